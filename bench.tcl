@@ -0,0 +1,604 @@
+#! /usr/bin/env tclsh
+# Benchmarks for tcl-duktape.
+# Copyright (c) 2026
+# D. Bohdan and contributors listed in AUTHORS
+# This code is released under the terms of the MIT license. See the file
+# LICENSE for details.
+
+namespace eval ::duktape::bench {
+    variable path [pwd]
+    variable iterations 10000
+    variable format text
+    variable match *
+
+    lappend ::auto_path $path
+    package require duktape
+
+    # Only heaps created with -stats count their allocations, so create every
+    # heap the benchmarks use that way, including those of pools and TclOO
+    # objects.
+    rename ::duktape::init ::duktape::bench::init
+    proc ::duktape::init args {
+        tailcall ::duktape::bench::init -stats true {*}$args
+    }
+
+    foreach {option value} $argv {
+        switch -- $option {
+            -format {
+                if {$value ni {json text}} {
+                    error "unknown format \"$value\"; must be json or text"
+                }
+                set format $value
+            }
+            -iterations {
+                set iterations $value
+            }
+            -match {
+                set match $value
+            }
+            default {
+                error "unknown option \"$option\";\
+                       must be -format, -iterations or -match"
+            }
+        }
+    }
+
+    # Run $script $iterations times at uplevel 1 and report the throughput,
+    # the mean time per run and how much the Duktape heaps of the
+    # interpreter allocated per run.  Cases whose names don't match the
+    # -match pattern are skipped.
+    proc bench {name script} {
+        variable format
+        variable iterations
+        variable match
+
+        if {![string match $match $name]} return
+
+        set before [::duktape::heap-stats]
+        set usPerOp [lindex [uplevel 1 [list time $script $iterations]] 0]
+        set after [::duktape::heap-stats]
+
+        set nsPerOp [expr {$usPerOp * 1000.0}]
+        set opsPerSec [expr {$usPerOp > 0 ? 1e6 / $usPerOp : 0.0}]
+        set bytesPerOp [expr {
+            double([dict get $after bytes] - [dict get $before bytes])
+            / $iterations
+        }]
+        set allocsPerOp [expr {
+            double([dict get $after allocations]
+                   - [dict get $before allocations])
+            / $iterations
+        }]
+
+        if {$format eq {json}} {
+            set template [join {
+                {"name":"%s"} {"iterations":%d} {"ops_per_sec":%.1f}
+                {"ns_per_op":%.1f} {"bytes_per_op":%.1f}
+                {"allocs_per_op":%.2f}
+            } ,]
+            puts [format \{$template\} \
+                    [string map {\\ \\\\ \" \\\"} $name] $iterations \
+                    $opsPerSec $nsPerOp $bytesPerOp $allocsPerOp]
+        } else {
+            puts [format {%-44s %12.0f ops/s %12.1f ns/op %11.1f B/op\
+                          %8.2f allocs/op} \
+                    $name $opsPerSec $nsPerOp $bytesPerOp $allocsPerOp]
+        }
+    }
+
+    # Heap lifetime.
+
+    foreach allocator {default pool} {
+        bench "init/close ($allocator allocator)" {
+            ::duktape::close [::duktape::init -allocator $allocator]
+        }
+    }
+
+    set id [::duktape::init]
+    bench {detach + attach} {
+        set id [::duktape::attach [::duktape::detach $id]]
+    }
+    ::duktape::close $id
+
+    # Evaluating and running code.
+
+    set snippet {
+        var total = 0;
+        for (var i = 0; i < 10; i++) {
+            total += i * i;
+        }
+        total;
+    }
+
+    set large {}
+    for {set i 0} {$i < 200} {incr i} {
+        append large [format {
+            function f%1$d(x) {
+                var s = 'f%1$d';
+                for (var j = 0; j < x; j++) {
+                    s += String.fromCharCode(97 + (j + %1$d) %% 26);
+                }
+                return {name: s, length: s.length, index: %1$d};
+            }
+        } $i]
+    }
+    append large {f199(3).length;}
+
+    set id [::duktape::init]
+
+    bench {eval small script} {
+        ::duktape::eval $id $snippet
+    }
+
+    bench "eval large script ([string length $large] bytes)" {
+        ::duktape::eval $id $large
+    }
+
+    set compiled [::duktape::compile $id $snippet]
+    bench {run compiled small script} {
+        ::duktape::run $id $compiled
+    }
+    unset compiled
+
+    # Calling JavaScript from Tcl.
+
+    ::duktape::eval $id {
+        var counter = {
+            n: 0,
+            add: function(x) {
+                this.n += x;
+                return this.n;
+            }
+        };
+        function concat(a, b) {
+            return a + b;
+        }
+        function add(a, b) {
+            return a + b;
+        }
+    }
+
+    bench {call} {
+        ::duktape::call $id concat foo bar
+    }
+
+    bench {call-str} {
+        ::duktape::call-str $id concat foo bar
+    }
+
+    bench {call-num} {
+        ::duktape::call-num $id add 1 2
+    }
+
+    bench {call-method} {
+        ::duktape::call-method $id counter.add counter {1 number}
+    }
+
+    set tuples {}
+    for {set i 0} {$i < 100} {incr i} {
+        lappend tuples [list $i 1]
+    }
+    bench {call-num x 100} {
+        foreach tuple $tuples {
+            ::duktape::call-num $id add {*}$tuple
+        }
+    }
+    bench {call-batch 100 tuples} {
+        ::duktape::call-batch $id add $tuples -types {number number}
+    }
+
+    set add [::duktape::bind $id counter.add counter number]
+    bench {bound method} {
+        $add 1
+    }
+
+    # Calling Tcl from JavaScript.
+
+    ::duktape::tcl-function $id tclAdd integer {a b} {
+        expr {$a + $b}
+    }
+    set compiled [::duktape::compile $id {tclAdd(1, 2)}]
+    bench {tcl-function callback} {
+        ::duktape::run $id $compiled
+    }
+    unset compiled
+
+    ::duktape::tcl-function $id tclFormat {x} {
+        set parts {}
+        foreach {key value} [list id $x square [expr {$x * $x}]] {
+            lappend parts [format %s=%s $key $value]
+        }
+        if {$x % 2 == 0} {
+            lappend parts even
+        } else {
+            lappend parts odd
+        }
+        return [join $parts ,]
+    }
+    set compiled [::duktape::compile $id {tclFormat(7)}]
+    bench {tcl-function callback (10-line body)} {
+        ::duktape::run $id $compiled
+    }
+    unset compiled
+
+    ::duktape::tcl-command $id tclLength {string length} integer
+    set compiled [::duktape::compile $id {tclLength('abc')}]
+    bench {tcl-command callback} {
+        ::duktape::run $id $compiled
+    }
+    unset compiled
+
+    set unsafe [::duktape::init -safe false]
+    set compiled [::duktape::compile $unsafe {
+        Duktape.tcl.eval('list', 'a', 1, true);
+    }]
+    bench {Duktape.tcl.eval} {
+        ::duktape::run $unsafe $compiled
+    }
+    unset compiled
+
+    # Numeric Tcl results: parsing strings vs. converting by internal type.
+    proc ::benchNumbers {} {
+        lmap i [lrepeat 50 1] {expr {$i * 1.5}}
+    }
+    set compiled [::duktape::compile $unsafe {
+        Duktape.tcl.eval('::benchNumbers').split(' ').map(Number);
+    }]
+    bench {Duktape.tcl.eval (parse 50 numbers)} {
+        ::duktape::run $unsafe $compiled
+    }
+    unset compiled
+
+    set compiled [::duktape::compile $unsafe {
+        Duktape.tcl.call('::benchNumbers');
+    }]
+    bench {Duktape.tcl.call (50 numbers)} {
+        ::duktape::run $unsafe $compiled
+    }
+    unset compiled
+
+    # Reading a file from JavaScript in 4 KiB chunks.
+    set file [file join [pwd] bench.log]
+    set ch [open $file w]
+    for {set i 0} {$i < 10000} {incr i} {
+        puts $ch "line $i of the benchmark log file"
+    }
+    close $ch
+    ::duktape::eval $unsafe {
+        function evalRead(chan) {
+            var n = 0, chunk;
+            while ((chunk = Duktape.tcl.eval('read', chan, 4096)) !== '') {
+                n += chunk.length;
+            }
+            return n;
+        }
+        function channelRead(chan) {
+            var c = Duktape.tcl.channel(chan), n = 0, chunk;
+            while ((chunk = c.read(4096)).length > 0) {
+                n += chunk.length;
+            }
+            return n;
+        }
+    }
+    foreach function {evalRead channelRead} {
+        bench "$function [file size $file] bytes" {
+            set ch [open $file]
+            ::duktape::call-str $unsafe $function $ch
+            close $ch
+        }
+    }
+    file delete $file
+    ::duktape::close $unsafe
+
+    # Converting arrays and objects from JavaScript to Tcl.
+
+    ::duktape::eval $id {
+        var numbers = [];
+        for (var i = 0; i < 100; i++) {
+            numbers.push(i * 1.5);
+        }
+    }
+
+    foreach resultType {string native} {
+        bench "JS to Tcl: array of 100 ($resultType)" {
+            llength [::duktape::eval $id numbers -result $resultType]
+        }
+    }
+
+    ::duktape::eval $id {
+        var config = {};
+        for (var i = 0; i < 50; i++) {
+            config['section' + i] = {
+                enabled: i % 2 === 0,
+                size: i,
+                tags: ['a', 'b']
+            };
+        }
+    }
+
+    foreach resultType {json dict} {
+        bench "JS to Tcl: object of 50 ($resultType)" {
+            ::duktape::eval $id config -result $resultType
+        }
+    }
+
+    # Converting arrays and objects from Tcl to JavaScript.
+
+    set context {}
+    set pairs {}
+    for {set i 0} {$i < 100} {incr i} {
+        dict set context key$i $i
+        lappend pairs "\"key$i\":$i"
+    }
+    set contextJson \{[join $pairs ,]\}
+    ::duktape::tcl-function $id contextJson json {} [list return $contextJson]
+    ::duktape::tcl-function $id contextDict {dict integer} {} \
+            [list return $context]
+
+    foreach returnType {json dict} {
+        bench "Tcl to JS: object of 100 ($returnType)" [format {
+            ::duktape::eval $id {context%s().key99}
+        } [string totitle $returnType]]
+    }
+
+    set numbers {}
+    for {set i 0} {$i < 1000} {incr i} {
+        lappend numbers [expr {$i * 0.5}]
+    }
+    ::duktape::tcl-function $id numbers {array double} {} \
+            [list return $numbers]
+    bench {Tcl to JS: array of 1000 doubles} {
+        ::duktape::eval $id {numbers().length}
+    }
+
+    # Byte arrays and buffers.
+
+    set payload [string repeat [binary format cu* {1 2 3 4}] 262144]
+    ::duktape::eval $id {
+        function byteLength(buf) {
+            return buf.length;
+        }
+        var payload = new Uint8Array(1048576);
+    }
+    bench {call-method 1 MiB bytearray argument} {
+        ::duktape::call-method $id byteLength null [list $payload bytearray]
+    }
+    ::duktape::tcl-function $id payloadFromTcl bytearray {} {
+        return $::duktape::bench::payload
+    }
+    bench {tcl-function 1 MiB bytearray return} {
+        ::duktape::eval $id {payloadFromTcl().length}
+    }
+    bench {eval 1 MiB buffer result (native)} {
+        ::duktape::eval $id payload -result native
+    }
+
+    # JavaScript functions exported to Tcl as lambdas.
+
+    set compiled [::duktape::compile $id {
+        (function(x) { return x * 2; })
+    }]
+    bench {export lambda} {
+        ::duktape::run $id $compiled -result native
+    }
+    unset compiled
+
+    set compiled [::duktape::compile $id {
+        (function() {
+            var callbacks = [];
+            for (var i = 0; i < 100; i++) {
+                callbacks.push(function(x) { return x * 2; });
+            }
+            return callbacks;
+        })()
+    }]
+    bench {export 100 lambdas} {
+        ::duktape::run $id $compiled -result native
+    }
+    unset compiled
+
+    set double [::duktape::eval $id {
+        (function(x) { return x * 2; })
+    } -result native]
+    bench {eval-lambda} {
+        {*}$double 21
+    }
+    unset double
+
+    # Cases that "make bench-performance" speeds up.
+
+    ::duktape::eval $id {
+        function intLoop(n) {
+            var acc = 0;
+            for (var i = 0; i < n; i++) {
+                acc = (acc ^ (i << 3)) & 0xffff;
+            }
+            return acc;
+        }
+        var records = [];
+        for (var i = 0; i < 100; i++) {
+            records.push({id: i, name: 'record' + i, flags: [i & 1, i & 2]});
+        }
+        function internKeys(n) {
+            var o = {};
+            for (var i = 0; i < n; i++) {
+                o['k' + i] = i;
+            }
+            return Object.keys(o).length;
+        }
+    }
+    bench {integer loop (1000 iterations)} {
+        ::duktape::eval $id {intLoop(1000)}
+    }
+    bench {JSON.stringify 100 records} {
+        ::duktape::eval $id {JSON.stringify(records).length}
+    }
+    bench {intern 1000 property names} {
+        ::duktape::eval $id {internKeys(1000)}
+    }
+    set doc [::duktape::json parse $id \
+            [::duktape::eval $id {JSON.stringify(records)}]]
+    bench {json get in 100 records} {
+        ::duktape::json get $id $doc 50 flags 1
+    }
+    bench {json keys of 100 records} {
+        ::duktape::json keys $id $doc
+    }
+
+    # Loading a JSON file: reading it into Tcl versus streaming it.
+
+    set file [file join [pwd] bench.json]
+    set ch [open $file w]
+    puts $ch [::duktape::eval $id {
+        var big = [];
+        for (var i = 0; i < 10; i++) {
+            big = big.concat(records);
+        }
+        JSON.stringify(big);
+    }]
+    close $ch
+    bench {read + JSON.parse (1000 records)} {
+        set ch [open $file]
+        ::duktape::call $id {(function(s) { loaded = JSON.parse(s); })} \
+                [read $ch]
+        close $ch
+    }
+    bench {json-ingest (1000 records)} {
+        set ch [open $file]
+        ::duktape::json-ingest $id $ch loaded
+        close $ch
+    }
+    file delete $file
+
+    ::duktape::close $id
+
+    # Starting a heap with a library: evaluating its source versus
+    # preloading its bytecode.
+
+    set library {}
+    for {set i 0} {$i < 500} {incr i} {
+        append library [format {
+            function lib%1$d(items) {
+                return items.map(function(x) { return x + %1$d; });
+            }
+        } $i]
+    }
+    set bundle [file join [pwd] bench.bundle]
+    set id [::duktape::init]
+    ::duktape::dump-bundle $id $bundle $library
+    ::duktape::close $id
+
+    bench "init + eval library ([string length $library] bytes)" {
+        set id [::duktape::init]
+        ::duktape::eval $id $library
+        ::duktape::close $id
+    }
+    bench {init -preload library bundle} {
+        ::duktape::close [::duktape::init -preload $bundle]
+    }
+    file delete $bundle
+
+    set cache [file join [pwd] bench.cache]
+    file mkdir $cache
+    set script [file join $cache library.js]
+    set ch [open $script w]
+    puts -nonewline $ch $library
+    close $ch
+    bench {init + eval-file library} {
+        set id [::duktape::init]
+        ::duktape::eval-file $id $script
+        ::duktape::close $id
+    }
+    bench {init + eval-file library (code cache)} {
+        set id [::duktape::init -code-cache $cache]
+        ::duktape::eval-file $id $script
+        ::duktape::close $id
+    }
+    file delete -force $cache
+
+    # Heap pools.
+
+    set pool [::duktape::pool create -init $library]
+    foreach recycle {true false} {
+        bench "pool checkout + eval + checkin -recycle $recycle (library)" {
+            set id [::duktape::pool checkout $pool]
+            ::duktape::eval $id {var request = lib1([1, 2, 3]);}
+            ::duktape::pool checkin $pool $id -recycle $recycle
+        }
+    }
+    ::duktape::pool destroy $pool
+
+    # Parallel map.
+
+    set items {}
+    for {set i 0} {$i < 200} {incr i} {
+        lappend items $i
+    }
+    set init {
+        function work(x) {
+            var s = 0;
+            for (var j = 0; j < 1000; j++) {
+                s = (s + j * x) & 0xffff;
+            }
+            return s;
+        }
+    }
+    foreach threads {1 4} {
+        bench "parallel-map 200 items ($threads threads)" {
+            ::duktape::parallel-map -threads $threads -init $init work $items
+        }
+    }
+
+    # Allocators.
+
+    set objects {
+        var list = [];
+        for (var i = 0; i < 100; i++) {
+            list.push({index: i, name: 'item' + i});
+        }
+        list.length;
+    }
+
+    foreach allocator {default pool} {
+        set id [::duktape::init -allocator $allocator]
+        bench "allocate objects ($allocator allocator)" {
+            ::duktape::eval $id $objects
+        }
+        bench "reset ($allocator allocator)" {
+            ::duktape::reset $id
+        }
+        ::duktape::close $id
+    }
+
+    # The TclOO wrappers.
+
+    if {[catch {package require duktape::oo}]} return
+
+    set duktapeObj [::duktape::oo::Duktape new]
+    $duktapeObj eval {
+        function add(a, b) {
+            return a + b;
+        }
+    }
+    bench {OO eval} {
+        $duktapeObj eval {1 + 1}
+    }
+    bench {OO call-num} {
+        $duktapeObj call-num add 1 2
+    }
+
+    set json [::duktape::oo::JSON new $duktapeObj {
+        {"name": "bench", "nested": {"values": [1, 2, 3], "flag": true}}
+    }]
+    bench {OO JSON get} {
+        $json get nested flag
+    }
+    bench {OO JSON set} {
+        $json set nested name value
+    }
+    bench {OO JSON stringify} {
+        $json stringify
+    }
+    $json destroy
+    $duktapeObj destroy
+}
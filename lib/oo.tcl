@@ -12,9 +12,9 @@ namespace eval ::duktape::oo {}
 ::oo::class create ::duktape::oo::Duktape {
     variable id
 
-    constructor {{_debug 0}} {
+    constructor {{_debug 0} args} {
         my variable debug
-        set id [::duktape::init]
+        set id [::duktape::init {*}$args]
         set debug $_debug
     }
 
@@ -22,7 +22,7 @@ namespace eval ::duktape::oo {}
         ::duktape::close $id
     }
 
-    method eval {code} {
+    method eval {code args} {
         my variable debug
         if {$debug} {
             set printedCode $code
@@ -31,7 +31,7 @@ namespace eval ::duktape::oo {}
             }
             puts "evaluating code {$printedCode\n}"
         }
-        ::duktape::eval $id $code
+        ::duktape::eval $id $code {*}$args
     }
 
     method call-method args {
@@ -39,7 +39,8 @@ namespace eval ::duktape::oo {}
         if {$debug} {
             puts "calling method $args"
         }
-        ::duktape::call-method $id {*}$args
+        ::duktape::call-method {*}[::duktape::call-options args] -- $id \
+                {*}$args
     }
 
     method call args {
@@ -47,19 +48,45 @@ namespace eval ::duktape::oo {}
         if {$debug} {
             puts "calling function $args"
         }
-        ::duktape::call $id {*}$args
+        ::duktape::call {*}[::duktape::call-options args] -- $id {*}$args
     }
 
     foreach type $::duktape::types {
         method call-method-$type args [format {
-            ::duktape::call-method-%s $id {*}$args
+            ::duktape::call-method-%1$s {*}[::duktape::call-options args] \
+                    -- $id {*}$args
         } $type]
 
         method call-$type args [format {
-            ::duktape::call-%s $id {*}$args
+            ::duktape::call-%1$s {*}[::duktape::call-options args] \
+                    -- $id {*}$args
         } $type]
     }
 
+    method call-batch args {
+        ::duktape::call-batch $id {*}$args
+    }
+
+    method compile args {
+        ::duktape::compile $id {*}$args
+    }
+
+    method run {handle args} {
+        ::duktape::run $id $handle {*}$args
+    }
+
+    method eval-file {file args} {
+        ::duktape::eval-file $id $file {*}$args
+    }
+
+    method reset {} {
+        ::duktape::reset $id
+    }
+
+    method bind args {
+        ::duktape::bind $id {*}$args
+    }
+
     method js-proc {name arguments body} {
         uplevel 1 ::duktape::js-proc [list $id] [list $name] [list $arguments] \
                 [list $body]
@@ -81,128 +108,43 @@ namespace eval ::duktape::oo {}
     }
 }
 
-# JSON object.
+# JSON object.  The document is kept in the heap by ::duktape::json.
 ::oo::class create ::duktape::oo::JSON {
+    variable token
+    variable document
+
     constructor {duktapeInterp json} {
-        my variable d
-        my variable jsonId
-        set d $duktapeInterp
-        $d eval {
-            if (typeof jsonStorage !== 'object') {
-                jsonStorage = {};
-                jsonStorage.create = function() {
-                    that = {};
-                    that.count = 0;
-                    that.data = {};
-
-                    that.init = function(literal) {
-                        that.count++;
-                        var id = that.count;
-                        that.data[id] = JSON.parse(literal);
-                        return id;
-                    };
-
-                    that._keyError = function(pathList, from, to, i) {
-                        throw "key " + pathList[i] + " in sequence {" +
-                                Array.prototype.join.apply(
-                                        Array.prototype.slice.apply(pathList,
-                                                [from, to]),
-                                                [' ']) + "} isn't an object";
-                    }
-
-                    that._manipulatePath = function(id, pathList, from, to,
-                            set, newValue) {
-                        var currentPath = that.data[id];
-                        var set = set || false;
-                        for (var i = from; i < to - 1; i++) {
-                            if (typeof currentPath[pathList[i]] !== 'object') {
-                                if (set) {
-                                    currentPath[[pathList[i]]] = {};
-                                } else {
-                                    that._keyError(pathList, from, to, i);
-                                };
-                            };
-                            currentPath = currentPath[pathList[i]];
-                        };
-                        if (set) {
-                            currentPath[pathList[to - 1]] = newValue;
-                        };
-                        return currentPath[pathList[to - 1]];
-                    };
-
-                    that.get = function(id) {
-                        return that._manipulatePath(id, arguments, 1,
-                                arguments.length, false);
-                    };
-
-                    that.getJson = function(id) {
-                        if (arguments.length > 1) {
-                            var result = that.get.apply(that, arguments);
-                        } else {
-                            var result = that.data[id];
-                        };
-                        return JSON.stringify(result);
-                    };
-
-                    that.set = function(id) {
-                        var value = arguments[arguments.length - 1];
-                        that._manipulatePath(id, arguments, 1,
-                                arguments.length - 1, true, value);
-                        return "";
-                    };
-
-                    that.setJson = function(id) {
-                        var value = JSON.parse(arguments[arguments.length - 1]);
-                        if (arguments.length > 2) {
-                            that._manipulatePath(id, arguments, 1,
-                                    arguments.length - 1, true, value);
-                        } else {
-                            that.data[id] = value;
-                        };
-                        return "";
-                    };
-
-                    that.destroy = function(id) {
-                        delete that.data[id];
-                        // Do not decrement count.
-                        return;
-                    };
-
-                    return that;
-                };
-
-                json_data = jsonStorage.create();
-            };
-        }
-        set jsonId [$d call json_data.init [list $json str]]
+        set token [$duktapeInterp token]
+        set document [::duktape::json parse $token $json]
+    }
+
+    destructor {
+        # The heap may already be closed.
+        catch {::duktape::json destroy $token $document}
     }
 
     method get args {
-        my variable d
-        my variable jsonId
-        set result [$d call-str json_data.get $jsonId {*}$args]
-        if {$result eq "undefined"} {
-            error "can't access key $args"
-        }
-        return $result
+        ::duktape::json get $token $document {*}$args
     }
 
     method get-json args {
-        my variable d
-        my variable jsonId
-        $d call-str json_data.getJson $jsonId {*}$args
+        ::duktape::json stringify $token $document {*}$args
     }
 
     method set args {
-        my variable d
-        my variable jsonId
-        $d call-str json_data.set $jsonId {*}$args
+        ::duktape::json set $token $document {*}$args
     }
 
     method set-json args {
-        my variable d
-        my variable jsonId
-        $d call-str json_data.setJson $jsonId {*}$args
+        ::duktape::json set-json $token $document {*}$args
+    }
+
+    method exists args {
+        ::duktape::json exists $token $document {*}$args
+    }
+
+    method keys args {
+        ::duktape::json keys $token $document {*}$args
     }
 
     method stringify {} {
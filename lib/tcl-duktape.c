@@ -5,6 +5,7 @@
  * This code is released under the terms of the MIT license. See the file
  * LICENSE for details.
  */
+#include <sys/stat.h>
 #include <tcl.h>
 #include "duktape.h"
 
@@ -26,7 +27,23 @@
 #define EVAL "::eval"
 #define EVAL_LAMBDA "::eval-lambda"
 #define TCL_FUNCTION "::tcl-function"
+#define TCL_COMMAND "::tcl-command"
 #define CALL_METHOD "::call-method"
+#define CALL_BATCH "::call-batch"
+#define COMPILE "::compile"
+#define RUN "::run"
+#define BIND "::bind"
+#define BOUND "::bound"
+#define RESET "::reset"
+#define HEAP_STATS "::heap-stats"
+#define DUMP_BUNDLE "::dump-bundle"
+#define BASELINE "::baseline"
+#define RESTORE_BASELINE "::restore-baseline"
+#define PARALLEL_MAP "::parallel-map"
+#define DETACH "::detach"
+#define ATTACH "::attach"
+#define JSON "::json"
+#define JSON_INGEST "::json-ingest"
 
 /* Error messages. */
 
@@ -36,58 +53,775 @@
 #define ERROR_INVALID_INSTANCE "unable to locate instance"
 #define ERROR_INVALID_INTERP "unable to locate interp"
 #define ERROR_INVALID_STRING "unable to convert argument to string"
-#define ERROR_INVALID_TYPE "unable to convert argument to invalid type %s"
 #define ERROR_INTERNAL_ARGS_ERROR "internal error: negative arguments?"
 #define ERROR_INTERNAL_TCL_LAPPEND "internal error: lappend failed?"
 #define ERROR_NOT_ALLOWED "action not permitted while safe"
+#define ERROR_HANDLE "can't parse handle"
+#define ERROR_NOT_CALLABLE "method is not callable"
+#define ERROR_OPTION_VALUE "value for \"%s\" missing"
+#define ERROR_NEGATIVE "expected a non-negative integer but got \"%s\""
+#define ERROR_ARENA_SIZE "arena size must be at least %d bytes"
+#define ERROR_BUNDLE \
+    "\"%s\" is not a bytecode bundle for this build of tcl-duktape"
+#define ERROR_PRELOAD "error running preloaded bundle: %s"
+#define ERROR_READ "error reading \"%s\": %s"
+#define ERROR_WRITE "error writing \"%s\": %s"
+#define ERROR_CODE_CACHE "code cache \"%s\" is not a directory"
+#define ERROR_NO_BASELINE "heap has no baseline"
+#define ERROR_POSITIVE "expected a positive integer but got \"%s\""
+#define ERROR_MAP_ITEM "error mapping item %d: %s"
+#define ERROR_MAP_RESULT "parallel-map can't return %s results"
+#define ERROR_BUSY "heap is running code"
+#define ERROR_DETACHED "no detached heap \"%s\""
+#define ERROR_COMMAND "invalid command name \"%s\""
+#define ERROR_JSON_DOCUMENT "no JSON document \"%s\""
+#define ERROR_JSON_ROOT "JSON document isn't an object"
+#define ERROR_JSON_KEY "key %s in sequence {%s} isn't an object"
+#define ERROR_JSON_MISSING "can't access key %s"
+#define ERROR_CHANNEL_READABLE "channel \"%s\" wasn't opened for reading"
+#define ERROR_CHANNEL_WRITABLE "channel \"%s\" wasn't opened for writing"
+#define ERROR_CHANNEL_BLOCKED "channel \"%s\" is nonblocking"
+#define ERROR_INGEST_TRAILING "invalid json (data after the end of the array)"
+#define ERROR_INGEST_END "invalid json (unexpected end of input)"
+#define ERROR_INGEST_NESTING "invalid json (mismatched brackets)"
+#define ERROR_CALL_COMMAND "no command to call"
+#define ERROR_LAMBDA "lambda refers to a function that is gone"
 
 /* Usage. */
 
-#define USAGE_INIT "?-safe <boolean>?"
+#define USAGE_INIT "?-safe <boolean>? ?-allocator default|pool? ?-arena size?" \
+    " ?-eval-args string|native|dict? ?-timeout ms? ?-budget count?" \
+    " ?-preload file? ?-code-cache dir? ?-stats <boolean>?"
 #define USAGE_MAKE_SAFE "token"
 #define USAGE_MAKE_UNSAFE "token"
 #define USAGE_CLOSE "token"
-#define USAGE_EVAL "token code"
+#define USAGE_EVAL \
+    "token code ?-result type? ?-timeout ms? ?-budget count?"
 #define USAGE_EVAL_LAMBDA "token bytecode lambdaHandle args"
 #define USAGE_TCL_FUNCTION "token name ?returnType? args body"
-#define USAGE_CALL_METHOD "token method this ?{arg ?type?}? ..."
+#define USAGE_TCL_COMMAND "token jsName tclCommand ?returnType? ?argTypes?"
+#define USAGE_CALL_METHOD \
+    "?-result type? ?-timeout ms? ?-budget count? ?--? token method this" \
+    " ?{arg ?type?}? ..."
+#define USAGE_CALL_BATCH \
+    "token function argTupleList ?-types {?type ...?}? ?-errors stop|collect?" \
+    " ?-result type? ?-timeout ms? ?-budget count?"
+#define USAGE_COMPILE "token code ?-filename name?"
+#define USAGE_RUN \
+    "token handle ?-result type? ?-timeout ms? ?-budget count?"
+#define USAGE_BIND "token method this {?type ...?} ?returnType?"
+#define USAGE_RESET "token"
+#define USAGE_HEAP_STATS "?token?"
+#define USAGE_DUMP_BUNDLE "token file script"
+#define USAGE_BASELINE "token"
+#define USAGE_RESTORE_BASELINE "token"
+#define USAGE_PARALLEL_MAP \
+    "?-threads count? ?-init script? ?-chunk size? ?-result type? ?--?" \
+    " function items ?-option value ...?"
+#define USAGE_DETACH "token"
+#define USAGE_ATTACH "handle"
+#define USAGE_JSON "subcommand token ?arg ...?"
+#define USAGE_JSON_INGEST "token channel target ?-ndjson? ?-chunk size?"
+
+/* Pool allocator size classes: ARENA_MIN_CLASS << n for n < ARENA_CLASSES. */
+
+#define ARENA_MIN_CLASS 16
+#define ARENA_CLASSES 9
+#define ARENA_LARGE ARENA_CLASSES
+#define ARENA_DEFAULT_SIZE 65536
+#define ARENA_MIN_SIZE 8192
+
+/* Prefix of the handles of detached heaps. */
+
+#define DETACHED_PREFIX "duktape-detached-"
+
+/* Number of characters json-ingest reads from its channel at a time. */
+#define INGEST_DEFAULT_CHUNK 65536
+
+/*
+ * Bytes channel.read() asks for first; each further read asks for as much
+ * as it already has, up to the size the caller requested.
+ */
+#define CHANNEL_READ_CHUNK 65536
+
+/* Arguments of tcl-command functions that fit in an array on the stack. */
+#define COMMAND_STATIC_ARGS 8
+
+/* Whitespace allowed between JSON tokens. */
+#define JSON_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+
+/* Prefix of the string representation of a compiled handle. */
+
+#define COMPILED_PREFIX "duktape-bytecode"
+
+/* Prefix of the names lambdas refer to exported functions by. */
+
+#define LAMBDA_PREFIX "lambda_"
+
+/*
+ * Bytecode is only valid for the Duktape version and configuration that
+ * produced it, so bundles start with a line that names both.
+ */
+#if defined(TCLDUK_PERFORMANCE)
+#define BYTECODE_PROFILE "performance"
+#else
+#define BYTECODE_PROFILE "default"
+#endif
+#define BUNDLE_HEADER "tcl-duktape bundle %ld " BYTECODE_PROFILE "\n"
+
+/* 64-bit FNV-1a, which names the files of code caches. */
+#define FNV_OFFSET_BASIS ((Tcl_WideUInt) 14695981039346656037ULL)
+#define FNV_PRIME ((Tcl_WideUInt) 1099511628211ULL)
 
 /* Data types. */
 
+/*
+ * Allocation counters of a heap.  bytes is the total size requested from
+ * the allocator, including reallocations, not the amount currently in use.
+ */
+struct DuktapeHeapStats {
+    Tcl_WideInt allocations;
+    Tcl_WideInt bytes;
+};
+
 struct DuktapeData
 {
     int counter;
+    int boundCounter;
     Tcl_HashTable table;
+    /* Counters of the heaps that have been closed */
+    struct DuktapeHeapStats closedStats;
+};
+
+struct DuktapeBoundData;
+
+/*
+ * Allocations from the pool allocator are preceded by a header whose last
+ * field is the size class.  Small allocations are carved from blocks and
+ * recycled through per-class free lists; large ones are kept in a list.
+ */
+struct DuktapeArenaSmall {
+    size_t pad;
+    size_t sizeClass;
+};
+
+struct DuktapeArenaLarge {
+    struct DuktapeArenaLarge *prev;
+    struct DuktapeArenaLarge *next;
+    size_t size;
+    size_t sizeClass;
+};
+
+struct DuktapeArenaBlock {
+    struct DuktapeArenaBlock *next;
+    size_t pad;
+};
+
+struct DuktapeArena {
+    size_t blockSize;
+    struct DuktapeArenaBlock *blocks;
+    char *top;
+    char *end;
+    void *freeLists[ARENA_CLASSES];
+    struct DuktapeArenaLarge *large;
+};
+
+/*
+ * Execution limits of the call running in a heap.  expired is set to one of
+ * LIMIT_TIMEOUT or LIMIT_BUDGET once a limit is hit.
+ */
+struct DuktapeLimits {
+    int hasDeadline;
+    Tcl_Time deadline;
+    int hasBudget;
+    Tcl_WideInt budget;
+    int expired;
 };
 
 struct DuktapeInstanceData {
+    int refCount;
+    size_t generation;
     Tcl_Interp *interp;
     Tcl_Obj *handle;
     duk_context *ctx;
     struct DuktapeData *cdata;
     int isUnsafe;
-    int lambdaCount;
+    int evalArgFlags;
+    unsigned int lambdaCount;
+    /* Distinguishes the lambda names of this heap from those of others */
+    unsigned int lambdaSalt;
+    struct DuktapeBoundData *bound;
+    struct DuktapeArena *arena;
+    Tcl_HashTable types;
+    Tcl_WideInt defaultTimeout;
+    Tcl_WideInt defaultBudget;
+    struct DuktapeLimits limits;
+    /* Whether the heap counts its allocations in stats */
+    int countAllocations;
+    struct DuktapeHeapStats stats;
+    /* Bytecode run in every new heap of the instance or NULL */
+    Tcl_Obj *preload;
+    /* Directory compile keeps bytecode in or NULL */
+    Tcl_Obj *codeCache;
+    /* Number of calls running in the heap */
+    int running;
+    /* Number of JSON documents parsed in the heap */
+    int jsonCount;
+    /* The {apply lambda} prefixes of the tcl-function functions */
+    Tcl_HashTable lambdas;
+    /* The commands of the tcl-command functions */
+    Tcl_HashTable commands;
+    /* The functions exported to Tcl as lambdas, by serial number */
+    Tcl_HashTable exports;
+    /* Freed lambdas whose names may still be in use */
+    struct DuktapeLambdaInstanceData *orphans;
 };
 
 struct DuktapeLambdaInstanceData {
     int refCount;
-    struct DuktapeData *cdata;
+    struct DuktapeInstanceData *instanceData;
+    /* The generation of the instance and its token when it was exported */
+    size_t generation;
     Tcl_Obj *handle;
-    Tcl_Obj *lambdaName;
+    unsigned int serial;
+    duk_uarridx_t slot;
+    /* The base64-encoded bytecode or NULL until it is needed */
+    Tcl_Obj *bytecode;
+    /* Whether the name has been put in a string rep */
+    int named;
+    struct DuktapeLambdaInstanceData *next;
+};
+
+struct DuktapeCompiledData {
+    int refCount;
+    struct DuktapeInstanceData *instanceData;
+    size_t generation;
+    duk_uarridx_t slot;
     Tcl_Obj *bytecode;
 };
 
+struct DuktapeCommandData {
+    struct DuktapeInstanceData *instanceData;
+    /* The fully qualified name of the command */
+    Tcl_Obj *name;
+    /* The words that follow the name in the command prefix */
+    Tcl_Obj *words;
+    /* The traced command or NULL if it has to be looked up */
+    Tcl_Command token;
+    Tcl_Obj *returnType;
+    Tcl_Size numArgTypes;
+    int *argFlags;
+};
+
+struct DuktapeBoundData {
+    struct DuktapeInstanceData *instanceData;
+    struct DuktapeBoundData *prev;
+    struct DuktapeBoundData *next;
+    Tcl_Command command;
+    duk_uarridx_t methodSlot;
+    duk_uarridx_t thisSlot;
+    int resultType;
+    Tcl_Size numArgs;
+    int *argTypes;
+    Tcl_Obj *signature;
+};
+
+/*
+ * Tcl byte arrays lent to JavaScript as external buffers for the length of
+ * a call.  The Tcl values are held in the list values.  Every buffer is also
+ * kept on the stack from base up so it can be detached after the call.
+ */
+struct DuktapeLoans {
+    duk_idx_t base;
+    Tcl_Obj *values;
+};
+
+struct DuktapeType {
+    int refCount;
+    int type;
+    struct DuktapeType *item;
+    Tcl_HashTable *keys;
+};
+
+/* A timeout or budget of -1 stands for the heap's default. */
+struct DuktapeCallOptions {
+    int resultType;
+    Tcl_WideInt timeout;
+    Tcl_WideInt budget;
+};
+
+/* The limits of the calling code saved while a call runs with its own. */
+struct DuktapeLimitsFrame {
+    struct DuktapeLimits saved;
+    Tcl_WideInt budget;
+};
+
+struct DuktapeConversion {
+    int flags;
+    Tcl_Obj *obj;
+};
+
+/*
+ * The work of a parallel-map call, shared by its worker threads.  Workers
+ * take chunks of items from next under the mutex and store the result of
+ * item i in results[i] as a string the calling thread turns into a Tcl
+ * value, so no Tcl_Obj crosses threads.  Their heaps belong to no instance,
+ * so only result types that are strings can be made in them.  The first
+ * error stops them all.
+ */
+struct DuktapeParallelMap {
+    Tcl_Mutex mutex;
+    const char *init;
+    Tcl_Size initLength;
+    const char *function;
+    Tcl_Size functionLength;
+    int resultType;
+    Tcl_Size count;
+    const char **items;
+    Tcl_Size *itemLengths;
+    char **results;
+    Tcl_Size *resultLengths;
+    Tcl_Size chunk;
+    Tcl_Size next;
+    char *error;
+};
+
+/*
+ * An operation of the json command on the document doc and the value the
+ * keys in path lead to.  badKey is set to the number of keys after which
+ * the walk reached a value that isn't an object, or -1.
+ */
+struct DuktapeJson {
+    int subcommand;
+    duk_uarridx_t doc;
+    Tcl_Size pathLength;
+    Tcl_Obj *const *path;
+    Tcl_Obj *value;
+    int missing;
+    Tcl_Size badKey;
+    Tcl_Obj *keys;
+};
+
+/* What json-ingest is reading. */
+enum ingestModes {
+    INGEST_START,
+    INGEST_ARRAY,
+    INGEST_WHOLE,
+    INGEST_NDJSON,
+    INGEST_DONE
+};
+
+/*
+ * The state of a json-ingest call between chunks.  The text of the value
+ * being read is collected in the first used bytes of a dynamic buffer at
+ * base; the value at base + 1 is the array the elements go into, the
+ * callback of the records or the whole document.  depth, inString and
+ * escape follow the nesting of the array.
+ */
+struct DuktapeIngest {
+    int mode;
+    const char *chunk;
+    Tcl_Size chunkLength;
+    int eof;
+    duk_idx_t base;
+    duk_size_t used;
+    int depth;
+    int inString;
+    int escape;
+    Tcl_WideInt count;
+};
+
+/* Argument types of call-method and bound functions. */
+
+static const char *callArgTypes[] = {
+    "boolean",
+    "bytearray",
+    "nan",
+    "null",
+    "number",
+    "string",
+    "undefined",
+    (char *)NULL
+};
+enum callArgTypes {
+    TYPE_BOOLEAN,
+    TYPE_BYTEARRAY,
+    TYPE_NAN,
+    TYPE_NULL,
+    TYPE_NUMBER,
+    TYPE_STRING,
+    TYPE_UNDEFINED
+};
+
+/* Ways to convert the result of a call to Tcl. */
+
+static const char *resultTypes[] = {
+    "dict",
+    "json",
+    "native",
+    "string",
+    "undefined",
+    (char *)NULL
+};
+enum resultTypes {
+    RESULT_DICT,
+    RESULT_JSON,
+    RESULT_NATIVE,
+    RESULT_STRING,
+    RESULT_UNDEFINED
+};
+
+/* Types of Tcl values converted to JavaScript by Tclduk_TclToJS. */
+
+static const char *valueTypes[] = {
+    "array",
+    "auto",
+    "bigint",
+    "boolean",
+    "bytearray",
+    "dict",
+    "dict-of",
+    "double",
+    "integer",
+    "json",
+    "list-of-dict",
+    "null",
+    "string",
+    "undefined",
+    (char *)NULL
+};
+enum valueTypes {
+    VALUE_ARRAY,
+    VALUE_AUTO,
+    VALUE_BIGINT,
+    VALUE_BOOLEAN,
+    VALUE_BYTEARRAY,
+    VALUE_DICT,
+    VALUE_DICT_OF,
+    VALUE_DOUBLE,
+    VALUE_INTEGER,
+    VALUE_JSON,
+    VALUE_LIST_OF_DICT,
+    VALUE_NULL,
+    VALUE_STRING,
+    VALUE_UNDEFINED
+};
+
+/* Flags for Tclduk_JSToTcl */
+#define JSTOTCL_NATIVE 1
+#define JSTOTCL_DICT 2
+#define JSTOTCL_MAX_DEPTH 1000
+
+/* Nesting beyond which the "auto" value type converts lists to strings */
+#define TCLTOJS_MAX_DEPTH 1000
+
+/*
+ * The Tcl types that the "auto" value type recognizes.  They are looked up
+ * when the extension is loaded; a type this version of Tcl lacks is NULL.
+ */
+static struct {
+    const Tcl_ObjType *intType;
+    const Tcl_ObjType *wideIntType;
+    const Tcl_ObjType *doubleType;
+    const Tcl_ObjType *booleanType;
+    const Tcl_ObjType *booleanStringType;
+    const Tcl_ObjType *byteArrayType;
+    const Tcl_ObjType *listType;
+    const Tcl_ObjType *dictType;
+} tclTypes;
+
+/* Options of eval, run and call-method. */
+
+static const char *callOptions[] = {
+    "-budget",
+    "-result",
+    "-timeout",
+    (char *)NULL
+};
+enum callOptions {
+    CALL_OPTION_BUDGET,
+    CALL_OPTION_RESULT,
+    CALL_OPTION_TIMEOUT
+};
+
+/* Conversions of Duktape.tcl.eval and tcl-command arguments and their flags */
+
+static const char *evalArgTypes[] = {
+    "string",
+    "native",
+    "dict",
+    (char *)NULL
+};
+static const int evalArgFlags[] = {
+    0,
+    JSTOTCL_NATIVE,
+    JSTOTCL_NATIVE | JSTOTCL_DICT
+};
+
+/* Options of call-batch. */
+
+static const char *batchOptions[] = {
+    "-budget",
+    "-errors",
+    "-result",
+    "-timeout",
+    "-types",
+    (char *)NULL
+};
+enum batchOptions {
+    BATCH_OPTION_BUDGET,
+    BATCH_OPTION_ERRORS,
+    BATCH_OPTION_RESULT,
+    BATCH_OPTION_TIMEOUT,
+    BATCH_OPTION_TYPES
+};
+
+/* What call-batch does when a call fails. */
+
+static const char *batchErrorModes[] = {
+    "collect",
+    "stop",
+    (char *)NULL
+};
+enum batchErrorModes {
+    BATCH_ERRORS_COLLECT,
+    BATCH_ERRORS_STOP
+};
+
+/* Options of parallel-map. */
+
+static const char *parallelMapOptions[] = {
+    "-chunk",
+    "-init",
+    "-result",
+    "-threads",
+    (char *)NULL
+};
+enum parallelMapOptions {
+    MAP_OPTION_CHUNK,
+    MAP_OPTION_INIT,
+    MAP_OPTION_RESULT,
+    MAP_OPTION_THREADS
+};
+
+/* Subcommands of json and the arguments they take after the token. */
+
+static const char *jsonSubcommands[] = {
+    "destroy",
+    "exists",
+    "get",
+    "keys",
+    "parse",
+    "set",
+    "set-json",
+    "stringify",
+    (char *)NULL
+};
+enum jsonSubcommands {
+    JSON_DESTROY,
+    JSON_EXISTS,
+    JSON_GET,
+    JSON_KEYS,
+    JSON_PARSE,
+    JSON_SET,
+    JSON_SET_JSON,
+    JSON_STRINGIFY
+};
+
+/* Options of json-ingest. */
+
+static const char *ingestOptions[] = {
+    "-chunk",
+    "-ndjson",
+    (char *)NULL
+};
+enum ingestOptions {
+    INGEST_OPTION_CHUNK,
+    INGEST_OPTION_NDJSON
+};
+
+static const char *jsonUsage[] = {
+    "token document",
+    "token document ?key ...?",
+    "token document ?key ...?",
+    "token document ?key ...?",
+    "token json",
+    "token document ?key ...? value",
+    "token document ?key ...? json",
+    "token document ?key ...?"
+};
+
+/* Why a call was interrupted. */
+#define LIMIT_TIMEOUT 1
+#define LIMIT_BUDGET 2
+
+/*
+ * The number of bytecode instructions between two calls to
+ * Tclduk_ExecTimeoutCheck.  Matches DUK_HTHREAD_INTCTR_DEFAULT in
+ * duktape.c.
+ */
+#define INTERRUPT_INTERVAL (256L * 1024L)
+
 #define DUKTCL_CDATA ((struct DuktapeData *) cdata)
 
 /* Functions */
 
-static duk_context *
-parse_id(ClientData cdata, Tcl_Interp *interp, Tcl_Obj *const idobj, int del)
+/*
+ * Heaps moved between interps with detach and attach wait in this table,
+ * keyed by their handles, until they are attached.  The mutex guards the
+ * table and the reference counts of instances, which objects in the
+ * interp a heap was detached from may still drop from another thread.
+ */
+TCL_DECLARE_MUTEX(instanceMutex)
+static Tcl_HashTable detachedTable;
+static int detachedTableReady = 0;
+static int detachedCounter = 0;
+
+static void Tclduk_InstanceRetain(struct DuktapeInstanceData *instanceData) {
+    Tcl_MutexLock(&instanceMutex);
+    instanceData->refCount++;
+    Tcl_MutexUnlock(&instanceMutex);
+}
+
+/*
+ * Instance data is reference counted so that Tcl objects may cache a
+ * pointer to it.  The hash table holds one reference for as long as the
+ * heap is open.
+ */
+static void Tclduk_InstanceRelease(struct DuktapeInstanceData *instanceData) {
+    Tcl_HashEntry *hashPtr;
+    Tcl_HashSearch search;
+    int refCount;
+
+    Tcl_MutexLock(&instanceMutex);
+    refCount = --instanceData->refCount;
+    Tcl_MutexUnlock(&instanceMutex);
+    if (refCount > 0) {
+        return;
+    }
+
+    for (hashPtr = Tcl_FirstHashEntry(&instanceData->types, &search);
+            hashPtr != NULL;
+            hashPtr = Tcl_NextHashEntry(&search)) {
+        Tcl_DecrRefCount((Tcl_Obj *) Tcl_GetHashValue(hashPtr));
+    }
+    Tcl_DeleteHashTable(&instanceData->types);
+    /* The heap and with it the lambdas and commands are gone by now */
+    Tcl_DeleteHashTable(&instanceData->lambdas);
+    Tcl_DeleteHashTable(&instanceData->commands);
+    Tcl_DeleteHashTable(&instanceData->exports);
+
+    Tcl_DecrRefCount(instanceData->handle);
+    if (instanceData->preload) {
+        Tcl_DecrRefCount(instanceData->preload);
+    }
+    if (instanceData->codeCache) {
+        Tcl_DecrRefCount(instanceData->codeCache);
+    }
+    if (instanceData->arena) {
+        ckfree(instanceData->arena);
+    }
+    ckfree(instanceData);
+}
+
+/*
+ * Tokens are kept as a custom Tcl Obj type which caches the instance
+ * they refer to along with the generation of the instance at the time of
+ * the lookup.  Closing the heap bumps the generation, which makes stale
+ * tokens go back to the hash table and fail there.
+ */
+static void Tclduk_TokenObjType_Free(Tcl_Obj *tokenObj) {
+    Tclduk_InstanceRelease(tokenObj->internalRep.twoPtrValue.ptr1);
+}
+
+static void Tclduk_TokenObjType_Dup(Tcl_Obj *src, Tcl_Obj *dest) {
+    struct DuktapeInstanceData *instanceData;
+
+    instanceData = src->internalRep.twoPtrValue.ptr1;
+    Tclduk_InstanceRetain(instanceData);
+
+    dest->internalRep.twoPtrValue.ptr1 = instanceData;
+    dest->internalRep.twoPtrValue.ptr2 = src->internalRep.twoPtrValue.ptr2;
+    dest->typePtr = src->typePtr;
+}
+
+static void Tclduk_TokenObjType_String(Tcl_Obj *tokenObj) {
+    struct DuktapeInstanceData *instanceData;
+    const char *stringRep;
+    Tcl_Size stringRepLength;
+
+    instanceData = tokenObj->internalRep.twoPtrValue.ptr1;
+
+    stringRep = Tcl_GetStringFromObj(instanceData->handle, &stringRepLength);
+    tokenObj->bytes = ckalloc(stringRepLength + 1);
+    memcpy(tokenObj->bytes, stringRep, stringRepLength + 1);
+    tokenObj->length = stringRepLength;
+}
+
+static Tcl_ObjType Tclduk_TokenObjType = {
+    "duktape_token" /* name */,
+    Tclduk_TokenObjType_Free,
+    Tclduk_TokenObjType_Dup,
+    Tclduk_TokenObjType_String,
+#ifdef TCL_OBJTYPE_V0
+    NULL,
+    TCL_OBJTYPE_V0
+#else
+    NULL
+#endif
+};
+
+static void Tclduk_TokenObjType_Set(
+    Tcl_Obj *tokenObj,
+    struct DuktapeInstanceData *instanceData
+)
+{
+    /* Make sure the string rep outlives the old internal rep */
+    Tcl_GetString(tokenObj);
+    if (tokenObj->typePtr && tokenObj->typePtr->freeIntRepProc) {
+        tokenObj->typePtr->freeIntRepProc(tokenObj);
+    }
+
+    Tclduk_InstanceRetain(instanceData);
+    tokenObj->internalRep.twoPtrValue.ptr1 = instanceData;
+    tokenObj->internalRep.twoPtrValue.ptr2 =
+            (void *) instanceData->generation;
+    tokenObj->typePtr = &Tclduk_TokenObjType;
+}
+
+/*
+ * Drop the cached instance from a token.  Used on the token the instance
+ * itself holds, which would otherwise keep the instance alive forever.
+ */
+static void Tclduk_TokenObjType_Reset(Tcl_Obj *tokenObj) {
+    if (tokenObj->typePtr != &Tclduk_TokenObjType) {
+        return;
+    }
+
+    tokenObj->typePtr = NULL;
+    Tclduk_InstanceRelease(tokenObj->internalRep.twoPtrValue.ptr1);
+}
+
+static struct DuktapeInstanceData *
+parse_instance(
+    ClientData cdata,
+    Tcl_Interp *interp,
+    Tcl_Obj *const idobj,
+    int del
+)
 {
     struct DuktapeInstanceData *instanceData;
-    duk_context *ctx;
     Tcl_HashEntry *hashPtr;
 
+    if (!del && idobj->typePtr == &Tclduk_TokenObjType) {
+        instanceData = idobj->internalRep.twoPtrValue.ptr1;
+        if (instanceData->cdata == cdata
+                && (void *) instanceData->generation
+                == idobj->internalRep.twoPtrValue.ptr2) {
+            return instanceData;
+        }
+    }
+
     hashPtr = Tcl_FindHashEntry(&DUKTCL_CDATA->table, Tcl_GetString(idobj));
     if (hashPtr == NULL) {
         if (interp) {
@@ -105,112 +839,297 @@ parse_id(ClientData cdata, Tcl_Interp *interp, Tcl_Obj *const idobj, int del)
         }
         return(NULL);
     }
-    ctx = instanceData->ctx;
     if (del) {
         Tcl_DeleteHashEntry(hashPtr);
-        Tcl_DecrRefCount(instanceData->handle);
-        ckfree(instanceData);
+        instanceData->generation++;
+        Tclduk_TokenObjType_Reset(instanceData->handle);
+        return instanceData;
     }
-    return ctx;
+    if (idobj != instanceData->handle) {
+        Tclduk_TokenObjType_Set(idobj, instanceData);
+    }
+    return instanceData;
 }
 
 /*
- * Deal with Duktape Lambdas using a custom Tcl Obj type which
- * we can use to free the lambda when the object goes away
+ * Look up the heap a token refers to.
  */
-/**
- ** Free a Duktape lambda object when the Tcl one is freed
- ** also free all the internal mechanisms required to get
- ** this far
- **/
-static void Tclduk_LambdaObjType_Free(Tcl_Obj *lambdaObj) {
-    struct DuktapeLambdaInstanceData *instanceData;
-    ClientData cdata;
-    Tcl_Obj *handle, *lambdaNameObj, *bytecode;
-    const char *lambdaName;
-    Tcl_Size lambdaNameLength;
-    duk_context *ctx;
-    int freeDukLambda;
-
-    instanceData = lambdaObj->internalRep.otherValuePtr;
+static duk_context *
+parse_id(ClientData cdata, Tcl_Interp *interp, Tcl_Obj *const idobj)
+{
+    struct DuktapeInstanceData *instanceData;
 
-    freeDukLambda = 1;
+    instanceData = parse_instance(cdata, interp, idobj, 0);
+    if (instanceData == NULL) {
+        return NULL;
+    }
+    return instanceData->ctx;
+}
 
-    instanceData->refCount--;
+/*
+ * Mark an instance unregistered with parse_instance() whose heap has been
+ * destroyed as closed and drop the reference the hash table held.
+ */
+static void Tclduk_InstanceClosed(struct DuktapeInstanceData *instanceData) {
+    instanceData->cdata->closedStats.allocations +=
+            instanceData->stats.allocations;
+    instanceData->cdata->closedStats.bytes += instanceData->stats.bytes;
+    instanceData->ctx = NULL;
+    Tclduk_InstanceRelease(instanceData);
+}
 
-    if (instanceData->refCount > 0) {
-        return;
+/*
+ * Keep JavaScript values that Tcl holds handles to reachable from the
+ * global stash.  Values live in the "pinned" array; element 0 is the head
+ * of a free list threaded through the unused slots.
+ */
+static void Tclduk_PushPinnedArray(duk_context *ctx) {
+    duk_push_global_stash(ctx);                        /* => ... [stash] */
+    if (!duk_get_prop_literal(ctx, -1, "pinned")) {    /* => ... [stash] [pinned|undefined] */
+        duk_pop(ctx);                                  /* => ... [stash] */
+        duk_push_array(ctx);                           /* => ... [stash] [pinned] */
+        duk_push_uint(ctx, 0);                         /* => ... [stash] [pinned] [0] */
+        duk_put_prop_index(ctx, -2, 0);                /* => ... [stash] [pinned] */
+        duk_dup_top(ctx);                              /* => ... [stash] [pinned] [pinned] */
+        duk_put_prop_literal(ctx, -3, "pinned");       /* => ... [stash] [pinned] */
     }
+    duk_remove(ctx, -2);                               /* => ... [pinned] */
+}
 
-    cdata         = instanceData->cdata;
-    lambdaNameObj = instanceData->lambdaName;
-    handle        = instanceData->handle;
-    bytecode      = instanceData->bytecode;
+/*
+ * Pin the value at idx.
+ * Return value: the slot number the value can be retrieved with.
+ */
+static duk_uarridx_t Tclduk_Pin(duk_context *ctx, duk_idx_t idx) {
+    duk_uarridx_t slot;
 
-    ckfree(instanceData);
+    idx = duk_normalize_index(ctx, idx);
+    Tclduk_PushPinnedArray(ctx);                       /* => ... [pinned] */
+    duk_get_prop_index(ctx, -1, 0);                    /* => ... [pinned] [head] */
+    slot = duk_get_uint(ctx, -1);
+    duk_pop(ctx);                                      /* => ... [pinned] */
+    if (slot) {
+        duk_get_prop_index(ctx, -1, slot);             /* => ... [pinned] [next] */
+        duk_put_prop_index(ctx, -2, 0);                /* => ... [pinned] */
+    } else {
+        slot = (duk_uarridx_t) duk_get_length(ctx, -1);
+    }
+    duk_dup(ctx, idx);                                 /* => ... [pinned] [value] */
+    duk_put_prop_index(ctx, -2, slot);                 /* => ... [pinned] */
+    duk_pop(ctx);                                      /* => ... */
 
-    Tcl_DecrRefCount(bytecode);
+    return(slot);
+}
 
-    /*
-     * Find the Duktape heap context from the handle
-     */
-    ctx = parse_id(cdata, NULL, handle, 0);
-    Tcl_DecrRefCount(handle);
-    if (ctx == NULL) {
-        Tcl_DecrRefCount(lambdaNameObj);
-        return;
-    }
+static void Tclduk_Unpin(duk_context *ctx, duk_uarridx_t slot) {
+    Tclduk_PushPinnedArray(ctx);                       /* => ... [pinned] */
+    duk_get_prop_index(ctx, -1, 0);                    /* => ... [pinned] [head] */
+    duk_put_prop_index(ctx, -2, slot);                 /* => ... [pinned] */
+    duk_push_uint(ctx, slot);                          /* => ... [pinned] [slot] */
+    duk_put_prop_index(ctx, -2, 0);                    /* => ... [pinned] */
+    duk_pop(ctx);                                      /* => ... */
+}
 
-    /*
-     * Schedule the deletion of the lambda from Duktape
-     */
-    if (freeDukLambda) {
-        lambdaName = Tcl_GetStringFromObj(lambdaNameObj, &lambdaNameLength);
-        duk_push_global_stash(ctx);                                  /* => ... [stash] */
-        duk_get_prop_literal(ctx, -1, "freeableLambdas");            /* => ... [stash] [object|undefined] */
-        if (duk_is_undefined(ctx, -1)) {
-            duk_pop(ctx);                                            /* => ... [stash] */
-            duk_push_object(ctx);                                    /* => ... [stash] [object] */
-            duk_dup(ctx, -1);                                        /* => ... [stash] [object] [object] */
-            duk_put_prop_literal(ctx, -3, "freeableLambdas");        /* => ... [stash.freeableLambdas=object] [object] */
-        }
-        duk_push_true(ctx);                                          /* => ... [stash] [object] [true] */
-        duk_put_prop_lstring(ctx, -2, lambdaName, lambdaNameLength); /* => ... [stash] [object.lambdaName=true] */
-        duk_pop_2(ctx);                                              /* => ... */
-    }
+static void Tclduk_PushPinned(duk_context *ctx, duk_uarridx_t slot) {
+    Tclduk_PushPinnedArray(ctx);                       /* => ... [pinned] */
+    duk_get_prop_index(ctx, -1, slot);                 /* => ... [pinned] [value] */
+    duk_remove(ctx, -2);                               /* => ... [value] */
+}
 
-    /*
-     * Finish cleanup
-     */
-    Tcl_DecrRefCount(lambdaNameObj);
+/*
+ * Load the function from the bytecode buffer on top of the stack.  Run
+ * with duk_safe_call, since Duktape throws on bytecode that it can tell is
+ * malformed.
+ */
+static duk_ret_t Tclduk_LoadFunction(duk_context *ctx, void *udata) {
+    duk_load_function(ctx);                            /* => [function] */
+    return(1);
+    /* UNREACH: Disable some warnings */
+    udata = udata;
+}
 
-    return;
+/*
+ * Like Tclduk_LoadFunction but for bytecode encoded as a base64 string,
+ * which throws if it isn't valid base64.
+ */
+static duk_ret_t Tclduk_LoadBase64Function(duk_context *ctx, void *udata) {
+    duk_base64_decode(ctx, -1);                        /* => [bytecode] */
+    duk_load_function(ctx);                            /* => [function] */
+    return(1);
+    /* UNREACH: Disable some warnings */
+    udata = udata;
 }
 
-static void Tclduk_LambdaObjType_Dup(Tcl_Obj *src, Tcl_Obj *dest) {
-    struct DuktapeLambdaInstanceData *instanceData;
+/*
+ * Deal with Duktape Lambdas using a custom Tcl Obj type.  The function is
+ * pinned in the heap and the instance finds it by the serial number of the
+ * lambda in its exports table for as long as the heap lives.  The bytecode
+ * is only dumped when the string rep is generated or the heap goes away.
+ */
+static duk_ret_t Tclduk_DumpBase64(duk_context *ctx, void *udata) {
+    duk_dump_function(ctx);                            /* => [bytecode] */
+    duk_base64_encode(ctx, -1);                        /* => [bytecode.b64] */
+    return(1);
+    /* UNREACH: Disable some warnings */
+    udata = udata;
+}
 
-    instanceData = src->internalRep.otherValuePtr;
+/*
+ * Dump the bytecode of a lambda unless it has been dumped.  Functions that
+ * can't be dumped, such as native ones, get empty bytecode.
+ */
+static void Tclduk_DumpLambda(struct DuktapeLambdaInstanceData *lambdaData) {
+    struct DuktapeInstanceData *instanceData;
+    duk_context *ctx;
+    const char *bytecode;
+    duk_size_t bytecodeLength;
 
-    instanceData->refCount++;
+    if (lambdaData->bytecode != NULL) {
+        return;
+    }
 
-    dest->internalRep.otherValuePtr = instanceData;
+    instanceData = lambdaData->instanceData;
+    lambdaData->bytecode = Tcl_NewObj();
+    Tcl_IncrRefCount(lambdaData->bytecode);
 
-    return;
+    if (lambdaData->generation != instanceData->generation
+            || Tcl_FindHashEntry(&instanceData->exports,
+            (char *) (size_t) lambdaData->serial) == NULL) {
+        return;
+    }
+
+    ctx = instanceData->ctx;
+    Tclduk_PushPinned(ctx, lambdaData->slot);          /* => ... [function] */
+    if (duk_safe_call(ctx, Tclduk_DumpBase64, NULL, 1, 1) == DUK_EXEC_SUCCESS) {
+                                                       /* => ... [bytecode.b64] */
+        bytecode = duk_get_lstring(ctx, -1, &bytecodeLength);
+        Tcl_SetStringObj(lambdaData->bytecode, bytecode,
+                (Tcl_Size) bytecodeLength);
+    }
+    duk_pop(ctx);                                      /* => ... */
+}
+
+/*
+ * Unpin the functions of the lambdas that were freed after their names
+ * were put in a string rep, which copies of it may still call them by.
+ */
+static void Tclduk_ReclaimOrphans(struct DuktapeInstanceData *instanceData) {
+    struct DuktapeLambdaInstanceData *lambdaData;
+    Tcl_HashEntry *hashPtr;
+
+    while (instanceData->orphans != NULL) {
+        lambdaData = instanceData->orphans;
+        instanceData->orphans = lambdaData->next;
+
+        hashPtr = Tcl_FindHashEntry(&instanceData->exports,
+                (char *) (size_t) lambdaData->serial);
+        if (hashPtr != NULL) {
+            Tcl_DeleteHashEntry(hashPtr);
+            Tclduk_Unpin(instanceData->ctx, lambdaData->slot);
+        }
+        Tclduk_InstanceRelease(instanceData);
+        ckfree(lambdaData);
+    }
+}
+
+/*
+ * Unpin the functions of the lambdas of a heap that is going away, after
+ * dumping their bytecode.  The lambdas then only have their string reps.
+ */
+static void Tclduk_ReleaseExports(struct DuktapeInstanceData *instanceData) {
+    struct DuktapeLambdaInstanceData *lambdaData;
+    Tcl_HashEntry *hashPtr;
+    Tcl_HashSearch search;
+
+    Tclduk_ReclaimOrphans(instanceData);
+    for (hashPtr = Tcl_FirstHashEntry(&instanceData->exports, &search);
+            hashPtr != NULL;
+            hashPtr = Tcl_NextHashEntry(&search)) {
+        lambdaData = Tcl_GetHashValue(hashPtr);
+        Tclduk_DumpLambda(lambdaData);
+        Tclduk_Unpin(instanceData->ctx, lambdaData->slot);
+        Tcl_DeleteHashEntry(hashPtr);
+    }
+}
+
+/**
+ ** Free a Duktape lambda object when the Tcl one is freed.  Its function
+ ** is unpinned right away unless the name of the lambda has been put in
+ ** a string rep, in which case that waits for the next lambda to be
+ ** exported or the heap to go away.  A lambda from an earlier generation
+ ** has nothing left in the instance, which may be in another thread.
+ **/
+static void Tclduk_LambdaObjType_Free(Tcl_Obj *lambdaObj) {
+    struct DuktapeLambdaInstanceData *lambdaData;
+    struct DuktapeInstanceData *instanceData;
+    Tcl_HashEntry *hashPtr;
+
+    lambdaData = lambdaObj->internalRep.otherValuePtr;
+
+    lambdaData->refCount--;
+
+    if (lambdaData->refCount > 0) {
+        return;
+    }
+
+    instanceData = lambdaData->instanceData;
+
+    if (lambdaData->bytecode != NULL) {
+        Tcl_DecrRefCount(lambdaData->bytecode);
+        lambdaData->bytecode = NULL;
+    }
+    Tcl_DecrRefCount(lambdaData->handle);
+
+    hashPtr = NULL;
+    if (lambdaData->generation == instanceData->generation) {
+        hashPtr = Tcl_FindHashEntry(&instanceData->exports,
+                (char *) (size_t) lambdaData->serial);
+    }
+    if (hashPtr != NULL) {
+        if (lambdaData->named) {
+            lambdaData->next = instanceData->orphans;
+            instanceData->orphans = lambdaData;
+            return;
+        }
+        Tcl_DeleteHashEntry(hashPtr);
+        Tclduk_Unpin(instanceData->ctx, lambdaData->slot);
+    }
+
+    Tclduk_InstanceRelease(instanceData);
+    ckfree(lambdaData);
+
+    return;
+}
+
+static void Tclduk_LambdaObjType_Dup(Tcl_Obj *src, Tcl_Obj *dest) {
+    struct DuktapeLambdaInstanceData *lambdaData;
+
+    lambdaData = src->internalRep.otherValuePtr;
+
+    lambdaData->refCount++;
+
+    dest->internalRep.otherValuePtr = lambdaData;
+    dest->typePtr = src->typePtr;
+
+    return;
 }
 
 static void Tclduk_LambdaObjType_String(Tcl_Obj *lambdaObj) {
-    struct DuktapeLambdaInstanceData *instanceData;
+    struct DuktapeLambdaInstanceData *lambdaData;
     Tcl_Obj *handle, *lambdaName, *bytecode;
     Tcl_Obj *dukStringObj, *dukItemObj, *dukCodeObj, *dukCodeLineObj;
     char *stringRep;
     Tcl_Size stringRepLength;
 
-    instanceData = lambdaObj->internalRep.otherValuePtr;
+    lambdaData = lambdaObj->internalRep.otherValuePtr;
+
+    Tclduk_DumpLambda(lambdaData);
+    lambdaData->named = 1;
 
-    lambdaName = instanceData->lambdaName;
-    handle     = instanceData->handle;
-    bytecode   = instanceData->bytecode;
+    lambdaName = Tcl_ObjPrintf(LAMBDA_PREFIX "%u_%u",
+            lambdaData->instanceData->lambdaSalt, lambdaData->serial);
+    handle     = lambdaData->handle;
+    bytecode   = lambdaData->bytecode;
 
     dukStringObj = Tcl_NewObj();
     dukItemObj = Tcl_NewObj();
@@ -326,16 +1245,11 @@ static Tcl_ObjType Tclduk_LambdaObjType = {
  ** Allocate a new Tcl_Obj for a Lambda Object
  **/
 static Tcl_Obj *Tclduk_LambdaObjType_New(
-    ClientData cdata,
-    Tcl_Obj *handle,
-    Tcl_Obj *lambdaName,
-    Tcl_Obj *bytecode
+    struct DuktapeLambdaInstanceData *lambdaData
 )
 {
-    struct DuktapeLambdaInstanceData *instanceData;
     Tcl_Obj *retval;
 
-    instanceData = ckalloc(sizeof(*instanceData));
     retval       = Tcl_NewObj();
 
     retval->refCount = 0;
@@ -343,992 +1257,5602 @@ static Tcl_Obj *Tclduk_LambdaObjType_New(
     retval->length   = 0;
     retval->typePtr  = &Tclduk_LambdaObjType;
 
-    instanceData->refCount = 1;
-    instanceData->cdata  = cdata;
-    instanceData->handle = handle;
-    instanceData->bytecode = bytecode;
-    instanceData->lambdaName = lambdaName;
+    retval->internalRep.otherValuePtr = lambdaData;
 
-    Tcl_IncrRefCount(handle);
-    Tcl_IncrRefCount(lambdaName);
-    Tcl_IncrRefCount(bytecode);
+    return(retval);
+}
+
+/*
+ * Compiled scripts are kept as a custom Tcl Obj type which refers to
+ * the compiled function pinned in the heap it was compiled in.  The
+ * string representation carries the bytecode so the script can be
+ * reloaded when the handle is used with a different heap or after it
+ * loses its internal representation.
+ */
+static void Tclduk_CompiledObjType_Free(Tcl_Obj *compiledObj) {
+    struct DuktapeCompiledData *compiledData;
+    duk_context *ctx;
 
-    retval->internalRep.otherValuePtr = instanceData;
+    compiledData = compiledObj->internalRep.otherValuePtr;
 
-    return(retval);
+    compiledData->refCount--;
+    if (compiledData->refCount > 0) {
+        return;
+    }
+
+    /*
+     * A stale handle may be freed in the interp a heap was detached from
+     * while another thread owns the heap, so don't look at the heap unless
+     * the handle is current
+     */
+    if (compiledData->generation == compiledData->instanceData->generation) {
+        ctx = compiledData->instanceData->ctx;
+        if (ctx != NULL) {
+            Tclduk_Unpin(ctx, compiledData->slot);
+        }
+    }
+
+    Tclduk_InstanceRelease(compiledData->instanceData);
+    Tcl_DecrRefCount(compiledData->bytecode);
+    ckfree(compiledData);
 }
 
-static void
-cleanup_interp(ClientData cdata, Tcl_Interp *interp)
-{
-    struct DuktapeInstanceData *instanceData;
-    Tcl_HashEntry* hashPtr;
-    Tcl_HashSearch search;
-    duk_context* ctx;
+static void Tclduk_CompiledObjType_Dup(Tcl_Obj *src, Tcl_Obj *dest) {
+    struct DuktapeCompiledData *compiledData;
 
-    hashPtr = Tcl_FirstHashEntry(&DUKTCL_CDATA->table, &search);
-    while (hashPtr != NULL) {
-        instanceData = (struct DuktapeInstanceData *) Tcl_GetHashValue(hashPtr);
-        Tcl_SetHashValue(hashPtr, (ClientData) NULL);
+    compiledData = src->internalRep.otherValuePtr;
 
-        ctx = instanceData->ctx;
-        duk_destroy_heap(ctx);
+    compiledData->refCount++;
 
-        Tcl_DecrRefCount(instanceData->handle);
+    dest->internalRep.otherValuePtr = compiledData;
+    dest->typePtr = src->typePtr;
+}
 
-        ckfree(instanceData);
-        hashPtr = Tcl_NextHashEntry(&search);
-    }
-    Tcl_DeleteHashTable(&DUKTCL_CDATA->table);
-    ckfree((char *)DUKTCL_CDATA);
-    return;
-    /* UNREACH: Disable some warnings */
-    interp = interp;
+static void Tclduk_CompiledObjType_String(Tcl_Obj *compiledObj) {
+    struct DuktapeCompiledData *compiledData;
+    Tcl_Obj *listObj;
+    char *stringRep;
+    Tcl_Size stringRepLength;
+
+    compiledData = compiledObj->internalRep.otherValuePtr;
+
+    listObj = Tcl_NewObj();
+    Tcl_ListObjAppendElement(
+        NULL,
+        listObj,
+        Tcl_NewStringObj(COMPILED_PREFIX, -1)
+    );
+    Tcl_ListObjAppendElement(NULL, listObj, compiledData->bytecode);
+
+    stringRep = Tcl_GetStringFromObj(listObj, &stringRepLength);
+    compiledObj->bytes = ckalloc(stringRepLength + 1);
+    memcpy(compiledObj->bytes, stringRep, stringRepLength + 1);
+    compiledObj->length = stringRepLength;
+
+    Tcl_DecrRefCount(listObj);
 }
 
+static Tcl_ObjType Tclduk_CompiledObjType = {
+    "duktape_compiled" /* name */,
+    Tclduk_CompiledObjType_Free,
+    Tclduk_CompiledObjType_Dup,
+    Tclduk_CompiledObjType_String,
+#ifdef TCL_OBJTYPE_V0
+    NULL,
+    TCL_OBJTYPE_V0
+#else
+    NULL
+#endif
+};
+
 /*
- * Convert JavaScript item to a Tcl item
+ * Pin the function on top of the stack and make compiledObj refer to it.
+ * The stack is left unchanged.
  */
-static Tcl_Obj *Tclduk_JSToTcl_function(duk_context *ctx, duk_idx_t idx) {
-    struct DuktapeInstanceData *instanceData;
-    duk_memory_functions funcs;
-    struct DuktapeData *cdata;
-    const char *dukString;
-    Tcl_Obj *dukStringObj, *dukCodeByteCodeObj;
-    Tcl_Obj *handle, *lambdaNameObj;
-    duk_size_t dukStringLength;
+static void Tclduk_CompiledObjType_Set(
+    struct DuktapeInstanceData *instanceData,
+    Tcl_Obj *compiledObj,
+    Tcl_Obj *bytecode
+)
+{
+    struct DuktapeCompiledData *compiledData;
 
-    duk_get_memory_functions(ctx, &funcs);
-    instanceData = funcs.udata;
+    compiledData = ckalloc(sizeof(*compiledData));
+    compiledData->refCount     = 1;
+    compiledData->instanceData = instanceData;
+    compiledData->generation   = instanceData->generation;
+    compiledData->slot         = Tclduk_Pin(instanceData->ctx, -1);
+    compiledData->bytecode     = bytecode;
 
-    handle = instanceData->handle;
-    cdata  = instanceData->cdata;
+    Tclduk_InstanceRetain(instanceData);
+    Tcl_IncrRefCount(bytecode);
 
-    lambdaNameObj = Tcl_ObjPrintf(
-        "lambda_%i%i%i_%i",
-        rand(),
-        rand(),
-        rand(),
-        instanceData->lambdaCount
-    );
-    instanceData->lambdaCount++;
+    if (compiledObj->typePtr && compiledObj->typePtr->freeIntRepProc) {
+        compiledObj->typePtr->freeIntRepProc(compiledObj);
+    }
+    compiledObj->internalRep.otherValuePtr = compiledData;
+    compiledObj->typePtr = &Tclduk_CompiledObjType;
+}
 
-    idx = duk_normalize_index(ctx, idx);
-    duk_push_global_stash(ctx);                                 /* => ... [stash] */
-    duk_dup(ctx, idx);                                          /* => ... [stash] [function] */
-    duk_dump_function(ctx);                                     /* => ... [stash] [bytecode] */
-    duk_base64_encode(ctx, -1);                                 /* => ... [stash] [bytecode.b64] */
-    dukString = duk_safe_to_lstring(ctx, -1, &dukStringLength); /* => ... [stash] [bytecode.b64] */
-    dukCodeByteCodeObj = Tcl_NewStringObj(dukString, dukStringLength);
-    duk_pop(ctx);                                               /* => ... [stash] */
-    duk_dup(ctx, idx);                                          /* => ... [stash] [function] */
-    duk_put_prop_string(ctx, -2, Tcl_GetStringFromObj(lambdaNameObj, NULL));   /* => ... [stash] */
-
-    duk_get_prop_literal(ctx, -1, "freeableLambdas");           /* => ... [stash] [freeableLambdas] */
-    if (!duk_is_undefined(ctx, -1)) {
-        duk_enum(ctx, -1, 0);                                   /* => ... [stash] [freeableLambdas] [enum] */
-        while (duk_next(ctx, -1, 0)) {                          /* => ... [stash] [freeableLambdas] [enum] [key] */
-            duk_del_prop(ctx, -4);                              /* => ... [stash] [freeableLambdas] [enum] */
-        }
-        duk_pop(ctx);                                           /* => ... [stash] [freeableLambdas] */
-    }
-    duk_pop(ctx);                                               /* => ... [stash] */
-    duk_del_prop_literal(ctx, -1, "freeableLambdas");           /* => ... [stash] */
-
-    duk_pop(ctx);                                               /* => ... */
-
-    dukStringObj = Tclduk_LambdaObjType_New(
-        cdata,
-        handle,
-        lambdaNameObj,
-        dukCodeByteCodeObj
-    );
+/*
+ * Push the compiled function a handle refers to onto the stack of the
+ * heap of instanceData, loading it from the bytecode if the handle
+ * belongs to another heap.
+ * Return value: TCL_OK or TCL_ERROR with a message in interp.
+ */
+static int Tclduk_PushCompiled(
+    Tcl_Interp *interp,
+    struct DuktapeInstanceData *instanceData,
+    Tcl_Obj *compiledObj
+)
+{
+    struct DuktapeCompiledData *compiledData;
+    duk_context *ctx;
+    Tcl_Obj *prefixObj, *bytecodeObj;
+    const char *bytecode;
+    Tcl_Size bytecodeLength, listLength;
 
-    return(dukStringObj);
-}
+    ctx = instanceData->ctx;
 
-static Tcl_Obj *Tclduk_JSToTcl(duk_context *ctx, duk_idx_t idx) {
-    const char *dukString;
-    duk_size_t dukStringLength;
-    duk_int_t arrayLength;
-    duk_idx_t arrayIndex;
-    Tcl_Obj *dukStringObj, *dukItemObj;
-    enum {
-        TCLDUK_TYPE_BYTEARRAY,
-        TCLDUK_TYPE_STRING
-    } string_format;
+    if (compiledObj->typePtr == &Tclduk_CompiledObjType) {
+        compiledData = compiledObj->internalRep.otherValuePtr;
+        if (compiledData->instanceData == instanceData
+                && compiledData->generation == instanceData->generation) {
+            Tclduk_PushPinned(ctx, compiledData->slot);
+            return(TCL_OK);
+        }
+    }
+
+    if (Tcl_ListObjLength(NULL, compiledObj, &listLength) != TCL_OK
+            || listLength != 2
+            || Tcl_ListObjIndex(NULL, compiledObj, 0, &prefixObj) != TCL_OK
+            || strcmp(Tcl_GetString(prefixObj), COMPILED_PREFIX) != 0
+            || Tcl_ListObjIndex(NULL, compiledObj, 1, &bytecodeObj) != TCL_OK) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(ERROR_HANDLE, -1));
+        return(TCL_ERROR);
+    }
 
     /*
-     * Convert types
-     *     buffer          => ByteArray
-     *     array           => List
-     *     null/undefined  => empty string
-     *     other object    => JSON
-     *     everything else => string
+     * Keep the bytecode alive across the conversion of compiledObj
      */
-    dukString = NULL;
-    dukStringObj = NULL;
-    string_format = TCLDUK_TYPE_STRING;
-    if (duk_check_type_mask(
-            ctx,
-            idx,
-            DUK_TYPE_MASK_NULL | DUK_TYPE_MASK_UNDEFINED
-        )) {
-        dukString = "";
-        dukStringLength = 0;
-    }
+    Tcl_IncrRefCount(bytecodeObj);
+    bytecode = Tcl_GetStringFromObj(bytecodeObj, &bytecodeLength);
+
+    duk_push_lstring(ctx, bytecode, bytecodeLength); /* => [bytecode.b64] */
+    if (duk_safe_call(ctx, Tclduk_LoadBase64Function, NULL, 1, 1)
+            != DUK_EXEC_SUCCESS) {                   /* => [error] */
+        duk_pop(ctx);                                /* => */
+        Tcl_DecrRefCount(bytecodeObj);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(ERROR_HANDLE, -1));
+        return(TCL_ERROR);
+    }                                                /* => [function] */
 
-    if (!dukString && !dukStringObj && duk_is_array(ctx, idx)) {
-        duk_get_prop_string(ctx, idx, "length");
-        arrayLength = duk_get_int(ctx, -1);
-        duk_pop(ctx);
+    Tclduk_CompiledObjType_Set(instanceData, compiledObj, bytecodeObj);
+    Tcl_DecrRefCount(bytecodeObj);
 
-        dukStringObj = Tcl_NewObj();
-        for (arrayIndex = 0; arrayIndex < arrayLength; arrayIndex++) {
-            duk_get_prop_index(ctx, idx, arrayIndex);
-            dukItemObj = Tclduk_JSToTcl(ctx, -1);
-            duk_pop(ctx);
+    return(TCL_OK);
+}
 
-            Tcl_ListObjAppendElement(NULL, dukStringObj, dukItemObj);
+/*
+ * Bound functions are Tcl commands that call a JavaScript function pinned
+ * in the heap.  The instance keeps a list of them so closing the heap can
+ * delete the commands.
+ */
+static void Tclduk_Bound_Delete(ClientData cdata) {
+    struct DuktapeBoundData *boundData;
+    struct DuktapeInstanceData *instanceData;
+
+    boundData = (struct DuktapeBoundData *) cdata;
+    instanceData = boundData->instanceData;
+
+    if (instanceData) {
+        Tclduk_Unpin(instanceData->ctx, boundData->methodSlot);
+        Tclduk_Unpin(instanceData->ctx, boundData->thisSlot);
+
+        if (boundData->prev) {
+            boundData->prev->next = boundData->next;
+        } else {
+            instanceData->bound = boundData->next;
+        }
+        if (boundData->next) {
+            boundData->next->prev = boundData->prev;
         }
     }
 
-    if (!dukString && !dukStringObj && duk_is_function(ctx, idx)) {
-        dukStringObj = Tclduk_JSToTcl_function(ctx, idx);
-    }
+    Tcl_DecrRefCount(boundData->signature);
+    ckfree(boundData->argTypes);
+    ckfree(boundData);
+}
 
-    if (!dukString && !dukStringObj && duk_is_buffer_data(ctx, idx)) {
-        duk_buffer_to_string(ctx, idx);
-        string_format = TCLDUK_TYPE_BYTEARRAY;
+/*
+ * Delete the bound function commands of an instance before its heap is
+ * destroyed.
+ */
+static void Tclduk_DeleteBound(struct DuktapeInstanceData *instanceData) {
+    while (instanceData->bound) {
+        Tcl_DeleteCommandFromToken(
+            instanceData->interp,
+            instanceData->bound->command
+        );
     }
+}
 
-    if (!dukString
-        && !dukStringObj
-        && duk_check_type(ctx, idx, DUK_TYPE_OBJECT)) {
-        duk_json_encode(ctx, idx);
+/*
+ * Detach the bound function commands of an instance from it when the
+ * interp is being deleted.  The commands are freed when Tcl deletes them.
+ */
+static void Tclduk_ForgetBound(struct DuktapeInstanceData *instanceData) {
+    struct DuktapeBoundData *boundData, *next;
+
+    for (boundData = instanceData->bound; boundData; boundData = next) {
+        next = boundData->next;
+        boundData->instanceData = NULL;
+        boundData->prev = NULL;
+        boundData->next = NULL;
     }
+    instanceData->bound = NULL;
+}
 
-    if (!dukStringObj) {
-        if (!dukString) {
-            dukString = duk_safe_to_lstring(ctx, idx, &dukStringLength);
-        }
+/*
+ * Pool allocator.  Each heap created with "-allocator pool" gets its own
+ * arena, which is released as a whole when the heap is torn down.
+ */
+static void *Tclduk_Arena_Alloc(void *udata, duk_size_t size) {
+    struct DuktapeArena *arena;
+    struct DuktapeArenaSmall *small;
+    struct DuktapeArenaLarge *large;
+    struct DuktapeArenaBlock *block;
+    size_t sizeClass, classSize;
+
+    arena = ((struct DuktapeInstanceData *) udata)->arena;
+
+    sizeClass = 0;
+    classSize = ARENA_MIN_CLASS;
+    while (classSize < size && sizeClass < ARENA_CLASSES) {
+        sizeClass++;
+        classSize <<= 1;
+    }
 
-        if (!dukString) {
+    if (sizeClass == ARENA_LARGE) {
+        large = attemptckalloc(sizeof(*large) + size);
+        if (large == NULL) {
             return(NULL);
         }
+        large->size = size;
+        large->sizeClass = ARENA_LARGE;
+        large->prev = NULL;
+        large->next = arena->large;
+        if (arena->large) {
+            arena->large->prev = large;
+        }
+        arena->large = large;
+        return(large + 1);
+    }
 
-        switch (string_format) {
-            case TCLDUK_TYPE_BYTEARRAY:
-                dukStringObj = Tcl_NewByteArrayObj(
-                    (const unsigned char *) dukString,
-                    dukStringLength
-                );
-                break;
-            case TCLDUK_TYPE_STRING:
-                dukStringObj = Tcl_NewStringObj(dukString, dukStringLength);
-                break;
+    if (arena->freeLists[sizeClass]) {
+        small = arena->freeLists[sizeClass];
+        arena->freeLists[sizeClass] = *((void **) (small + 1));
+        return(small + 1);
+    }
+
+    if (arena->end - arena->top < (ptrdiff_t) (sizeof(*small) + classSize)) {
+        block = attemptckalloc(sizeof(*block) + arena->blockSize);
+        if (block == NULL) {
+            return(NULL);
         }
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->top = (char *) (block + 1);
+        arena->end = arena->top + arena->blockSize;
     }
 
-    return(dukStringObj);
+    small = (struct DuktapeArenaSmall *) arena->top;
+    small->sizeClass = sizeClass;
+    arena->top += sizeof(*small) + classSize;
+
+    return(small + 1);
 }
 
-/*
- * Convert Tcl item to a JavaScript item and push that item to the end of the stack
- */
-static duk_idx_t Tclduk_TclToJS(
-    Tcl_Interp *interp,
-    Tcl_Obj *value,
-    duk_context *ctx,
-    const char *type
-)
-{
-    Tcl_Obj *typeObj, *firstTypeObj, *itemObj;
-    char *firstTypeString, *otherTypesString;
-    const char *valueString;
-    unsigned int type_hash;
-    enum {
-        TCLDUK_TYPE_BOOLEAN,
-        TCLDUK_TYPE_BYTEARRAY,
-        TCLDUK_TYPE_STRING,
-        TCLDUK_TYPE_UNDEFINED,
-        TCLDUK_TYPE_NULL,
-        TCLDUK_TYPE_DOUBLE,
-        TCLDUK_TYPE_INTEGER,
-        TCLDUK_TYPE_BIGINT,
-        TCLDUK_TYPE_ARRAY,
-        TCLDUK_TYPE_JSON
-    } string_format;
-    double valueDouble;
-    duk_idx_t checkRet;
-    int valueBoolean;
-    Tcl_Size valueStringLength, firstTypeStringLength;
-    int idx;
-    Tcl_Size numItems;
-    int tclRet;
+static void Tclduk_Arena_Free(void *udata, void *ptr) {
+    struct DuktapeArena *arena;
+    struct DuktapeArenaLarge *large;
+    size_t sizeClass;
 
-    /*
-     * If the return type is ignored, return without bothering
-     * fetch the result
-     */
-    if (!type) {
-        type = "string";
+    if (ptr == NULL) {
+        return;
     }
 
-    typeObj = Tcl_NewStringObj(type, -1);
-    tclRet = Tcl_ListObjIndex(NULL, typeObj, 0, &firstTypeObj);
-    if (tclRet != TCL_OK || !firstTypeObj) {
-        firstTypeObj = typeObj;
+    arena = ((struct DuktapeInstanceData *) udata)->arena;
+    sizeClass = ((size_t *) ptr)[-1];
+
+    if (sizeClass == ARENA_LARGE) {
+        large = ((struct DuktapeArenaLarge *) ptr) - 1;
+        if (large->prev) {
+            large->prev->next = large->next;
+        } else {
+            arena->large = large->next;
+        }
+        if (large->next) {
+            large->next->prev = large->prev;
+        }
+        ckfree(large);
+        return;
     }
-    firstTypeString = Tcl_GetStringFromObj(
-        firstTypeObj,
-        &firstTypeStringLength
-    );
 
-    type_hash = Tcl_ZlibCRC32(
-        0,
-        (const unsigned char *) firstTypeString,
-        firstTypeStringLength
-    );
+    *((void **) ptr) = arena->freeLists[sizeClass];
+    arena->freeLists[sizeClass] = ((struct DuktapeArenaSmall *) ptr) - 1;
+}
 
-    switch (type_hash) {
-        case 0x0: /* (empty string) */
-        case 0x9ebeb2a9: /* string */
-            string_format = TCLDUK_TYPE_STRING;
-            break;
-        case 0x8a858868: /* boolean */
-            string_format = TCLDUK_TYPE_BOOLEAN;
-            break;
-        case 0xb3444c: /* bytearray */
-            string_format = TCLDUK_TYPE_BYTEARRAY;
-            break;
-        case 0xfedc304f: /* undefined */
-            string_format = TCLDUK_TYPE_UNDEFINED;
-            break;
-        case 0x25cbfc4f: /* null */
-            string_format = TCLDUK_TYPE_NULL;
-            break;
-        case 0xdae7f2ef: /* double */
-            string_format = TCLDUK_TYPE_DOUBLE;
-            break;
-        case 0x5a0fab0b: /* integer */
-            string_format = TCLDUK_TYPE_INTEGER;
-            break;
-        case 0x2d3dd6d7: /* bigint */
-            string_format = TCLDUK_TYPE_BIGINT;
-            break;
-        case 0xa10ceeb7: /* array */
-            string_format = TCLDUK_TYPE_ARRAY;
-            break;
-        case 0x6b072545: /* json */
-            string_format = TCLDUK_TYPE_JSON;
-            break;
-        default:
-            duk_push_error_object(ctx, DUK_ERR_ERROR, ERROR_INVALID_TYPE, type);
-            return(-1);
-            break;
+static void *Tclduk_Arena_Realloc(void *udata, void *ptr, duk_size_t size) {
+    struct DuktapeArena *arena;
+    struct DuktapeArenaLarge *large, *newLarge;
+    size_t sizeClass, classSize;
+    void *newPtr;
+
+    if (ptr == NULL) {
+        return(Tclduk_Arena_Alloc(udata, size));
+    }
+    if (size == 0) {
+        Tclduk_Arena_Free(udata, ptr);
+        return(NULL);
     }
 
-    switch (string_format) {
-        case TCLDUK_TYPE_UNDEFINED:
-            return(0);
-        case TCLDUK_TYPE_BOOLEAN:
-            tclRet = Tcl_GetBooleanFromObj(NULL, value, &valueBoolean);
-            if (tclRet != TCL_OK) {
-                return(0);
+    arena = ((struct DuktapeInstanceData *) udata)->arena;
+    sizeClass = ((size_t *) ptr)[-1];
+
+    if (sizeClass == ARENA_LARGE) {
+        large = ((struct DuktapeArenaLarge *) ptr) - 1;
+        if (size <= large->size && size > large->size / 2) {
+            return(ptr);
+        }
+        if (size > ((size_t) ARENA_MIN_CLASS << (ARENA_CLASSES - 1))) {
+            newLarge = attemptckrealloc(large, sizeof(*large) + size);
+            if (newLarge == NULL) {
+                return(NULL);
             }
-            duk_push_boolean(ctx, valueBoolean);
-            return(1);
-        case TCLDUK_TYPE_NULL:
-            duk_push_null(ctx);
-            return(1);
-        case TCLDUK_TYPE_BYTEARRAY:
-            valueString = (const char *) Tcl_GetByteArrayFromObj(
-                value,
-                &valueStringLength
-            );
-            duk_push_lstring(ctx, valueString, valueStringLength);
-            duk_to_buffer(ctx, -1, NULL);
-            return(1);
-        case TCLDUK_TYPE_BIGINT:
-        case TCLDUK_TYPE_STRING:
-        case TCLDUK_TYPE_JSON:
-            valueString = Tcl_GetStringFromObj(value, &valueStringLength);
-            duk_push_lstring(ctx, valueString, valueStringLength);
-
-            /* If JSON is being pushed, convert to an object */
-            if (string_format == TCLDUK_TYPE_JSON) {
-                duk_json_decode(ctx, -1);
-            }
-
-            return(1);
-        case TCLDUK_TYPE_DOUBLE:
-        case TCLDUK_TYPE_INTEGER:
-            tclRet = Tcl_GetDoubleFromObj(NULL, value, &valueDouble);
-            if (tclRet != TCL_OK) {
-                return(0);
-            }
-            if (valueDouble != valueDouble) {
-                duk_push_nan(ctx);
+            newLarge->size = size;
+            if (newLarge->prev) {
+                newLarge->prev->next = newLarge;
             } else {
-                duk_push_number(ctx, valueDouble);
+                arena->large = newLarge;
             }
-            return(1);
-        case TCLDUK_TYPE_ARRAY:
-            /*
-             * Remove the first item from the list of types
-             */
-            tclRet = Tcl_ListObjReplace(NULL, typeObj, 0, 1, 0, NULL);
-            otherTypesString = Tcl_GetStringFromObj(typeObj, NULL);
-
-            /*
-             * For each item in the list, format using this
-             * function
-             */
-            tclRet = Tcl_ListObjLength(NULL, value, &numItems);
-            if (tclRet != TCL_OK) {
-                duk_push_null(ctx);
-                return(1);
+            if (newLarge->next) {
+                newLarge->next->prev = newLarge;
             }
+            return(newLarge + 1);
+        }
+        classSize = large->size;
+    } else {
+        classSize = (size_t) ARENA_MIN_CLASS << sizeClass;
+        if (size <= classSize) {
+            return(ptr);
+        }
+    }
 
-            duk_push_array(ctx);
-            for (idx = 0; idx < numItems; idx++) {
-                tclRet = Tcl_ListObjIndex(NULL, value, idx, &itemObj);
-                if (tclRet != TCL_OK) {
-                    duk_push_null(ctx);
-                } else {
-                    checkRet = Tclduk_TclToJS(
-                        interp,
-                        itemObj,
-                        ctx,
-                        otherTypesString
-                    );
-                    if (checkRet == 0) {
-                        duk_push_null(ctx);
-                    } else if (checkRet != 1) {
-                        /* XXX:TODO: Handle this ? */
-                    }
-                }
-                duk_put_prop_index(ctx, -2, idx);
-            }
+    newPtr = Tclduk_Arena_Alloc(udata, size);
+    if (newPtr == NULL) {
+        return(NULL);
+    }
+    memcpy(newPtr, ptr, classSize < size ? classSize : size);
+    Tclduk_Arena_Free(udata, ptr);
 
-            return(1);
+    return(newPtr);
+}
+
+static struct DuktapeArena *Tclduk_Arena_New(size_t blockSize) {
+    struct DuktapeArena *arena;
+
+    arena = ckalloc(sizeof(*arena));
+    memset(arena, 0, sizeof(*arena));
+    arena->blockSize = blockSize;
+
+    return(arena);
+}
+
+/*
+ * Release everything allocated from an arena at once.  The arena itself
+ * stays usable.
+ */
+static void Tclduk_Arena_Reset(struct DuktapeArena *arena) {
+    struct DuktapeArenaBlock *block, *nextBlock;
+    struct DuktapeArenaLarge *large, *nextLarge;
+
+    for (block = arena->blocks; block; block = nextBlock) {
+        nextBlock = block->next;
+        ckfree(block);
+    }
+    for (large = arena->large; large; large = nextLarge) {
+        nextLarge = large->next;
+        ckfree(large);
     }
 
-    return(0);
+    arena->blocks = NULL;
+    arena->large = NULL;
+    arena->top = NULL;
+    arena->end = NULL;
+    memset(arena->freeLists, 0, sizeof(arena->freeLists));
 }
 
 /*
- * Evaluate a Tcl string and return the result to JavaScript
+ * Memory functions of heaps created with -stats.  They count the requests
+ * for heap-stats and pass them on to the arena of the instance or to the
+ * C library, which is what Duktape uses by default.
  */
-static duk_ret_t EvalTclFromJSWithInterp(Tcl_Interp *interp,
-                                         duk_context *ctx,
-                                         const char *returnType) {
-    Tcl_Obj *evalScript, *evalResult, *dukStringObj;
-    duk_idx_t numArgs, numRetVals;
-    int tclRet;
-    int idx;
+static void *Tclduk_Heap_Alloc(void *udata, duk_size_t size) {
+    struct DuktapeInstanceData *instanceData = udata;
 
-    numArgs = duk_get_top(ctx);
-    if (numArgs < 0) {
-        duk_push_error_object(
-            ctx,
-            DUK_ERR_ERROR,
-            "%s",
-            ERROR_INTERNAL_ARGS_ERROR
-        );
-        return(duk_throw(ctx));
+    instanceData->stats.allocations++;
+    instanceData->stats.bytes += size;
+    if (instanceData->arena) {
+        return(Tclduk_Arena_Alloc(udata, size));
     }
+    return(malloc(size));
+}
 
-    evalScript = Tcl_NewListObj(0, NULL);
-    for (idx = 0; idx < numArgs; idx++) {
-        dukStringObj = Tclduk_JSToTcl(ctx, idx);
-        if (!dukStringObj) {
-            duk_push_error_object(
-                ctx,
-                DUK_ERR_TYPE_ERROR,
-                "%s",
-                ERROR_INVALID_STRING
-            );
-            return(duk_throw(ctx));
-        }
+static void *Tclduk_Heap_Realloc(void *udata, void *ptr, duk_size_t size) {
+    struct DuktapeInstanceData *instanceData = udata;
 
-        tclRet = Tcl_ListObjAppendElement(interp, evalScript, dukStringObj);
-        if (tclRet != TCL_OK) {
-            duk_push_error_object(
-                ctx,
-                DUK_ERR_ERROR,
-                "%s",
-                ERROR_INTERNAL_TCL_LAPPEND
-            );
-            return(duk_throw(ctx));
-        }
+    if (size > 0) {
+        instanceData->stats.allocations++;
+        instanceData->stats.bytes += size;
     }
-    for (idx = 0; idx < numArgs; idx++) {
-        duk_pop(ctx);
+    if (instanceData->arena) {
+        return(Tclduk_Arena_Realloc(udata, ptr, size));
     }
+    return(realloc(ptr, size));
+}
 
-    tclRet = Tcl_EvalObjEx(interp, evalScript, 0);
-    if (tclRet != TCL_OK) {
-        duk_push_error_object(
-            ctx,
-            DUK_ERR_ERROR,
-            "%s",
-            Tcl_GetStringResult(interp)
+static void Tclduk_Heap_Free(void *udata, void *ptr) {
+    struct DuktapeInstanceData *instanceData = udata;
+
+    if (instanceData->arena) {
+        Tclduk_Arena_Free(udata, ptr);
+        return;
+    }
+    free(ptr);
+}
+
+/*
+ * Create the Duktape heap of an instance using its allocator.  Only a heap
+ * that counts its allocations pays for the extra call of the counting
+ * wrappers.  The instance is the heap's udata in every case, which is how
+ * native functions find it.
+ */
+static duk_context *Tclduk_CreateHeap(
+    struct DuktapeInstanceData *instanceData
+)
+{
+    if (instanceData->countAllocations) {
+        return duk_create_heap(
+            Tclduk_Heap_Alloc,
+            Tclduk_Heap_Realloc,
+            Tclduk_Heap_Free,
+            instanceData,
+            NULL
         );
-        return(duk_throw(ctx));
     }
+    if (instanceData->arena) {
+        return duk_create_heap(
+            Tclduk_Arena_Alloc,
+            Tclduk_Arena_Realloc,
+            Tclduk_Arena_Free,
+            instanceData,
+            NULL
+        );
+    }
+    return duk_create_heap(NULL, NULL, NULL, instanceData, NULL);
+}
 
-    evalResult = Tcl_GetObjResult(interp);
+/*
+ * Functions created with tcl-function hold a pointer to a Tcl list
+ * {apply lambda} that is kept in instanceData->lambdas, so Tcl compiles the
+ * lambda once rather than on every call.  A finalizer forgets the list when
+ * the function is collected.
+ */
+static Tcl_Obj *Tclduk_NewLambda(
+    struct DuktapeInstanceData *instanceData,
+    Tcl_Obj *lambdaObj
+)
+{
+    Tcl_HashEntry *hashPtr;
+    Tcl_Obj *prefix, *words[2];
+    int isNew;
 
-    numRetVals = Tclduk_TclToJS(interp, evalResult, ctx, returnType);
+    words[0] = Tcl_NewStringObj("apply", -1);
+    words[1] = lambdaObj;
+    prefix = Tcl_NewListObj(2, words);
+    Tcl_IncrRefCount(prefix);
 
-    Tcl_ResetResult(interp);
+    hashPtr = Tcl_CreateHashEntry(&instanceData->lambdas, (char *) prefix,
+            &isNew);
+    Tcl_SetHashValue(hashPtr, (ClientData) prefix);
 
-    return(numRetVals);
+    return(prefix);
 }
 
-static duk_ret_t EvalTclFromJS(duk_context *ctx) {
-    struct DuktapeInstanceData *instanceData;
-    duk_memory_functions funcs;
-    Tcl_Interp *interp;
+static void Tclduk_ForgetLambda(
+    struct DuktapeInstanceData *instanceData,
+    Tcl_Obj *prefix
+)
+{
+    Tcl_HashEntry *hashPtr;
 
-    duk_get_memory_functions(ctx, &funcs);
-    instanceData = funcs.udata;
+    hashPtr = Tcl_FindHashEntry(&instanceData->lambdas, (char *) prefix);
+    if (hashPtr != NULL) {
+        Tcl_DeleteHashEntry(hashPtr);
+        Tcl_DecrRefCount(prefix);
+    }
+}
 
-    if (!instanceData) {
-        duk_push_error_object(ctx, DUK_ERR_ERROR, "%s", ERROR_INVALID_INSTANCE);
-        return(duk_throw(ctx));
+static void Tclduk_FreeLambdas(struct DuktapeInstanceData *instanceData) {
+    Tcl_HashEntry *hashPtr;
+    Tcl_HashSearch search;
+
+    for (hashPtr = Tcl_FirstHashEntry(&instanceData->lambdas, &search);
+            hashPtr != NULL;
+            hashPtr = Tcl_NextHashEntry(&search)) {
+        Tcl_DecrRefCount((Tcl_Obj *) Tcl_GetHashValue(hashPtr));
+        Tcl_DeleteHashEntry(hashPtr);
     }
+}
 
-    if (!instanceData->isUnsafe) {
-        duk_push_error_object(ctx, DUK_ERR_ERROR, "%s", ERROR_NOT_ALLOWED);
-        return(duk_throw(ctx));
+/*
+ * Replace the words of the lambda prefixes with plain strings so they no
+ * longer refer to the compiled procedures and commands of an interp.
+ */
+static void Tclduk_ResetLambdas(struct DuktapeInstanceData *instanceData) {
+    Tcl_HashEntry *hashPtr;
+    Tcl_HashSearch search;
+    Tcl_Obj *prefix, **words, *fresh[2];
+    Tcl_Size count;
+
+    for (hashPtr = Tcl_FirstHashEntry(&instanceData->lambdas, &search);
+            hashPtr != NULL;
+            hashPtr = Tcl_NextHashEntry(&search)) {
+        prefix = Tcl_GetHashValue(hashPtr);
+        Tcl_ListObjGetElements(NULL, prefix, &count, &words);
+        fresh[0] = Tcl_NewStringObj(Tcl_GetString(words[0]), -1);
+        fresh[1] = Tcl_NewStringObj(Tcl_GetString(words[1]), -1);
+        Tcl_SetListObj(prefix, 2, fresh);
     }
+}
 
-    interp = instanceData->interp;
+/*
+ * Functions created with tcl-command call the objProc of a Tcl command
+ * directly.  The command is resolved once; a trace keeps the name current
+ * across renames and drops the token when the command is deleted, after
+ * which the name is resolved again on the next call.
+ */
+static void Tclduk_CommandTrace(
+    ClientData cdata,
+    Tcl_Interp *interp,
+    const char *oldName,
+    const char *newName,
+    int flags
+)
+{
+    struct DuktapeCommandData *commandData = cdata;
 
-    if (!interp) {
-        duk_push_error_object(ctx, DUK_ERR_ERROR, "%s", ERROR_INVALID_INTERP);
-        return(duk_throw(ctx));
+    if ((flags & TCL_TRACE_DESTROYED) || newName == NULL || *newName == '\0') {
+        commandData->token = NULL;
+        return;
     }
 
-    return(EvalTclFromJSWithInterp(interp, ctx, NULL));
+    Tcl_DecrRefCount(commandData->name);
+    commandData->name = Tcl_NewStringObj(newName, -1);
+    Tcl_IncrRefCount(commandData->name);
+    return;
+    /* UNREACH: Disable some warnings */
+    interp = interp;
+    oldName = oldName;
 }
 
-static void MakeContextUnsafe(duk_context *ctx) {
-    struct DuktapeInstanceData *instanceData;
-    duk_memory_functions funcs;
+/*
+ * Look up the command of commandData by name and trace it.
+ * Return value: TCL_OK or TCL_ERROR with a message in interp.
+ */
+static int Tclduk_ResolveCommand(
+    Tcl_Interp *interp,
+    struct DuktapeCommandData *commandData
+)
+{
+    Tcl_Command token;
+    Tcl_Obj *fullName;
 
-    duk_get_memory_functions(ctx, &funcs);
-    instanceData = funcs.udata;
+    token = Tcl_GetCommandFromObj(interp, commandData->name);
+    if (token == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_COMMAND,
+                Tcl_GetString(commandData->name)));
+        return TCL_ERROR;
+    }
 
-    instanceData->isUnsafe = 1;
+    fullName = Tcl_NewObj();
+    Tcl_GetCommandFullName(interp, token, fullName);
+    Tcl_IncrRefCount(fullName);
+    Tcl_DecrRefCount(commandData->name);
+    commandData->name = fullName;
 
-    duk_push_global_object(ctx);           /* => [global] */
-    duk_push_string(ctx, "Duktape");       /* => [global] ["duktape"] */
-    duk_get_prop(ctx, -2);                 /* => [global] [duktape] */
-    if (duk_is_object(ctx, -1)) {
-        duk_push_string(ctx, "tcl");   /* => [global] [duktape] ["tcl"] */
-        duk_push_object(ctx);          /* => [global] [duktape] ["tcl"] [object] */
-        duk_push_string(ctx, "eval");  /* => [global] [duktape] ["tcl"] [object] ["eval"] */
-        duk_push_c_function(ctx, EvalTclFromJS, DUK_VARARGS);
-                                       /* => [global] [duktape] ["tcl"] [object] ["eval"] [function] */
-        duk_put_prop(ctx, -3);         /* => [global] [duktape] ["tcl"] [object.eval=function] */
-        duk_put_prop(ctx, -3);         /* => [global] [duktape.tcl=object] */
+    Tcl_TraceCommand(interp, Tcl_GetString(fullName),
+            TCL_TRACE_RENAME | TCL_TRACE_DELETE, Tclduk_CommandTrace,
+            commandData);
+    commandData->token = token;
+
+    return TCL_OK;
+}
+
+/*
+ * Stop tracing the command of commandData and forget its token, for
+ * example because the heap is leaving the interp.
+ */
+static void Tclduk_ReleaseCommand(struct DuktapeCommandData *commandData) {
+    Tcl_Obj *name;
+
+    if (commandData->token != NULL) {
+        Tcl_UntraceCommand(commandData->instanceData->interp,
+                Tcl_GetString(commandData->name),
+                TCL_TRACE_RENAME | TCL_TRACE_DELETE, Tclduk_CommandTrace,
+                commandData);
+        commandData->token = NULL;
     }
-    duk_pop(ctx);                          /* => [global] */
-    duk_pop(ctx);                          /* => */
 
-    return;
+    /* Don't keep the command lookup cached in the name either */
+    name = Tcl_NewStringObj(Tcl_GetString(commandData->name), -1);
+    Tcl_IncrRefCount(name);
+    Tcl_DecrRefCount(commandData->name);
+    commandData->name = name;
 }
 
-static void MakeContextSafe(duk_context *ctx) {
-    struct DuktapeInstanceData *instanceData;
-    duk_memory_functions funcs;
+static void Tclduk_FreeCommand(struct DuktapeCommandData *commandData) {
+    Tclduk_ReleaseCommand(commandData);
+    Tcl_DecrRefCount(commandData->name);
+    Tcl_DecrRefCount(commandData->words);
+    if (commandData->argFlags != NULL) {
+        ckfree((char *) commandData->argFlags);
+    }
+    ckfree((char *) commandData);
+}
 
-    duk_get_memory_functions(ctx, &funcs);
-    instanceData = funcs.udata;
+static void Tclduk_ForgetCommand(struct DuktapeCommandData *commandData) {
+    Tcl_HashEntry *hashPtr;
 
-    instanceData->isUnsafe = 0;
+    hashPtr = Tcl_FindHashEntry(&commandData->instanceData->commands,
+            (char *) commandData);
+    if (hashPtr != NULL) {
+        Tcl_DeleteHashEntry(hashPtr);
+        Tclduk_FreeCommand(commandData);
+    }
+}
 
-    duk_push_global_object(ctx);           /* => [global] */
-    duk_push_string(ctx, "Duktape");       /* => [global] ["duktape"] */
-    duk_get_prop(ctx, -2);                 /* => [global] [duktape] */
-    if (duk_is_object(ctx, -1)) {
-        duk_push_string(ctx, "tcl");   /* => [global] [duktape] ["tcl"] */
-        duk_del_prop(ctx, -2);         /* => [global] [duktape]  */
+static void Tclduk_FreeCommands(struct DuktapeInstanceData *instanceData) {
+    Tcl_HashEntry *hashPtr;
+    Tcl_HashSearch search;
+
+    for (hashPtr = Tcl_FirstHashEntry(&instanceData->commands, &search);
+            hashPtr != NULL;
+            hashPtr = Tcl_NextHashEntry(&search)) {
+        Tclduk_FreeCommand(Tcl_GetHashValue(hashPtr));
+        Tcl_DeleteHashEntry(hashPtr);
     }
-    duk_pop(ctx);                          /* => [global] */
-    duk_pop(ctx);                          /* => */
+}
 
-    return;
+static void Tclduk_ResetCommands(struct DuktapeInstanceData *instanceData) {
+    Tcl_HashEntry *hashPtr;
+    Tcl_HashSearch search;
+
+    for (hashPtr = Tcl_FirstHashEntry(&instanceData->commands, &search);
+            hashPtr != NULL;
+            hashPtr = Tcl_NextHashEntry(&search)) {
+        Tclduk_ReleaseCommand(Tcl_GetHashValue(hashPtr));
+    }
 }
 
 /*
- * Initialize a Duktape intepreter.
- * Return value: string token of the form "::duktape::(integer)".
- * Side effects: creates an Duktape heap.
+ * Destroy the Duktape heap of an instance.  Heaps that use the pool
+ * allocator are dropped by releasing their arena, so finalizers do not
+ * run for them.
  */
-static int
-Init_Cmd(ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+static void Tclduk_DestroyHeap(struct DuktapeInstanceData *instanceData) {
+    Tclduk_ReleaseExports(instanceData);
+    if (instanceData->arena) {
+        Tclduk_Arena_Reset(instanceData->arena);
+    } else {
+        duk_destroy_heap(instanceData->ctx);
+    }
+    Tclduk_FreeLambdas(instanceData);
+    Tclduk_FreeCommands(instanceData);
+}
+
+/*
+ * Get a timeout or a budget.  Zero means no limit.
+ * Return value: TCL_OK or TCL_ERROR if limitObj isn't a non-negative
+ * integer.
+ */
+static int Tclduk_GetLimit(
+    Tcl_Interp *interp,
+    Tcl_Obj *limitObj,
+    Tcl_WideInt *limit
+)
 {
-    struct DuktapeInstanceData *instanceData;
-    duk_context *ctx;
-    Tcl_HashEntry *hashPtr;
-    int isNew;
-    Tcl_Obj *token;
-    int makeSafe = 1;
-    int tclRet;
+    if (Tcl_GetWideIntFromObj(interp, limitObj, limit) != TCL_OK) {
+        return TCL_ERROR;
+    }
 
-    if (objc != 1 && objc != 3) {
-        Tcl_WrongNumArgs(interp, 1, objv, USAGE_INIT);
+    if (*limit < 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_NEGATIVE,
+                Tcl_GetString(limitObj)));
+        return TCL_ERROR;
+    }
+
+    return TCL_OK;
+}
+
+/*
+ * Called by Duktape every INTERRUPT_INTERVAL instructions with the heap's
+ * instance data, so a budget is only charged in steps of that size.  Once
+ * it returns true it must keep doing so until the error it causes has
+ * propagated out of Duktape, which is when Tclduk_EndLimits clears expired.
+ * Return value: nonzero to abort the running code with a RangeError.
+ */
+TCLDUK_INTERNAL duk_bool_t Tclduk_ExecTimeoutCheck(void *udata) {
+    struct DuktapeLimits *limits;
+    Tcl_Time now;
+
+    if (udata == NULL) {
+        return 0;
+    }
+
+    limits = &((struct DuktapeInstanceData *) udata)->limits;
+    if (limits->expired) {
+        return 1;
+    }
+
+    if (limits->hasBudget) {
+        limits->budget -= INTERRUPT_INTERVAL;
+        if (limits->budget < 0) {
+            limits->expired = LIMIT_BUDGET;
+            return 1;
+        }
+    }
+
+    if (limits->hasDeadline) {
+        Tcl_GetTime(&now);
+        if (now.sec > limits->deadline.sec
+                || (now.sec == limits->deadline.sec
+                    && now.usec >= limits->deadline.usec)) {
+            limits->expired = LIMIT_TIMEOUT;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Apply the timeout and budget of a call, or the heap's defaults, before
+ * running code, and count the call as running until Tclduk_EndLimits.  A
+ * call made while another one runs in the same heap can only tighten the
+ * limits of the outer call.
+ */
+static void Tclduk_BeginLimits(
+    struct DuktapeInstanceData *instanceData,
+    struct DuktapeCallOptions *opts,
+    struct DuktapeLimitsFrame *frame
+)
+{
+    struct DuktapeLimits *limits;
+    Tcl_WideInt timeout, budget;
+    Tcl_Time deadline;
+
+    instanceData->running++;
+    limits = &instanceData->limits;
+    frame->saved = *limits;
+
+    timeout = opts->timeout >= 0 ? opts->timeout : instanceData->defaultTimeout;
+    budget = opts->budget >= 0 ? opts->budget : instanceData->defaultBudget;
+
+    if (timeout > 0) {
+        Tcl_GetTime(&deadline);
+        deadline.sec += (long) (timeout / 1000);
+        deadline.usec += (long) (timeout % 1000) * 1000;
+        if (deadline.usec >= 1000000) {
+            deadline.sec++;
+            deadline.usec -= 1000000;
+        }
+
+        if (!limits->hasDeadline
+                || deadline.sec < limits->deadline.sec
+                || (deadline.sec == limits->deadline.sec
+                    && deadline.usec < limits->deadline.usec)) {
+            limits->hasDeadline = 1;
+            limits->deadline = deadline;
+        }
+    }
+
+    if (budget > 0 && (!limits->hasBudget || budget < limits->budget)) {
+        limits->hasBudget = 1;
+        limits->budget = budget;
+    }
+
+    frame->budget = limits->budget;
+}
+
+/*
+ * Restore the limits of the calling code after a call, charging it for the
+ * instructions the call used.  If the call was interrupted the error code
+ * is set to {DUKTAPE TIMEOUT} or {DUKTAPE BUDGET}.
+ * Return value: retval.
+ */
+static int Tclduk_EndLimits(
+    Tcl_Interp *interp,
+    struct DuktapeInstanceData *instanceData,
+    struct DuktapeLimitsFrame *frame,
+    int retval
+)
+{
+    struct DuktapeLimits *limits;
+
+    instanceData->running--;
+    limits = &instanceData->limits;
+
+    if (limits->expired && !frame->saved.expired && retval != TCL_OK) {
+        Tcl_SetErrorCode(interp, "DUKTAPE",
+                limits->expired == LIMIT_TIMEOUT ? "TIMEOUT" : "BUDGET",
+                (char *) NULL);
+    }
+
+    if (frame->saved.hasBudget && limits->hasBudget) {
+        frame->saved.budget -= frame->budget - limits->budget;
+    }
+    *limits = frame->saved;
+
+    return retval;
+}
+
+/*
+ * Refuse to destroy or rebuild a heap while code runs in it, for example
+ * from a Tcl function that JavaScript code in the same heap has called:
+ * the frames of that code would be left on a freed heap.
+ * Return value: TCL_OK if no call is running in the heap, otherwise
+ * TCL_ERROR with an error message and the error code DUKTAPE BUSY.
+ */
+static int Tclduk_CheckIdle(
+    Tcl_Interp *interp,
+    struct DuktapeInstanceData *instanceData
+)
+{
+    if (instanceData->running > 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(ERROR_BUSY, -1));
+        Tcl_SetErrorCode(interp, "DUKTAPE", "BUSY", (char *) NULL);
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ * Read the bytecode from a bundle written by dump-bundle or stored in a code
+ * cache.
+ * Return value: a new byte array object with the bytecode or NULL with an
+ * error message in interp if interp is not NULL.
+ */
+static Tcl_Obj *Tclduk_ReadBundle(Tcl_Interp *interp, Tcl_Obj *pathObj) {
+    Tcl_Channel chan;
+    Tcl_Obj *contentsObj, *headerObj, *bytecodeObj;
+    unsigned char *contents;
+    const char *header;
+    Tcl_Size contentsLength, headerLength;
+
+    chan = Tcl_FSOpenFileChannel(interp, pathObj, "r", 0);
+    if (chan == NULL) {
+        return(NULL);
+    }
+    contentsObj = Tcl_NewObj();
+    Tcl_IncrRefCount(contentsObj);
+    if (Tcl_SetChannelOption(interp, chan, "-translation", "binary")
+            != TCL_OK) {
+        Tcl_Close(NULL, chan);
+        Tcl_DecrRefCount(contentsObj);
+        return(NULL);
+    }
+    if (Tcl_ReadChars(chan, contentsObj, -1, 0) < 0) {
+        if (interp) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_READ,
+                    Tcl_GetString(pathObj), Tcl_PosixError(interp)));
+        }
+        Tcl_Close(NULL, chan);
+        Tcl_DecrRefCount(contentsObj);
+        return(NULL);
+    }
+    if (Tcl_Close(interp, chan) != TCL_OK) {
+        Tcl_DecrRefCount(contentsObj);
+        return(NULL);
+    }
+
+    headerObj = Tcl_ObjPrintf(BUNDLE_HEADER, (long) DUK_VERSION);
+    header = Tcl_GetStringFromObj(headerObj, &headerLength);
+    contents = Tcl_GetByteArrayFromObj(contentsObj, &contentsLength);
+    if (contentsLength <= headerLength
+            || memcmp(contents, header, headerLength) != 0) {
+        if (interp) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_BUNDLE,
+                    Tcl_GetString(pathObj)));
+        }
+        Tcl_DecrRefCount(headerObj);
+        Tcl_DecrRefCount(contentsObj);
+        return(NULL);
+    }
+
+    bytecodeObj = Tcl_NewByteArrayObj(contents + headerLength,
+            contentsLength - headerLength);
+    Tcl_DecrRefCount(headerObj);
+    Tcl_DecrRefCount(contentsObj);
+
+    return(bytecodeObj);
+}
+
+/*
+ * Write the bytecode on top of the stack as a bundle.  The file is opened
+ * with the given mode, which may ask for it to be created exclusively.  If
+ * recordObj is not NULL, its bytes go between the header and the bytecode.
+ * Return value: TCL_OK or TCL_ERROR with an error message in interp if
+ * interp is not NULL.
+ */
+static int Tclduk_WriteBundle(
+    Tcl_Interp *interp,
+    duk_context *ctx,
+    Tcl_Obj *pathObj,
+    const char *mode,
+    Tcl_Obj *recordObj
+)
+{
+    Tcl_Channel chan;
+    Tcl_Obj *headerObj, *bundleObj;
+    const char *header;
+    Tcl_Size headerLength, recordLength;
+    unsigned char *bundle, *record;
+    void *bytecode;
+    duk_size_t bytecodeLength;
+
+    bytecode = duk_get_buffer(ctx, -1, &bytecodeLength);
+    headerObj = Tcl_ObjPrintf(BUNDLE_HEADER, (long) DUK_VERSION);
+    header = Tcl_GetStringFromObj(headerObj, &headerLength);
+    record = NULL;
+    recordLength = 0;
+    if (recordObj) {
+        record = Tcl_GetByteArrayFromObj(recordObj, &recordLength);
+    }
+    bundleObj = Tcl_NewObj();
+    Tcl_IncrRefCount(bundleObj);
+    bundle = Tcl_SetByteArrayLength(bundleObj,
+            headerLength + recordLength + bytecodeLength);
+    memcpy(bundle, header, headerLength);
+    if (recordLength > 0) {
+        memcpy(bundle + headerLength, record, recordLength);
+    }
+    memcpy(bundle + headerLength + recordLength, bytecode, bytecodeLength);
+    Tcl_DecrRefCount(headerObj);
+
+    chan = Tcl_FSOpenFileChannel(interp, pathObj, mode, 0666);
+    if (chan == NULL) {
+        Tcl_DecrRefCount(bundleObj);
+        return TCL_ERROR;
+    }
+    if (Tcl_SetChannelOption(interp, chan, "-translation", "binary")
+            != TCL_OK) {
+        Tcl_Close(NULL, chan);
+        Tcl_DecrRefCount(bundleObj);
+        return TCL_ERROR;
+    }
+    if (Tcl_WriteObj(chan, bundleObj) < 0) {
+        if (interp) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_WRITE,
+                    Tcl_GetString(pathObj), Tcl_PosixError(interp)));
+        }
+        Tcl_Close(NULL, chan);
+        Tcl_DecrRefCount(bundleObj);
+        return TCL_ERROR;
+    }
+    Tcl_DecrRefCount(bundleObj);
+
+    return Tcl_Close(interp, chan);
+}
+
+static Tcl_WideUInt Tclduk_Fnv1a(
+    Tcl_WideUInt hash,
+    const void *data,
+    size_t length
+)
+{
+    const unsigned char *bytes = data;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return(hash);
+}
+
+/*
+ * Build the line that a bundle written by dump-bundle keeps between the
+ * header and the bytecode: the length and a hash of the bytecode.
+ * Return value: a new byte array object.
+ */
+static Tcl_Obj *Tclduk_BundleRecord(
+    const unsigned char *bytecode,
+    Tcl_Size bytecodeLength
+)
+{
+    Tcl_Obj *lineObj, *recordObj;
+    const char *line;
+    Tcl_Size lineLength;
+    Tcl_WideUInt hash;
+
+    hash = Tclduk_Fnv1a(FNV_OFFSET_BASIS, bytecode, bytecodeLength);
+    lineObj = Tcl_ObjPrintf("%lu %08lx%08lx\n", (unsigned long) bytecodeLength,
+            (unsigned long) (hash >> 32), (unsigned long) (hash & 0xffffffff));
+    line = Tcl_GetStringFromObj(lineObj, &lineLength);
+    recordObj = Tcl_NewByteArrayObj((const unsigned char *) line, lineLength);
+    Tcl_DecrRefCount(lineObj);
+
+    return(recordObj);
+}
+
+/*
+ * Read a bundle written by dump-bundle for preloading.  Duktape trusts
+ * bytecode completely, so a file whose bytecode doesn't match its record,
+ * e.g., because it was cut short, is rejected before it gets near a heap.
+ * Return value: a new byte array object with the bytecode or NULL with an
+ * error message in interp.
+ */
+static Tcl_Obj *Tclduk_ReadPreload(Tcl_Interp *interp, Tcl_Obj *pathObj) {
+    Tcl_Obj *contentsObj, *recordObj, *bytecodeObj;
+    unsigned char *contents, *newline, *record;
+    Tcl_Size contentsLength, lineLength, recordLength;
+
+    contentsObj = Tclduk_ReadBundle(interp, pathObj);
+    if (contentsObj == NULL) {
+        return(NULL);
+    }
+    Tcl_IncrRefCount(contentsObj);
+
+    bytecodeObj = NULL;
+    contents = Tcl_GetByteArrayFromObj(contentsObj, &contentsLength);
+    newline = memchr(contents, '\n', contentsLength < 64 ? contentsLength : 64);
+    if (newline != NULL) {
+        lineLength = newline - contents + 1;
+        recordObj = Tclduk_BundleRecord(contents + lineLength,
+                contentsLength - lineLength);
+        record = Tcl_GetByteArrayFromObj(recordObj, &recordLength);
+        if (recordLength == lineLength
+                && memcmp(record, contents, lineLength) == 0) {
+            bytecodeObj = Tcl_NewByteArrayObj(contents + lineLength,
+                    contentsLength - lineLength);
+        }
+        Tcl_DecrRefCount(recordObj);
+    }
+    Tcl_DecrRefCount(contentsObj);
+
+    if (bytecodeObj == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_BUNDLE,
+                Tcl_GetString(pathObj)));
+    }
+
+    return(bytecodeObj);
+}
+
+/*
+ * Find the file in the code cache of an instance for a script.  The name
+ * is a hash of the source, the file name it is compiled under and the
+ * Duktape version and build profile, so a change to any of them misses
+ * the cache.
+ * Return value: a new object with the path.
+ */
+static Tcl_Obj *Tclduk_CodeCachePath(
+    struct DuktapeInstanceData *instanceData,
+    Tcl_Obj *filenameObj,
+    const char *code,
+    Tcl_Size codeLength
+)
+{
+    Tcl_Obj *headerObj, *nameObj, *pathObj;
+    const char *string;
+    Tcl_Size length;
+    Tcl_WideUInt hash;
+
+    headerObj = Tcl_ObjPrintf(BUNDLE_HEADER, (long) DUK_VERSION);
+    string = Tcl_GetStringFromObj(headerObj, &length);
+    hash = Tclduk_Fnv1a(FNV_OFFSET_BASIS, string, length);
+    Tcl_DecrRefCount(headerObj);
+
+    /* Keep the name and the code apart, NUL included */
+    if (filenameObj) {
+        string = Tcl_GetStringFromObj(filenameObj, &length);
+        hash = Tclduk_Fnv1a(hash, string, length);
+    }
+    hash = Tclduk_Fnv1a(hash, "", 1);
+    hash = Tclduk_Fnv1a(hash, code, codeLength);
+
+    nameObj = Tcl_ObjPrintf("%08lx%08lx.dukbc",
+            (unsigned long) (hash >> 32), (unsigned long) (hash & 0xffffffff));
+    Tcl_IncrRefCount(nameObj);
+    pathObj = Tcl_FSJoinToPath(instanceData->codeCache, 1, &nameObj);
+    Tcl_DecrRefCount(nameObj);
+
+    return(pathObj);
+}
+
+/*
+ * Build the record that a code cache file keeps between the header and
+ * the bytecode: a line with the lengths of the file name and the code and
+ * a hash of the bytecode, then the file name and the code themselves.  A
+ * file is only used if its record matches the script being compiled, so
+ * neither a hash collision in the file name nor a truncated file loads the
+ * wrong bytecode.
+ * Return value: a new byte array object.
+ */
+static Tcl_Obj *Tclduk_CodeCacheRecord(
+    Tcl_Obj *filenameObj,
+    const char *code,
+    Tcl_Size codeLength,
+    const unsigned char *bytecode,
+    Tcl_Size bytecodeLength
+)
+{
+    Tcl_Obj *lineObj, *recordObj;
+    const char *line, *filename;
+    unsigned char *record;
+    Tcl_Size lineLength, filenameLength;
+    Tcl_WideUInt hash;
+
+    filename = "";
+    filenameLength = 0;
+    if (filenameObj) {
+        filename = Tcl_GetStringFromObj(filenameObj, &filenameLength);
+    }
+
+    hash = Tclduk_Fnv1a(FNV_OFFSET_BASIS, bytecode, bytecodeLength);
+    lineObj = Tcl_ObjPrintf("%lu %lu %08lx%08lx\n",
+            (unsigned long) filenameLength, (unsigned long) codeLength,
+            (unsigned long) (hash >> 32), (unsigned long) (hash & 0xffffffff));
+    line = Tcl_GetStringFromObj(lineObj, &lineLength);
+
+    recordObj = Tcl_NewObj();
+    record = Tcl_SetByteArrayLength(recordObj,
+            lineLength + filenameLength + codeLength);
+    memcpy(record, line, lineLength);
+    memcpy(record + lineLength, filename, filenameLength);
+    memcpy(record + lineLength + filenameLength, code, codeLength);
+    Tcl_DecrRefCount(lineObj);
+
+    return(recordObj);
+}
+
+/*
+ * Load the function from the contents of a code cache file read with
+ * Tclduk_ReadBundle if its record matches the script.
+ * Return value: 1 with the function pushed or 0 with the stack unchanged
+ * if the record doesn't match or the bytecode can't be loaded.
+ */
+static int Tclduk_CodeCacheLoad(
+    duk_context *ctx,
+    Tcl_Obj *cachedObj,
+    Tcl_Obj *filenameObj,
+    const char *code,
+    Tcl_Size codeLength
+)
+{
+    Tcl_Obj *recordObj;
+    unsigned char *cached, *record, *newline;
+    Tcl_Size cachedLength, recordLength, lineLength, filenameLength;
+    int matches;
+
+    cached = Tcl_GetByteArrayFromObj(cachedObj, &cachedLength);
+    newline = memchr(cached, '\n', cachedLength < 64 ? cachedLength : 64);
+    if (newline == NULL) {
+        return(0);
+    }
+    lineLength = (newline - cached) + 1;
+
+    filenameLength = 0;
+    if (filenameObj) {
+        Tcl_GetStringFromObj(filenameObj, &filenameLength);
+    }
+    if (cachedLength < lineLength + filenameLength + codeLength) {
+        return(0);
+    }
+
+    recordObj = Tclduk_CodeCacheRecord(filenameObj, code, codeLength,
+            cached + lineLength + filenameLength + codeLength,
+            cachedLength - lineLength - filenameLength - codeLength);
+    Tcl_IncrRefCount(recordObj);
+    record = Tcl_GetByteArrayFromObj(recordObj, &recordLength);
+    matches = recordLength == lineLength + filenameLength + codeLength
+            && memcmp(record, cached, recordLength) == 0;
+    Tcl_DecrRefCount(recordObj);
+    if (!matches) {
+        return(0);
+    }
+
+    duk_push_external_buffer(ctx);                     /* => [bytecode] */
+    duk_config_buffer(ctx, -1, cached + recordLength,
+            cachedLength - recordLength);
+    if (duk_safe_call(ctx, Tclduk_LoadFunction, NULL, 1, 1)
+            != DUK_EXEC_SUCCESS) {                     /* => [function|error] */
+        duk_pop(ctx);                                  /* => */
+        return(0);
+    }
+
+    return(1);
+}
+
+/*
+ * Store the function on top of the stack in the code cache.  Errors are
+ * ignored: the cache only saves time.  The bytecode is written to a
+ * temporary file that is then renamed so that other processes never load
+ * a partial file.
+ */
+static void Tclduk_CodeCacheStore(
+    duk_context *ctx,
+    Tcl_Obj *pathObj,
+    Tcl_Obj *filenameObj,
+    const char *code,
+    Tcl_Size codeLength
+)
+{
+    Tcl_Obj *tempObj, *recordObj;
+    Tcl_Time now;
+    void *bytecode;
+    duk_size_t bytecodeLength;
+
+    Tcl_GetTime(&now);
+    tempObj = Tcl_ObjPrintf("%s.%lx.%lx.%lx.tmp", Tcl_GetString(pathObj),
+            (unsigned long) now.sec, (unsigned long) now.usec,
+            (unsigned long) (size_t) Tcl_GetCurrentThread());
+    Tcl_IncrRefCount(tempObj);
+
+    duk_dup_top(ctx);                            /* => [function] [function] */
+    duk_dump_function(ctx);                      /* => [function] [bytecode] */
+    bytecode = duk_get_buffer(ctx, -1, &bytecodeLength);
+    recordObj = Tclduk_CodeCacheRecord(filenameObj, code, codeLength,
+            bytecode, (Tcl_Size) bytecodeLength);
+    Tcl_IncrRefCount(recordObj);
+    if (Tclduk_WriteBundle(NULL, ctx, tempObj, "WRONLY CREAT EXCL", recordObj)
+            == TCL_OK) {
+        if (Tcl_FSRenameFile(tempObj, pathObj) != 0) {
+            Tcl_FSDeleteFile(tempObj);
+        }
+    } else {
+        Tcl_FSDeleteFile(tempObj);
+    }
+    duk_pop(ctx);                                /* => [function] */
+
+    Tcl_DecrRefCount(recordObj);
+    Tcl_DecrRefCount(tempObj);
+}
+
+/*
+ * Load the preloaded bytecode of an instance into its heap and run it
+ * under the heap's default limits.
+ * Return value: TCL_OK or TCL_ERROR with a message in interp.
+ */
+static int Tclduk_Preload(
+    Tcl_Interp *interp,
+    struct DuktapeInstanceData *instanceData
+)
+{
+    struct DuktapeCallOptions opts;
+    struct DuktapeLimitsFrame frame;
+    duk_context *ctx;
+    duk_int_t duk_result;
+    unsigned char *bytecode;
+    Tcl_Size bytecodeLength;
+    int retval;
+
+    if (instanceData->preload == NULL) {
+        return(TCL_OK);
+    }
+
+    ctx = instanceData->ctx;
+    bytecode = Tcl_GetByteArrayFromObj(instanceData->preload, &bytecodeLength);
+
+    /*
+     * Load straight from the bytes of the Tcl object; the function does
+     * not refer to the buffer once it has been loaded
+     */
+    duk_push_external_buffer(ctx);                      /* => [buffer] */
+    duk_config_buffer(ctx, -1, bytecode, bytecodeLength);
+    if (duk_safe_call(ctx, Tclduk_LoadFunction, NULL, 1, 1)
+            != DUK_EXEC_SUCCESS) {                      /* => [error] */
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_PRELOAD,
+                duk_safe_to_string(ctx, -1)));
+        duk_pop(ctx);                                   /* => */
+        return(TCL_ERROR);
+    }                                                   /* => [function] */
+
+    opts.timeout = -1;
+    opts.budget = -1;
+    Tclduk_BeginLimits(instanceData, &opts, &frame);
+    duk_result = duk_pcall(ctx, 0);                     /* => [result|error] */
+    retval = TCL_OK;
+    if (duk_result != DUK_EXEC_SUCCESS) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_PRELOAD,
+                duk_safe_to_string(ctx, -1)));
+        retval = TCL_ERROR;
+    }
+    duk_pop(ctx);                                       /* => */
+
+    return Tclduk_EndLimits(interp, instanceData, &frame, retval);
+}
+
+static void
+cleanup_interp(ClientData cdata, Tcl_Interp *interp)
+{
+    struct DuktapeInstanceData *instanceData;
+    Tcl_HashEntry* hashPtr;
+    Tcl_HashSearch search;
+
+    hashPtr = Tcl_FirstHashEntry(&DUKTCL_CDATA->table, &search);
+    while (hashPtr != NULL) {
+        instanceData = (struct DuktapeInstanceData *) Tcl_GetHashValue(hashPtr);
+        Tcl_SetHashValue(hashPtr, (ClientData) NULL);
+
+        Tclduk_ForgetBound(instanceData);
+
+        Tclduk_DestroyHeap(instanceData);
+
+        instanceData->generation++;
+        Tclduk_TokenObjType_Reset(instanceData->handle);
+        Tclduk_InstanceClosed(instanceData);
+        hashPtr = Tcl_NextHashEntry(&search);
+    }
+    Tcl_DeleteHashTable(&DUKTCL_CDATA->table);
+    ckfree((char *)DUKTCL_CDATA);
+    return;
+    /* UNREACH: Disable some warnings */
+    interp = interp;
+}
+
+/*
+ * Convert JavaScript item to a Tcl item
+ */
+static Tcl_Obj *Tclduk_JSToTcl_function(duk_context *ctx, duk_idx_t idx) {
+    struct DuktapeInstanceData *instanceData;
+    struct DuktapeLambdaInstanceData *lambdaData;
+    duk_memory_functions funcs;
+    Tcl_HashEntry *hashPtr;
+    int isNew;
+
+    duk_get_memory_functions(ctx, &funcs);
+    instanceData = funcs.udata;
+
+    lambdaData = ckalloc(sizeof(*lambdaData));
+    lambdaData->refCount     = 1;
+    lambdaData->instanceData = instanceData;
+    lambdaData->generation   = instanceData->generation;
+    lambdaData->handle       = instanceData->handle;
+    lambdaData->serial       = ++instanceData->lambdaCount;
+    lambdaData->slot         = Tclduk_Pin(ctx, idx);
+    lambdaData->bytecode     = NULL;
+    lambdaData->named        = 0;
+    lambdaData->next         = NULL;
+
+    Tclduk_InstanceRetain(instanceData);
+    Tcl_IncrRefCount(lambdaData->handle);
+    Tclduk_ReclaimOrphans(instanceData);
+
+    hashPtr = Tcl_CreateHashEntry(&instanceData->exports,
+            (char *) (size_t) lambdaData->serial, &isNew);
+    Tcl_SetHashValue(hashPtr, lambdaData);
+
+    return(Tclduk_LambdaObjType_New(lambdaData));
+}
+
+static Tcl_Obj *Tclduk_JSToTclRecursive(duk_context *ctx, duk_idx_t idx,
+                                        int flags, int depth) {
+    const char *dukString, *key;
+    duk_size_t dukStringLength, keyLength;
+    duk_int_t arrayLength;
+    duk_idx_t arrayIndex;
+    duk_double_t number;
+    Tcl_Obj *dukStringObj, *dukItemObj, *dukKeyObj;
+    void *bufferData;
+    duk_size_t bufferLength;
+
+    /*
+     * Convert types
+     *     buffer          => ByteArray
+     *     array           => List
+     *     null/undefined  => empty string
+     *     other object    => JSON
+     *     everything else => string
+     * With JSTOTCL_NATIVE also
+     *     integral number => WideInt
+     *     other number    => Double
+     *     boolean         => Boolean
+     * With JSTOTCL_DICT
+     *     other object    => Dict of its own enumerable properties
+     * Return NULL if a value can't be converted or is nested too deeply.
+     */
+    dukString = NULL;
+    dukStringObj = NULL;
+    idx = duk_require_normalize_index(ctx, idx);
+
+    if (depth > JSTOTCL_MAX_DEPTH) {
+        return(NULL);
+    }
+    duk_require_stack(ctx, 3);
+
+    if (flags & JSTOTCL_NATIVE) {
+        switch (duk_get_type(ctx, idx)) {
+            case DUK_TYPE_NUMBER:
+                number = duk_get_number(ctx, idx);
+                if (number >= -9007199254740992.0
+                        && number <= 9007199254740992.0
+                        && (duk_double_t) (Tcl_WideInt) number == number) {
+                    return(Tcl_NewWideIntObj((Tcl_WideInt) number));
+                }
+                return(Tcl_NewDoubleObj(number));
+            case DUK_TYPE_BOOLEAN:
+                return(Tcl_NewBooleanObj(duk_get_boolean(ctx, idx)));
+            default:
+                break;
+        }
+    }
+
+    if (duk_check_type_mask(
+            ctx,
+            idx,
+            DUK_TYPE_MASK_NULL | DUK_TYPE_MASK_UNDEFINED
+        )) {
+        dukString = "";
+        dukStringLength = 0;
+    }
+
+    if (!dukString && !dukStringObj && duk_is_array(ctx, idx)) {
+        duk_get_prop_string(ctx, idx, "length");
+        arrayLength = duk_get_int(ctx, -1);
+        duk_pop(ctx);
+
+        dukStringObj = Tcl_NewObj();
+        for (arrayIndex = 0; arrayIndex < arrayLength; arrayIndex++) {
+            duk_get_prop_index(ctx, idx, arrayIndex);
+            dukItemObj = Tclduk_JSToTclRecursive(ctx, -1, flags, depth + 1);
+            duk_pop(ctx);
+
+            if (!dukItemObj) {
+                Tcl_DecrRefCount(dukStringObj);
+                return(NULL);
+            }
+
+            Tcl_ListObjAppendElement(NULL, dukStringObj, dukItemObj);
+        }
+    }
+
+    if (!dukString && !dukStringObj && duk_is_function(ctx, idx)) {
+        dukStringObj = Tclduk_JSToTcl_function(ctx, idx);
+    }
+
+    if (!dukString && !dukStringObj && duk_is_buffer_data(ctx, idx)) {
+        /* Copy the buffer (or the view's slice of it) straight to Tcl */
+        bufferData = duk_get_buffer_data(ctx, idx, &bufferLength);
+        dukStringObj = Tcl_NewByteArrayObj(
+            (const unsigned char *) bufferData,
+            bufferLength
+        );
+    }
+
+    if (!dukString
+        && !dukStringObj
+        && (flags & JSTOTCL_DICT)
+        && duk_check_type(ctx, idx, DUK_TYPE_OBJECT)) {
+        dukStringObj = Tcl_NewDictObj();
+        duk_enum(ctx, idx, DUK_ENUM_OWN_PROPERTIES_ONLY); /* => [enum] */
+        while (duk_next(ctx, -1, 1)) {                    /* => [enum] [key] [value] */
+            key = duk_get_lstring(ctx, -2, &keyLength);
+            dukKeyObj = Tcl_NewStringObj(key, keyLength);
+            dukItemObj = Tclduk_JSToTclRecursive(ctx, -1, flags, depth + 1);
+            duk_pop_2(ctx);                               /* => [enum] */
+
+            if (!dukItemObj) {
+                duk_pop(ctx);                             /* => */
+                Tcl_DecrRefCount(dukKeyObj);
+                Tcl_DecrRefCount(dukStringObj);
+                return(NULL);
+            }
+
+            Tcl_DictObjPut(NULL, dukStringObj, dukKeyObj, dukItemObj);
+        }
+        duk_pop(ctx);                                     /* => */
+    }
+
+    if (!dukString
+        && !dukStringObj
+        && duk_check_type(ctx, idx, DUK_TYPE_OBJECT)) {
+        duk_json_encode(ctx, idx);
+    }
+
+    if (!dukStringObj) {
+        if (!dukString) {
+            dukString = duk_safe_to_lstring(ctx, idx, &dukStringLength);
+        }
+
+        if (!dukString) {
+            return(NULL);
+        }
+
+        dukStringObj = Tcl_NewStringObj(dukString, dukStringLength);
+    }
+
+    return(dukStringObj);
+}
+
+static Tcl_Obj *Tclduk_JSToTcl(duk_context *ctx, duk_idx_t idx, int flags) {
+    return(Tclduk_JSToTclRecursive(ctx, idx, flags, 0));
+}
+
+/*
+ * Type specs of values converted to JavaScript by Tclduk_TclToJS, such as
+ * "array dict double", are compiled once into a tree of DuktapeType nodes
+ * and kept as the internal representation of a custom Tcl Obj type.
+ */
+static void Tclduk_FreeType(struct DuktapeType *type) {
+    Tcl_HashEntry *hashPtr;
+    Tcl_HashSearch search;
+
+    if (type == NULL) {
+        return;
+    }
+
+    Tclduk_FreeType(type->item);
+    if (type->keys != NULL) {
+        for (hashPtr = Tcl_FirstHashEntry(type->keys, &search);
+                hashPtr != NULL;
+                hashPtr = Tcl_NextHashEntry(&search)) {
+            Tclduk_FreeType(Tcl_GetHashValue(hashPtr));
+        }
+        Tcl_DeleteHashTable(type->keys);
+        ckfree(type->keys);
+    }
+    ckfree(type);
+}
+
+static struct DuktapeType *Tclduk_NewType(int valueType) {
+    struct DuktapeType *type;
+
+    type = ckalloc(sizeof(*type));
+    type->refCount = 1;
+    type->type = valueType;
+    type->item = NULL;
+    type->keys = NULL;
+
+    return(type);
+}
+
+/*
+ * Compile the type spec typeObj.
+ * Return value: the root of a new type tree or NULL with an error in interp
+ * if the spec is invalid.
+ */
+static struct DuktapeType *Tclduk_ParseType(
+    Tcl_Interp *interp,
+    Tcl_Obj *typeObj
+)
+{
+    struct DuktapeType *type, *keyType;
+    Tcl_Obj **words, *restObj, *keyObj, *keyTypeObj;
+    Tcl_Size numWords;
+    Tcl_DictSearch search;
+    Tcl_HashEntry *hashPtr;
+    int valueType, done, isNew;
+
+    if (Tcl_ListObjGetElements(interp, typeObj, &numWords, &words) != TCL_OK) {
+        return(NULL);
+    }
+
+    if (numWords == 0) {
+        return(Tclduk_NewType(VALUE_STRING));
+    }
+
+    if (Tcl_GetIndexFromObj(interp, words[0], valueTypes, "type", TCL_EXACT,
+            &valueType) != TCL_OK) {
+        return(NULL);
+    }
+
+    switch ((enum valueTypes) valueType) {
+        case VALUE_ARRAY:
+        case VALUE_DICT:
+        case VALUE_LIST_OF_DICT:
+            /* The rest of the words are the type of the items */
+            restObj = Tcl_NewListObj(numWords - 1, words + 1);
+            Tcl_IncrRefCount(restObj);
+            keyType = Tclduk_ParseType(interp, restObj);
+            Tcl_DecrRefCount(restObj);
+            if (keyType == NULL) {
+                return(NULL);
+            }
+
+            if (valueType == VALUE_LIST_OF_DICT) {
+                type = Tclduk_NewType(VALUE_DICT);
+                type->item = keyType;
+                keyType = type;
+                valueType = VALUE_ARRAY;
+            }
+
+            type = Tclduk_NewType(valueType);
+            type->item = keyType;
+            return(type);
+        case VALUE_DICT_OF:
+            type = Tclduk_NewType(VALUE_DICT_OF);
+            type->keys = ckalloc(sizeof(Tcl_HashTable));
+            Tcl_InitHashTable(type->keys, TCL_STRING_KEYS);
+            if (numWords < 2) {
+                return(type);
+            }
+
+            if (Tcl_DictObjFirst(interp, words[1], &search, &keyObj,
+                    &keyTypeObj, &done) != TCL_OK) {
+                Tclduk_FreeType(type);
+                return(NULL);
+            }
+            for (; !done; Tcl_DictObjNext(&search, &keyObj, &keyTypeObj,
+                    &done)) {
+                keyType = Tclduk_ParseType(interp, keyTypeObj);
+                if (keyType == NULL) {
+                    Tcl_DictObjDone(&search);
+                    Tclduk_FreeType(type);
+                    return(NULL);
+                }
+                hashPtr = Tcl_CreateHashEntry(type->keys,
+                        Tcl_GetString(keyObj), &isNew);
+                Tcl_SetHashValue(hashPtr, keyType);
+            }
+            return(type);
+        default:
+            return(Tclduk_NewType(valueType));
+    }
+}
+
+static void Tclduk_TypeObjType_Free(Tcl_Obj *typeObj) {
+    struct DuktapeType *type;
+
+    type = typeObj->internalRep.otherValuePtr;
+
+    type->refCount--;
+    if (type->refCount > 0) {
+        return;
+    }
+
+    Tclduk_FreeType(type);
+}
+
+static void Tclduk_TypeObjType_Dup(Tcl_Obj *src, Tcl_Obj *dest) {
+    struct DuktapeType *type;
+
+    type = src->internalRep.otherValuePtr;
+
+    type->refCount++;
+
+    dest->internalRep.otherValuePtr = type;
+    dest->typePtr = src->typePtr;
+}
+
+static Tcl_ObjType Tclduk_TypeObjType = {
+    "duktape_type" /* name */,
+    Tclduk_TypeObjType_Free,
+    Tclduk_TypeObjType_Dup,
+    NULL,
+#ifdef TCL_OBJTYPE_V0
+    NULL,
+    TCL_OBJTYPE_V0
+#else
+    NULL
+#endif
+};
+
+/*
+ * Get the compiled form of the type spec typeObj, compiling it if needed.
+ * Return value: the type tree, which belongs to typeObj, or NULL with an
+ * error in interp if the spec is invalid.
+ */
+static struct DuktapeType *Tclduk_GetTypeFromObj(
+    Tcl_Interp *interp,
+    Tcl_Obj *typeObj
+)
+{
+    struct DuktapeType *type;
+
+    if (typeObj->typePtr == &Tclduk_TypeObjType) {
+        return(typeObj->internalRep.otherValuePtr);
+    }
+
+    type = Tclduk_ParseType(interp, typeObj);
+    if (type == NULL) {
+        return(NULL);
+    }
+
+    /* The string rep is kept, so no updateStringProc is needed */
+    Tcl_GetString(typeObj);
+    if (typeObj->typePtr && typeObj->typePtr->freeIntRepProc) {
+        typeObj->typePtr->freeIntRepProc(typeObj);
+    }
+
+    typeObj->internalRep.otherValuePtr = type;
+    typeObj->typePtr = &Tclduk_TypeObjType;
+
+    return(type);
+}
+
+/*
+ * Compile a type spec for a heap.  Specs are interned by their string in
+ * instanceData->types, so the returned object is private to the heap and
+ * keeps its compiled form for as long as the heap's instance data lives.
+ * Return value: the interned type object or NULL with an error in interp.
+ */
+static Tcl_Obj *Tclduk_InternType(
+    Tcl_Interp *interp,
+    struct DuktapeInstanceData *instanceData,
+    Tcl_Obj *typeObj
+)
+{
+    Tcl_HashEntry *hashPtr;
+    Tcl_Obj *internedObj;
+    int isNew;
+
+    hashPtr = Tcl_FindHashEntry(&instanceData->types, Tcl_GetString(typeObj));
+    if (hashPtr != NULL) {
+        return(Tcl_GetHashValue(hashPtr));
+    }
+
+    internedObj = Tcl_DuplicateObj(typeObj);
+    Tcl_IncrRefCount(internedObj);
+    if (Tclduk_GetTypeFromObj(interp, internedObj) == NULL) {
+        Tcl_DecrRefCount(internedObj);
+        return(NULL);
+    }
+
+    hashPtr = Tcl_CreateHashEntry(&instanceData->types,
+            Tcl_GetString(typeObj), &isNew);
+    Tcl_SetHashValue(hashPtr, internedObj);
+
+    return(internedObj);
+}
+
+/*
+ * Convert the Tcl value to the JavaScript value that matches its internal
+ * type and push it: numbers for integers and doubles, booleans, buffers for
+ * byte arrays, objects for dicts and arrays for lists, converting their
+ * items the same way.  Other values, including integers too large for a
+ * wide int, become strings.  The value gets no string rep it didn't have.
+ */
+static void Tclduk_TclToJSAuto(duk_context *ctx, Tcl_Obj *value, int depth) {
+    const Tcl_ObjType *typePtr;
+    Tcl_Obj **items, *keyObj, *itemObj;
+    const char *valueString;
+    Tcl_DictSearch search;
+    Tcl_WideInt valueWide;
+    double valueDouble;
+    int valueBoolean, done;
+    Tcl_Size valueStringLength, numItems, idx;
+
+    typePtr = value->typePtr;
+    if (typePtr == NULL || depth > TCLTOJS_MAX_DEPTH) {
+        /* Pure strings and values nested too deeply */
+    } else if (typePtr == tclTypes.intType
+            || typePtr == tclTypes.wideIntType) {
+        if (Tcl_GetWideIntFromObj(NULL, value, &valueWide) == TCL_OK) {
+            duk_push_number(ctx, (duk_double_t) valueWide);
+            return;
+        }
+    } else if (typePtr == tclTypes.doubleType) {
+        if (Tcl_GetDoubleFromObj(NULL, value, &valueDouble) == TCL_OK) {
+            if (valueDouble != valueDouble) {
+                duk_push_nan(ctx);
+            } else {
+                duk_push_number(ctx, valueDouble);
+            }
+            return;
+        }
+    } else if (typePtr == tclTypes.booleanType
+            || typePtr == tclTypes.booleanStringType) {
+        if (Tcl_GetBooleanFromObj(NULL, value, &valueBoolean) == TCL_OK) {
+            duk_push_boolean(ctx, valueBoolean);
+            return;
+        }
+    } else if (typePtr == tclTypes.byteArrayType) {
+        valueString = (const char *) Tcl_GetByteArrayFromObj(value,
+                &valueStringLength);
+        memcpy(duk_push_fixed_buffer(ctx, valueStringLength), valueString,
+                valueStringLength);
+        return;
+    } else if (typePtr == tclTypes.dictType) {
+        if (Tcl_DictObjFirst(NULL, value, &search, &keyObj, &itemObj, &done)
+                == TCL_OK) {
+            duk_require_stack(ctx, 2);
+            duk_push_object(ctx);
+            for (; !done; Tcl_DictObjNext(&search, &keyObj, &itemObj, &done)) {
+                valueString = Tcl_GetStringFromObj(keyObj, &valueStringLength);
+                Tclduk_TclToJSAuto(ctx, itemObj, depth + 1);
+                duk_put_prop_lstring(ctx, -2, valueString, valueStringLength);
+            }
+            return;
+        }
+    } else if (typePtr == tclTypes.listType) {
+        if (Tcl_ListObjGetElements(NULL, value, &numItems, &items) == TCL_OK) {
+            duk_require_stack(ctx, 2);
+            duk_push_array(ctx);
+            for (idx = 0; idx < numItems; idx++) {
+                Tclduk_TclToJSAuto(ctx, items[idx], depth + 1);
+                duk_put_prop_index(ctx, -2, (duk_uarridx_t) idx);
+            }
+            return;
+        }
+    }
+
+    valueString = Tcl_GetStringFromObj(value, &valueStringLength);
+    duk_push_lstring(ctx, valueString, valueStringLength);
+}
+
+/*
+ * Convert Tcl item to a JavaScript item of the given type, or a string if
+ * type is NULL, and push that item to the end of the stack
+ * Return value: the number of values pushed, 0 if the type is undefined or
+ * the item can't be converted to it.
+ */
+static duk_idx_t Tclduk_TclToJS(
+    Tcl_Interp *interp,
+    Tcl_Obj *value,
+    duk_context *ctx,
+    struct DuktapeType *type
+)
+{
+    Tcl_Obj **items, *keyObj, *itemObj;
+    const char *valueString;
+    struct DuktapeType *itemType;
+    Tcl_HashEntry *hashPtr;
+    Tcl_DictSearch search;
+    double valueDouble;
+    int valueBoolean;
+    Tcl_Size valueStringLength, numItems;
+    Tcl_Size idx;
+    int done;
+
+    if (type == NULL) {
+        valueString = Tcl_GetStringFromObj(value, &valueStringLength);
+        duk_push_lstring(ctx, valueString, valueStringLength);
+        return(1);
+    }
+
+    switch ((enum valueTypes) type->type) {
+        case VALUE_AUTO:
+            Tclduk_TclToJSAuto(ctx, value, 0);
+            return(1);
+        case VALUE_UNDEFINED:
+            return(0);
+        case VALUE_BOOLEAN:
+            if (Tcl_GetBooleanFromObj(NULL, value, &valueBoolean) != TCL_OK) {
+                return(0);
+            }
+            duk_push_boolean(ctx, valueBoolean);
+            return(1);
+        case VALUE_NULL:
+            duk_push_null(ctx);
+            return(1);
+        case VALUE_BYTEARRAY:
+            valueString = (const char *) Tcl_GetByteArrayFromObj(
+                value,
+                &valueStringLength
+            );
+            memcpy(duk_push_fixed_buffer(ctx, valueStringLength),
+                    valueString, valueStringLength);
+            return(1);
+        case VALUE_BIGINT:
+        case VALUE_STRING:
+        case VALUE_JSON:
+            valueString = Tcl_GetStringFromObj(value, &valueStringLength);
+            duk_push_lstring(ctx, valueString, valueStringLength);
+
+            /* If JSON is being pushed, convert to an object */
+            if (type->type == VALUE_JSON) {
+                duk_json_decode(ctx, -1);
+            }
+
+            return(1);
+        case VALUE_DOUBLE:
+        case VALUE_INTEGER:
+            if (Tcl_GetDoubleFromObj(NULL, value, &valueDouble) != TCL_OK) {
+                return(0);
+            }
+            if (valueDouble != valueDouble) {
+                duk_push_nan(ctx);
+            } else {
+                duk_push_number(ctx, valueDouble);
+            }
+            return(1);
+        case VALUE_ARRAY:
+        case VALUE_LIST_OF_DICT: /* Compiled as array dict */
+            /*
+             * For each item in the list, format using this
+             * function
+             */
+            if (Tcl_ListObjGetElements(NULL, value, &numItems, &items)
+                    != TCL_OK) {
+                duk_push_null(ctx);
+                return(1);
+            }
+
+            duk_require_stack(ctx, 2);
+            duk_push_array(ctx);
+            for (idx = 0; idx < numItems; idx++) {
+                if (Tclduk_TclToJS(interp, items[idx], ctx, type->item) == 0) {
+                    duk_push_null(ctx);
+                }
+                duk_put_prop_index(ctx, -2, (duk_uarridx_t) idx);
+            }
+
+            return(1);
+        case VALUE_DICT:
+        case VALUE_DICT_OF:
+            /*
+             * "dict ?valueType?" formats every value as valueType,
+             * "dict-of {key type ...}" formats the value of each key with
+             * its own type and those of other keys as strings
+             */
+            if (Tcl_DictObjFirst(NULL, value, &search, &keyObj, &itemObj,
+                    &done) != TCL_OK) {
+                duk_push_null(ctx);
+                return(1);
+            }
+
+            duk_require_stack(ctx, 2);
+            duk_push_object(ctx);
+            for (; !done; Tcl_DictObjNext(&search, &keyObj, &itemObj, &done)) {
+                valueString = Tcl_GetStringFromObj(keyObj, &valueStringLength);
+
+                itemType = type->item;
+                if (type->keys != NULL) {
+                    hashPtr = Tcl_FindHashEntry(type->keys, valueString);
+                    itemType = hashPtr ? Tcl_GetHashValue(hashPtr) : NULL;
+                }
+
+                if (Tclduk_TclToJS(interp, itemObj, ctx, itemType) == 0) {
+                    duk_push_null(ctx);
+                }
+                duk_put_prop_lstring(ctx, -2, valueString, valueStringLength);
+            }
+
+            return(1);
+    }
+
+    return(0);
+}
+
+/*
+ * Evaluate a Tcl string and return the result to JavaScript
+ */
+static duk_ret_t EvalTclFromJSWithInterp(Tcl_Interp *interp,
+                                         duk_context *ctx,
+                                         Tcl_Obj *prefix,
+                                         struct DuktapeType *returnType,
+                                         int argFlags) {
+    Tcl_Obj *evalScript, *evalResult, *dukStringObj;
+    duk_idx_t numArgs, numRetVals;
+    int tclRet;
+    int idx;
+
+    numArgs = duk_get_top(ctx);
+    if (numArgs < 0) {
+        duk_push_error_object(
+            ctx,
+            DUK_ERR_ERROR,
+            "%s",
+            ERROR_INTERNAL_ARGS_ERROR
+        );
+        return(duk_throw(ctx));
+    }
+
+    /* The words of the prefix keep their internal reps */
+    evalScript = prefix ? Tcl_DuplicateObj(prefix) : Tcl_NewListObj(0, NULL);
+    for (idx = 0; idx < numArgs; idx++) {
+        dukStringObj = Tclduk_JSToTcl(ctx, idx, argFlags);
+        if (!dukStringObj) {
+            duk_push_error_object(
+                ctx,
+                DUK_ERR_TYPE_ERROR,
+                "%s",
+                ERROR_INVALID_STRING
+            );
+            return(duk_throw(ctx));
+        }
+
+        tclRet = Tcl_ListObjAppendElement(interp, evalScript, dukStringObj);
+        if (tclRet != TCL_OK) {
+            duk_push_error_object(
+                ctx,
+                DUK_ERR_ERROR,
+                "%s",
+                ERROR_INTERNAL_TCL_LAPPEND
+            );
+            return(duk_throw(ctx));
+        }
+    }
+    for (idx = 0; idx < numArgs; idx++) {
+        duk_pop(ctx);
+    }
+
+    tclRet = Tcl_EvalObjEx(interp, evalScript, 0);
+    if (tclRet != TCL_OK) {
+        duk_push_error_object(
+            ctx,
+            DUK_ERR_ERROR,
+            "%s",
+            Tcl_GetStringResult(interp)
+        );
+        return(duk_throw(ctx));
+    }
+
+    evalResult = Tcl_GetObjResult(interp);
+
+    numRetVals = Tclduk_TclToJS(interp, evalResult, ctx, returnType);
+
+    Tcl_ResetResult(interp);
+
+    return(numRetVals);
+}
+
+/*
+ * Return value: the interp of the heap ctx belongs to.  Throws a JavaScript
+ * error if the heap is safe or has no interp.
+ */
+static Tcl_Interp *Tclduk_UnsafeInterp(duk_context *ctx) {
+    struct DuktapeInstanceData *instanceData;
+    duk_memory_functions funcs;
+
+    duk_get_memory_functions(ctx, &funcs);
+    instanceData = funcs.udata;
+
+    if (!instanceData) {
+        (void) duk_error(ctx, DUK_ERR_ERROR, "%s", ERROR_INVALID_INSTANCE);
+        return(NULL);
+    }
+
+    if (!instanceData->isUnsafe) {
+        (void) duk_error(ctx, DUK_ERR_ERROR, "%s", ERROR_NOT_ALLOWED);
+        return(NULL);
+    }
+
+    if (!instanceData->interp) {
+        (void) duk_error(ctx, DUK_ERR_ERROR, "%s", ERROR_INVALID_INTERP);
+        return(NULL);
+    }
+
+    return(instanceData->interp);
+}
+
+static duk_ret_t EvalTclFromJS(duk_context *ctx) {
+    struct DuktapeInstanceData *instanceData;
+    duk_memory_functions funcs;
+    Tcl_Interp *interp;
+
+    interp = Tclduk_UnsafeInterp(ctx);
+
+    duk_get_memory_functions(ctx, &funcs);
+    instanceData = funcs.udata;
+
+    return(EvalTclFromJSWithInterp(interp, ctx, NULL, NULL,
+                                   instanceData->evalArgFlags));
+}
+
+/*
+ * Call the Tcl command named by the JavaScript argument first with the
+ * arguments after it, converted like those of Duktape.tcl.eval().  The
+ * command result is converted to returnType or by its internal type if
+ * returnType is NULL.
+ */
+static duk_ret_t Tclduk_CallTcl(
+    duk_context *ctx,
+    struct DuktapeInstanceData *instanceData,
+    duk_idx_t first,
+    struct DuktapeType *returnType
+)
+{
+    Tcl_Interp *interp;
+    Tcl_Obj *staticObjv[COMMAND_STATIC_ARGS], **objv;
+    duk_idx_t objc, i;
+    duk_ret_t numRetVals;
+    int tclRet;
+
+    interp = instanceData->interp;
+
+    objc = duk_get_top(ctx) - first;
+    if (objc < 1) {
+        return(duk_error(ctx, DUK_ERR_TYPE_ERROR, "%s", ERROR_CALL_COMMAND));
+    }
+
+    objv = objc <= COMMAND_STATIC_ARGS ? staticObjv
+            : (Tcl_Obj **) ckalloc(sizeof(Tcl_Obj *) * objc);
+    for (i = 0; i < objc; i++) {
+        objv[i] = Tclduk_JSToTcl(ctx, first + i,
+                i == 0 ? 0 : instanceData->evalArgFlags);
+        if (objv[i] == NULL) {
+            while (i > 0) {
+                i--;
+                Tcl_DecrRefCount(objv[i]);
+            }
+            if (objv != staticObjv) {
+                ckfree((char *) objv);
+            }
+            duk_push_error_object(ctx, DUK_ERR_TYPE_ERROR, "%s",
+                    ERROR_INVALID_STRING);
+            return(duk_throw(ctx));
+        }
+        Tcl_IncrRefCount(objv[i]);
+    }
+
+    tclRet = Tcl_EvalObjv(interp, (int) objc, objv, 0);
+
+    for (i = 0; i < objc; i++) {
+        Tcl_DecrRefCount(objv[i]);
+    }
+    if (objv != staticObjv) {
+        ckfree((char *) objv);
+    }
+
+    if (tclRet != TCL_OK) {
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "%s",
+                Tcl_GetStringResult(interp));
+        Tcl_ResetResult(interp);
+        return(duk_throw(ctx));
+    }
+
+    duk_set_top(ctx, 0);                   /* => */
+    if (returnType == NULL) {
+        Tclduk_TclToJSAuto(ctx, Tcl_GetObjResult(interp), 0);
+        numRetVals = 1;
+    } else {
+        numRetVals = Tclduk_TclToJS(interp, Tcl_GetObjResult(interp), ctx,
+                returnType);
+    }
+    Tcl_ResetResult(interp);
+
+    return(numRetVals);
+}
+
+/*
+ * Duktape.tcl.call(command, ...args)
+ */
+static duk_ret_t CallTclFromJS(duk_context *ctx) {
+    duk_memory_functions funcs;
+
+    Tclduk_UnsafeInterp(ctx);
+    duk_get_memory_functions(ctx, &funcs);
+
+    return(Tclduk_CallTcl(ctx, funcs.udata, 0, NULL));
+}
+
+/*
+ * Duktape.tcl.callAs(returnType, command, ...args)
+ */
+static duk_ret_t CallTclAsFromJS(duk_context *ctx) {
+    struct DuktapeInstanceData *instanceData;
+    duk_memory_functions funcs;
+    Tcl_Interp *interp;
+    Tcl_Obj *typeObj, *internedObj;
+    duk_size_t length;
+    const char *typeString;
+
+    interp = Tclduk_UnsafeInterp(ctx);
+    duk_get_memory_functions(ctx, &funcs);
+    instanceData = funcs.udata;
+
+    typeString = duk_safe_to_lstring(ctx, 0, &length);
+    typeObj = Tcl_NewStringObj(typeString, (Tcl_Size) length);
+    Tcl_IncrRefCount(typeObj);
+    internedObj = Tclduk_InternType(interp, instanceData, typeObj);
+    Tcl_DecrRefCount(typeObj);
+    if (internedObj == NULL) {
+        duk_push_error_object(ctx, DUK_ERR_TYPE_ERROR, "%s",
+                Tcl_GetStringResult(interp));
+        Tcl_ResetResult(interp);
+        return(duk_throw(ctx));
+    }
+
+    return(Tclduk_CallTcl(ctx, instanceData, 1,
+            Tclduk_GetTypeFromObj(NULL, internedObj)));
+}
+
+/*
+ * Look up the Tcl channel named name and check that it was opened with
+ * mode.  Throws a JavaScript error if it wasn't.
+ */
+static Tcl_Channel Tclduk_GetChannel(
+    duk_context *ctx,
+    Tcl_Interp *interp,
+    const char *name,
+    int mode
+)
+{
+    Tcl_Channel chan;
+    int chanMode;
+
+    chan = Tcl_GetChannel(interp, name, &chanMode);
+    if (chan == NULL) {
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "%s",
+                Tcl_GetStringResult(interp));
+        Tcl_ResetResult(interp);
+        (void) duk_throw(ctx);
+        return(NULL);
+    }
+    if ((chanMode & mode) != mode) {
+        (void) duk_error(ctx, DUK_ERR_ERROR,
+                mode == TCL_READABLE ? ERROR_CHANNEL_READABLE
+                : ERROR_CHANNEL_WRITABLE, name);
+        return(NULL);
+    }
+
+    return(chan);
+}
+
+/*
+ * The channel the "this" of a channel method stands for.
+ */
+static Tcl_Channel Tclduk_ThisChannel(duk_context *ctx, int mode) {
+    Tcl_Interp *interp;
+    Tcl_Channel chan;
+
+    interp = Tclduk_UnsafeInterp(ctx);
+    duk_push_this(ctx);                                /* => ... [this] */
+    duk_get_prop_literal(ctx, -1, "name");             /* => ... [this] [name] */
+    chan = Tclduk_GetChannel(ctx, interp, duk_require_string(ctx, -1), mode);
+    duk_pop_2(ctx);                                    /* => ... */
+
+    return(chan);
+}
+
+/*
+ * channel.read(n): read up to n bytes from the channel into a buffer
+ * without encoding conversion.  Returns a buffer, which is shorter than n
+ * bytes only at the end of the file.  The buffer grows as data arrives, so
+ * a large n costs nothing up front.
+ */
+static duk_ret_t Tclduk_ChannelRead(duk_context *ctx) {
+    Tcl_Channel chan;
+    duk_int_t size;
+    duk_size_t used, want;
+    Tcl_Size read;
+    char *data;
+
+    size = duk_require_int(ctx, 0);
+    if (size < 0) {
+        return(duk_error(ctx, DUK_ERR_RANGE_ERROR, ERROR_NEGATIVE,
+                duk_safe_to_string(ctx, 0)));
+    }
+    chan = Tclduk_ThisChannel(ctx, TCL_READABLE);
+
+    duk_push_dynamic_buffer(ctx, 0);                   /* => [n] [buffer] */
+    used = 0;
+    while (used < (duk_size_t) size) {
+        want = used > CHANNEL_READ_CHUNK ? used : CHANNEL_READ_CHUNK;
+        if (want > (duk_size_t) size - used) {
+            want = (duk_size_t) size - used;
+        }
+        data = duk_resize_buffer(ctx, -1, used + want);
+        /*
+         * Not Tcl_ReadRaw: that bypasses the channel's buffers, so it
+         * would skip data that gets() has already read into them.
+         */
+        read = Tcl_Read(chan, data + used, (Tcl_Size) want);
+        if (read < 0) {
+            return(duk_error(ctx, DUK_ERR_ERROR, "%s",
+                    Tcl_ErrnoMsg(Tcl_GetErrno())));
+        }
+        used += (duk_size_t) read;
+        /* The end of the file, or no more data on a nonblocking channel */
+        if ((duk_size_t) read < want) {
+            break;
+        }
+    }
+    duk_resize_buffer(ctx, -1, used);
+
+    return(1);
+}
+
+/*
+ * channel.write(data): write a buffer or the UTF-8 encoding of a string to
+ * the channel without encoding conversion.  Returns the number of bytes
+ * written.
+ */
+static duk_ret_t Tclduk_ChannelWrite(duk_context *ctx) {
+    Tcl_Channel chan;
+    const char *data;
+    duk_size_t length;
+    Tcl_Size written;
+
+    if (duk_is_buffer_data(ctx, 0)) {
+        data = duk_get_buffer_data(ctx, 0, &length);
+    } else {
+        data = duk_to_lstring(ctx, 0, &length);
+    }
+    chan = Tclduk_ThisChannel(ctx, TCL_WRITABLE);
+
+    /* Tcl_Write rather than Tcl_WriteRaw keeps the output buffered */
+    written = length == 0 ? 0 : Tcl_Write(chan, data, (Tcl_Size) length);
+    if (written < 0) {
+        return(duk_error(ctx, DUK_ERR_ERROR, "%s",
+                Tcl_ErrnoMsg(Tcl_GetErrno())));
+    }
+    duk_push_number(ctx, (duk_double_t) written);
+
+    return(1);
+}
+
+/*
+ * channel.gets(): read a line with the encoding and translation of the
+ * channel.  Returns the line without the newline or null at the end of the
+ * file.
+ */
+static duk_ret_t Tclduk_ChannelGets(duk_context *ctx) {
+    Tcl_Channel chan;
+    Tcl_Obj *lineObj;
+    const char *line;
+    Tcl_Size length;
+
+    chan = Tclduk_ThisChannel(ctx, TCL_READABLE);
+
+    lineObj = Tcl_NewObj();
+    Tcl_IncrRefCount(lineObj);
+    if (Tcl_GetsObj(chan, lineObj) < 0) {
+        Tcl_DecrRefCount(lineObj);
+        if (!Tcl_Eof(chan) && !Tcl_InputBlocked(chan)) {
+            return(duk_error(ctx, DUK_ERR_ERROR, "%s",
+                    Tcl_ErrnoMsg(Tcl_GetErrno())));
+        }
+        duk_push_null(ctx);
+        return(1);
+    }
+    line = Tcl_GetStringFromObj(lineObj, &length);
+    duk_push_lstring(ctx, line, length);
+    Tcl_DecrRefCount(lineObj);
+
+    return(1);
+}
+
+/*
+ * channel.eof(): whether the last read from the channel hit the end of the
+ * file.
+ */
+static duk_ret_t Tclduk_ChannelEof(duk_context *ctx) {
+    duk_push_boolean(ctx, Tcl_Eof(Tclduk_ThisChannel(ctx, 0)));
+    return(1);
+}
+
+static const duk_function_list_entry channelMethods[] = {
+    { "read", Tclduk_ChannelRead, 1 },
+    { "write", Tclduk_ChannelWrite, 1 },
+    { "gets", Tclduk_ChannelGets, 0 },
+    { "eof", Tclduk_ChannelEof, 0 },
+    { NULL, NULL, 0 }
+};
+
+/*
+ * Duktape.tcl.channel(name): an object for the Tcl channel name.  The
+ * objects share a prototype kept in the global stash and look the channel
+ * up by name on every call, so they fail cleanly once it is closed.
+ */
+static duk_ret_t Tclduk_Channel(duk_context *ctx) {
+    Tcl_Interp *interp;
+
+    interp = Tclduk_UnsafeInterp(ctx);
+    Tclduk_GetChannel(ctx, interp, duk_require_string(ctx, 0), 0);
+
+    duk_push_object(ctx);                              /* => [name] [channel] */
+    duk_push_global_stash(ctx);                        /* => [name] [channel] [stash] */
+    if (!duk_get_prop_literal(ctx, -1, "channelPrototype")) {
+                                                       /* => [name] [channel] [stash] [proto|undefined] */
+        duk_pop(ctx);                                  /* => [name] [channel] [stash] */
+        duk_push_object(ctx);                          /* => [name] [channel] [stash] [proto] */
+        duk_put_function_list(ctx, -1, channelMethods);
+        duk_dup_top(ctx);                              /* => [name] [channel] [stash] [proto] [proto] */
+        duk_put_prop_literal(ctx, -3, "channelPrototype");
+                                                       /* => [name] [channel] [stash] [proto] */
+    }
+    duk_set_prototype(ctx, -3);                        /* => [name] [channel] [stash] */
+    duk_pop(ctx);                                      /* => [name] [channel] */
+    duk_dup(ctx, 0);                                   /* => [name] [channel] [name] */
+    duk_put_prop_literal(ctx, -2, "name");             /* => [name] [channel] */
+
+    return(1);
+}
+
+static void MakeContextUnsafe(duk_context *ctx) {
+    struct DuktapeInstanceData *instanceData;
+    duk_memory_functions funcs;
+
+    duk_get_memory_functions(ctx, &funcs);
+    instanceData = funcs.udata;
+
+    instanceData->isUnsafe = 1;
+
+    duk_push_global_object(ctx);           /* => [global] */
+    duk_push_string(ctx, "Duktape");       /* => [global] ["duktape"] */
+    duk_get_prop(ctx, -2);                 /* => [global] [duktape] */
+    if (duk_is_object(ctx, -1)) {
+        duk_push_string(ctx, "tcl");   /* => [global] [duktape] ["tcl"] */
+        duk_push_object(ctx);          /* => [global] [duktape] ["tcl"] [object] */
+        duk_push_string(ctx, "eval");  /* => [global] [duktape] ["tcl"] [object] ["eval"] */
+        duk_push_c_function(ctx, EvalTclFromJS, DUK_VARARGS);
+                                       /* => [global] [duktape] ["tcl"] [object] ["eval"] [function] */
+        duk_put_prop(ctx, -3);         /* => [global] [duktape] ["tcl"] [object.eval=function] */
+        duk_push_c_function(ctx, CallTclFromJS, DUK_VARARGS);
+                                       /* => [global] [duktape] ["tcl"] [object] [function] */
+        duk_put_prop_literal(ctx, -2, "call");
+                                       /* => [global] [duktape] ["tcl"] [object.call=function] */
+        duk_push_c_function(ctx, CallTclAsFromJS, DUK_VARARGS);
+                                       /* => [global] [duktape] ["tcl"] [object] [function] */
+        duk_put_prop_literal(ctx, -2, "callAs");
+                                       /* => [global] [duktape] ["tcl"] [object.callAs=function] */
+        duk_push_c_function(ctx, Tclduk_Channel, 1);
+                                       /* => [global] [duktape] ["tcl"] [object] [function] */
+        duk_put_prop_literal(ctx, -2, "channel");
+                                       /* => [global] [duktape] ["tcl"] [object.channel=function] */
+        duk_put_prop(ctx, -3);         /* => [global] [duktape.tcl=object] */
+    }
+    duk_pop(ctx);                          /* => [global] */
+    duk_pop(ctx);                          /* => */
+
+    return;
+}
+
+static void MakeContextSafe(duk_context *ctx) {
+    struct DuktapeInstanceData *instanceData;
+    duk_memory_functions funcs;
+
+    duk_get_memory_functions(ctx, &funcs);
+    instanceData = funcs.udata;
+
+    instanceData->isUnsafe = 0;
+
+    duk_push_global_object(ctx);           /* => [global] */
+    duk_push_string(ctx, "Duktape");       /* => [global] ["duktape"] */
+    duk_get_prop(ctx, -2);                 /* => [global] [duktape] */
+    if (duk_is_object(ctx, -1)) {
+        duk_push_string(ctx, "tcl");   /* => [global] [duktape] ["tcl"] */
+        duk_del_prop(ctx, -2);         /* => [global] [duktape]  */
+    }
+    duk_pop(ctx);                          /* => [global] */
+    duk_pop(ctx);                          /* => */
+
+    return;
+}
+
+/*
+ * Initialize a Duktape intepreter.
+ * Return value: string token of the form "::duktape::(integer)".
+ * Side effects: creates an Duktape heap.
+ */
+static int
+Init_Cmd(ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    struct DuktapeInstanceData *instanceData;
+    duk_context *ctx;
+    Tcl_HashEntry *hashPtr;
+    int isNew;
+    Tcl_Obj *token;
+    int makeSafe = 1;
+    int countAllocations = 0;
+    int usePool = 0;
+    int arenaSize = ARENA_DEFAULT_SIZE;
+    int evalArgs = 0;
+    Tcl_WideInt timeout = 0;
+    Tcl_WideInt budget = 0;
+    Tcl_Obj *preloadPath = NULL;
+    Tcl_Obj *preload = NULL;
+    Tcl_Obj *codeCache = NULL;
+    Tcl_StatBuf *statBuf;
+    int tclRet;
+    int i, option;
+
+    static const char *options[] = {
+        "-allocator",
+        "-arena",
+        "-budget",
+        "-code-cache",
+        "-eval-args",
+        "-preload",
+        "-safe",
+        "-stats",
+        "-timeout",
+        (char *)NULL
+    };
+    enum options {
+        OPTION_ALLOCATOR,
+        OPTION_ARENA,
+        OPTION_BUDGET,
+        OPTION_CODE_CACHE,
+        OPTION_EVAL_ARGS,
+        OPTION_PRELOAD,
+        OPTION_SAFE,
+        OPTION_STATS,
+        OPTION_TIMEOUT
+    };
+    static const char *allocators[] = {
+        "default",
+        "pool",
+        (char *)NULL
+    };
+
+    if (objc % 2 != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_INIT);
+        return TCL_ERROR;
+    }
+
+    for (i = 1; i < objc; i += 2) {
+        if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0,
+                &option) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        switch ((enum options) option) {
+            case OPTION_ALLOCATOR:
+                tclRet = Tcl_GetIndexFromObj(interp, objv[i + 1], allocators,
+                        "allocator", 0, &usePool);
+                break;
+            case OPTION_ARENA:
+                tclRet = Tcl_GetIntFromObj(interp, objv[i + 1], &arenaSize);
+                if (tclRet == TCL_OK && arenaSize < ARENA_MIN_SIZE) {
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_ARENA_SIZE,
+                            ARENA_MIN_SIZE));
+                    tclRet = TCL_ERROR;
+                }
+                break;
+            case OPTION_BUDGET:
+                tclRet = Tclduk_GetLimit(interp, objv[i + 1], &budget);
+                break;
+            case OPTION_EVAL_ARGS:
+                tclRet = Tcl_GetIndexFromObj(interp, objv[i + 1], evalArgTypes,
+                        "argument type", 0, &evalArgs);
+                break;
+            case OPTION_CODE_CACHE:
+                codeCache = objv[i + 1];
+                tclRet = TCL_OK;
+                statBuf = Tcl_AllocStatBuf();
+                if (Tcl_FSStat(codeCache, statBuf) != 0
+                        || (statBuf->st_mode & S_IFMT) != S_IFDIR) {
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_CODE_CACHE,
+                            Tcl_GetString(codeCache)));
+                    tclRet = TCL_ERROR;
+                }
+                ckfree(statBuf);
+                break;
+            case OPTION_PRELOAD:
+                preloadPath = objv[i + 1];
+                tclRet = TCL_OK;
+                break;
+            case OPTION_STATS:
+                tclRet = Tcl_GetBooleanFromObj(interp, objv[i + 1],
+                        &countAllocations);
+                break;
+            case OPTION_TIMEOUT:
+                tclRet = Tclduk_GetLimit(interp, objv[i + 1], &timeout);
+                break;
+            case OPTION_SAFE:
+            default:
+                tclRet = Tcl_GetBooleanFromObj(interp, objv[i + 1], &makeSafe);
+                break;
+        }
+        if (tclRet != TCL_OK) {
+            return(tclRet);
+        }
+    }
+
+    if (preloadPath) {
+        preload = Tclduk_ReadPreload(interp, preloadPath);
+        if (preload == NULL) {
+            return TCL_ERROR;
+        }
+        Tcl_IncrRefCount(preload);
+    }
+
+    instanceData = ckalloc(sizeof(*instanceData));
+    instanceData->refCount = 1;
+    instanceData->generation = 0;
+    instanceData->interp = interp;
+    instanceData->lambdaCount = 0;
+    instanceData->lambdaSalt = (unsigned int) rand();
+    instanceData->orphans = NULL;
+    instanceData->jsonCount = 0;
+    instanceData->cdata = cdata;
+    instanceData->isUnsafe = 0;
+    instanceData->evalArgFlags = evalArgFlags[evalArgs];
+    instanceData->defaultTimeout = timeout;
+    instanceData->defaultBudget = budget;
+    memset(&instanceData->limits, 0, sizeof(instanceData->limits));
+    instanceData->countAllocations = countAllocations;
+    memset(&instanceData->stats, 0, sizeof(instanceData->stats));
+    instanceData->preload = preload;
+    instanceData->codeCache = codeCache;
+    if (codeCache) {
+        Tcl_IncrRefCount(codeCache);
+    }
+    instanceData->bound = NULL;
+    instanceData->running = 0;
+    instanceData->arena = usePool ? Tclduk_Arena_New(arenaSize) : NULL;
+
+    ctx = Tclduk_CreateHeap(instanceData);
+    if (ctx == NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(ERROR_CREATE, -1));
+        if (instanceData->arena) {
+            Tclduk_Arena_Reset(instanceData->arena);
+            ckfree(instanceData->arena);
+        }
+        if (preload) {
+            Tcl_DecrRefCount(preload);
+        }
+        if (codeCache) {
+            Tcl_DecrRefCount(codeCache);
+        }
+        ckfree(instanceData);
+        return TCL_ERROR;
+    }
+
+    instanceData->ctx = ctx;
+    Tcl_InitHashTable(&instanceData->types, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&instanceData->lambdas, TCL_ONE_WORD_KEYS);
+    Tcl_InitHashTable(&instanceData->commands, TCL_ONE_WORD_KEYS);
+    Tcl_InitHashTable(&instanceData->exports, TCL_ONE_WORD_KEYS);
+
+    DUKTCL_CDATA->counter++;
+    token = Tcl_ObjPrintf(NS "::%d", DUKTCL_CDATA->counter);
+    instanceData->handle = token;
+    Tcl_IncrRefCount(token);
+
+    hashPtr = Tcl_CreateHashEntry(&DUKTCL_CDATA->table, Tcl_GetString(token),
+            &isNew);
+    Tcl_SetHashValue(hashPtr, (ClientData) instanceData);
+
+    if (!makeSafe) {
+        MakeContextUnsafe(ctx);
+    }
+
+    if (Tclduk_Preload(interp, instanceData) != TCL_OK) {
+        parse_instance(cdata, interp, token, 1);
+        Tclduk_DeleteBound(instanceData);
+        Tclduk_DestroyHeap(instanceData);
+        Tclduk_InstanceClosed(instanceData);
+        return TCL_ERROR;
+    }
+
+    /*
+     * Return a copy of the token that already caches the instance
+     */
+    token = Tcl_DuplicateObj(token);
+    Tclduk_TokenObjType_Set(token, instanceData);
+
+    Tcl_SetObjResult(interp, token);
+    return TCL_OK;
+}
+
+static int MakeSafe_Cmd(
+    ClientData cdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[]
+)
+{
+    duk_context *ctx;
+
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_MAKE_SAFE);
+        return(TCL_ERROR);
+    }
+
+    ctx = parse_id(cdata, interp, objv[1]);
+    if (!ctx) {
+        return(TCL_ERROR);
+    }
+
+    MakeContextSafe(ctx);
+
+    return(TCL_OK);
+}
+
+static int MakeUnsafe_Cmd(
+    ClientData cdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[]
+)
+{
+    duk_context *ctx;
+
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_MAKE_UNSAFE);
+        return(TCL_ERROR);
+    }
+
+    ctx = parse_id(cdata, interp, objv[1]);
+    if (!ctx) {
+        return(TCL_ERROR);
+    }
+
+    MakeContextUnsafe(ctx);
+
+    return(TCL_OK);
+}
+
+/*
+ * Destroy a Duktape interpreter heap.  Fails while code runs in the heap.
+ * Return value: nothing.
+ * Side effects: destroys a Duktape interpreter heap.
+ */
+static int
+Close_Cmd(ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    struct DuktapeInstanceData *instanceData;
+
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_CLOSE);
+        return TCL_ERROR;
+    }
+
+    instanceData = parse_instance(cdata, interp, objv[1], 0);
+    if (instanceData == NULL) {
+        return TCL_ERROR;
+    }
+    if (Tclduk_CheckIdle(interp, instanceData) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    Tclduk_DeleteBound(instanceData);
+
+    parse_instance(cdata, interp, objv[1], 1);
+
+    Tclduk_DestroyHeap(instanceData);
+    Tclduk_InstanceClosed(instanceData);
+
+    return TCL_OK;
+}
+
+/*
+ * Report how much a heap has allocated.
+ * Usage: heap-stats ?token?
+ * Return value: a dict with the number of allocations and the number of
+ * bytes requested by the heap since it was created.  Without a token, the
+ * totals for every heap created in the Tcl interpreter, closed or not.
+ * Side effects: none.
+ */
+static int
+HeapStats_Cmd(
+    ClientData cdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[]
+)
+{
+    struct DuktapeInstanceData *instanceData;
+    struct DuktapeHeapStats stats;
+    Tcl_HashEntry *hashPtr;
+    Tcl_HashSearch search;
+    Tcl_Obj *result;
+
+    if (objc > 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_HEAP_STATS);
+        return TCL_ERROR;
+    }
+
+    if (objc == 2) {
+        instanceData = parse_instance(cdata, interp, objv[1], 0);
+        if (instanceData == NULL) {
+            return TCL_ERROR;
+        }
+        stats = instanceData->stats;
+    } else {
+        stats = DUKTCL_CDATA->closedStats;
+        for (hashPtr = Tcl_FirstHashEntry(&DUKTCL_CDATA->table, &search);
+                hashPtr != NULL;
+                hashPtr = Tcl_NextHashEntry(&search)) {
+            instanceData = Tcl_GetHashValue(hashPtr);
+            if (instanceData) {
+                stats.allocations += instanceData->stats.allocations;
+                stats.bytes += instanceData->stats.bytes;
+            }
+        }
+    }
+
+    result = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, result,
+            Tcl_NewStringObj("allocations", -1));
+    Tcl_ListObjAppendElement(NULL, result,
+            Tcl_NewWideIntObj(stats.allocations));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("bytes", -1));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewWideIntObj(stats.bytes));
+    Tcl_SetObjResult(interp, result);
+
+    return TCL_OK;
+}
+
+/*
+ * Record the baseline of a heap: an object in the global stash that maps
+ * the names of the own properties of the global object to their
+ * descriptors.  Called with duk_safe_call().
+ */
+static duk_ret_t Tclduk_Baseline(duk_context *ctx, void *udata) {
+    duk_push_global_stash(ctx);                        /* => [stash] */
+    duk_push_global_object(ctx);                       /* => [stash] [global] */
+    duk_push_bare_object(ctx);                         /* => [stash] [global] [descriptors] */
+    duk_enum(ctx, -2, DUK_ENUM_OWN_PROPERTIES_ONLY
+            | DUK_ENUM_INCLUDE_NONENUMERABLE);         /* => [stash] [global] [descriptors] [enum] */
+    while (duk_next(ctx, -1, 0)) {                     /* => [stash] [global] [descriptors] [enum] [key] */
+        duk_dup_top(ctx);                              /* => ... [enum] [key] [key] */
+        duk_get_prop_desc(ctx, -5, 0);                 /* => ... [enum] [key] [descriptor] */
+        duk_put_prop(ctx, -4);                         /* => [stash] [global] [descriptors] [enum] */
+    }
+    duk_pop(ctx);                                      /* => [stash] [global] [descriptors] */
+    duk_put_prop_literal(ctx, -3, "baseline");         /* => [stash] [global] */
+    duk_pop_2(ctx);                                    /* => */
+
+    return 0;
+    /* UNREACH: Disable some warnings */
+    udata = udata;
+}
+
+/*
+ * Compare a field of the property descriptors at idx1 and idx2.
+ */
+static int Tclduk_SameField(
+    duk_context *ctx,
+    duk_idx_t idx1,
+    duk_idx_t idx2,
+    const char *field
+)
+{
+    int same;
+
+    duk_get_prop_string(ctx, idx1, field);
+    duk_get_prop_string(ctx, idx2, field);
+    same = duk_samevalue(ctx, -1, -2);
+    duk_pop_2(ctx);
+
+    return(same);
+}
+
+/*
+ * Compare the property descriptors at idx1 and idx2.
+ */
+static int Tclduk_SameDescriptor(
+    duk_context *ctx,
+    duk_idx_t idx1,
+    duk_idx_t idx2
+)
+{
+    idx1 = duk_normalize_index(ctx, idx1);
+    idx2 = duk_normalize_index(ctx, idx2);
+
+    return(Tclduk_SameField(ctx, idx1, idx2, "value")
+            && Tclduk_SameField(ctx, idx1, idx2, "get")
+            && Tclduk_SameField(ctx, idx1, idx2, "set")
+            && Tclduk_SameField(ctx, idx1, idx2, "writable")
+            && Tclduk_SameField(ctx, idx1, idx2, "enumerable")
+            && Tclduk_SameField(ctx, idx1, idx2, "configurable"));
+}
+
+/*
+ * Define the property named by the key on top of the stack on the object
+ * at idx according to the descriptor below the key.  Pops both.
+ */
+static void Tclduk_DefineFromDescriptor(duk_context *ctx, duk_idx_t idx) {
+    duk_uint_t flags;
+    duk_idx_t descriptorIdx;
+
+    idx = duk_normalize_index(ctx, idx);
+    descriptorIdx = duk_normalize_index(ctx, -2);
+    flags = DUK_DEFPROP_HAVE_ENUMERABLE | DUK_DEFPROP_HAVE_CONFIGURABLE;
+    if (duk_get_prop_literal(ctx, descriptorIdx, "enumerable")
+            && duk_to_boolean(ctx, -1)) {
+        flags |= DUK_DEFPROP_ENUMERABLE;
+    }
+    duk_pop(ctx);
+    if (duk_get_prop_literal(ctx, descriptorIdx, "configurable")
+            && duk_to_boolean(ctx, -1)) {
+        flags |= DUK_DEFPROP_CONFIGURABLE;
+    }
+    duk_pop(ctx);                                      /* => [descriptor] [key] */
+
+    if (duk_has_prop_literal(ctx, descriptorIdx, "value")) {
+        flags |= DUK_DEFPROP_HAVE_VALUE | DUK_DEFPROP_HAVE_WRITABLE;
+        if (duk_get_prop_literal(ctx, descriptorIdx, "writable")
+                && duk_to_boolean(ctx, -1)) {
+            flags |= DUK_DEFPROP_WRITABLE;
+        }
+        duk_pop(ctx);
+        duk_get_prop_literal(ctx, descriptorIdx, "value"); /* => [descriptor] [key] [value] */
+    } else {
+        flags |= DUK_DEFPROP_HAVE_GETTER | DUK_DEFPROP_HAVE_SETTER;
+        duk_get_prop_literal(ctx, descriptorIdx, "get");   /* => [descriptor] [key] [getter] */
+        duk_get_prop_literal(ctx, descriptorIdx, "set");   /* => [descriptor] [key] [getter] [setter] */
+    }
+    duk_def_prop(ctx, idx, flags);                     /* => [descriptor] */
+    duk_pop(ctx);                                      /* => */
+}
+
+/*
+ * Restore the global object to the baseline.  Called with duk_safe_call().
+ * Throws if a property can't be deleted or redefined.
+ */
+static duk_ret_t Tclduk_RestoreBaseline(duk_context *ctx, void *udata) {
+    int same;
+
+    duk_push_global_stash(ctx);                        /* => [stash] */
+    duk_push_global_object(ctx);                       /* => [stash] [global] */
+    duk_get_prop_literal(ctx, -2, "baseline");         /* => [stash] [global] [descriptors] */
+
+    /* Remove the global properties that have been added */
+    duk_enum(ctx, -2, DUK_ENUM_OWN_PROPERTIES_ONLY
+            | DUK_ENUM_INCLUDE_NONENUMERABLE);         /* => ... [global] [descriptors] [enum] */
+    while (duk_next(ctx, -1, 0)) {                     /* => ... [global] [descriptors] [enum] [key] */
+        duk_dup_top(ctx);                              /* => ... [enum] [key] [key] */
+        if (duk_has_prop(ctx, -4)) {                   /* => ... [enum] [key] */
+            duk_pop(ctx);                              /* => ... [enum] */
+        } else {
+            duk_del_prop(ctx, -4);                     /* => ... [enum] */
+        }
+    }
+    duk_pop(ctx);                                      /* => ... [global] [descriptors] */
+
+    /* Put back the ones that have been changed or removed */
+    duk_enum(ctx, -1, DUK_ENUM_OWN_PROPERTIES_ONLY);   /* => ... [global] [descriptors] [enum] */
+    while (duk_next(ctx, -1, 1)) {                     /* => ... [enum] [key] [saved] */
+        duk_dup(ctx, -2);                              /* => ... [enum] [key] [saved] [key] */
+        duk_get_prop_desc(ctx, -6, 0);                 /* => ... [key] [saved] [descriptor|undefined] */
+        same = !duk_is_undefined(ctx, -1)
+                && Tclduk_SameDescriptor(ctx, -1, -2);
+        duk_pop(ctx);                                  /* => ... [enum] [key] [saved] */
+        if (same) {
+            duk_pop_2(ctx);                            /* => ... [enum] */
+        } else {
+            duk_swap_top(ctx, -2);                     /* => ... [enum] [saved] [key] */
+            Tclduk_DefineFromDescriptor(ctx, -5);      /* => ... [enum] */
+        }
+    }
+
+    return 0;
+    /* UNREACH: Disable some warnings */
+    udata = udata;
+}
+
+/*
+ * Record the state of the global object for restore-baseline.
+ * Usage: baseline token
+ * Return value: nothing.
+ * Side effects: replaces the previous baseline of the heap.
+ */
+static int
+Baseline_Cmd(
+    ClientData cdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[]
+)
+{
+    struct DuktapeInstanceData *instanceData;
+    duk_context *ctx;
+
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_BASELINE);
+        return TCL_ERROR;
+    }
+
+    instanceData = parse_instance(cdata, interp, objv[1], 0);
+    if (instanceData == NULL) {
+        return TCL_ERROR;
+    }
+
+    ctx = instanceData->ctx;
+
+    if (duk_safe_call(ctx, Tclduk_Baseline, NULL, 0, 1) != DUK_EXEC_SUCCESS) {
+        Tcl_SetObjResult(interp,
+                Tcl_NewStringObj(duk_safe_to_string(ctx, -1), -1));
+        duk_pop(ctx);
+        return TCL_ERROR;
+    }
+    duk_pop(ctx);
+
+    return TCL_OK;
+}
+
+/*
+ * Put the global object of a heap back the way it was when baseline was
+ * called: remove global properties added since then and restore the ones
+ * that were changed or deleted.
+ * Usage: restore-baseline token
+ * Return value: 1 if the global object is back to its baseline, 0 if it
+ * can't be restored because a global property can't be removed or
+ * redefined.  Changes to other objects, including the built-in ones, are
+ * not detected.  Fails while code runs in the heap.
+ * Side effects: deletes the bound function commands of the heap.
+ */
+static int
+RestoreBaseline_Cmd(
+    ClientData cdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[]
+)
+{
+    struct DuktapeInstanceData *instanceData;
+    duk_context *ctx;
+    int restored;
+
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_RESTORE_BASELINE);
+        return TCL_ERROR;
+    }
+
+    instanceData = parse_instance(cdata, interp, objv[1], 0);
+    if (instanceData == NULL) {
+        return TCL_ERROR;
+    }
+    if (Tclduk_CheckIdle(interp, instanceData) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    ctx = instanceData->ctx;
+
+    duk_push_global_stash(ctx);                            /* => [stash] */
+    if (!duk_has_prop_literal(ctx, -1, "baseline")) {
+        duk_pop(ctx);                                      /* => */
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(ERROR_NO_BASELINE, -1));
+        return TCL_ERROR;
+    }
+    duk_pop(ctx);                                          /* => */
+
+    Tclduk_DeleteBound(instanceData);
+
+    restored = duk_safe_call(ctx, Tclduk_RestoreBaseline, NULL, 0, 1)
+            == DUK_EXEC_SUCCESS;
+    duk_pop(ctx);
+
+    Tcl_SetObjResult(interp, Tcl_NewBooleanObj(restored));
+    return TCL_OK;
+}
+
+/*
+ * Replace the heap behind a token with a fresh one.  Fails while code runs
+ * in the heap.
+ * Usage: reset token
+ * Return value: nothing.
+ * Side effects: destroys the Duktape heap, its bound functions and pinned
+ * values and creates a new heap with the same allocator, safety setting and
+ * preloaded bundle.
+ */
+static int
+Reset_Cmd(ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    struct DuktapeInstanceData *instanceData;
+    duk_context *ctx;
+
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_RESET);
+        return TCL_ERROR;
+    }
+
+    instanceData = parse_instance(cdata, interp, objv[1], 0);
+    if (instanceData == NULL) {
+        return TCL_ERROR;
+    }
+    if (Tclduk_CheckIdle(interp, instanceData) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    Tclduk_DeleteBound(instanceData);
+    Tclduk_DestroyHeap(instanceData);
+
+    /*
+     * Values pinned in the old heap are gone; bumping the generation makes
+     * handles that refer to them reload or give up
+     */
+    instanceData->generation++;
+
+    ctx = Tclduk_CreateHeap(instanceData);
+    if (ctx == NULL) {
+        parse_instance(cdata, interp, objv[1], 1);
+        Tclduk_InstanceClosed(instanceData);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(ERROR_CREATE, -1));
+        return TCL_ERROR;
+    }
+    instanceData->ctx = ctx;
+
+    if (instanceData->isUnsafe) {
+        MakeContextUnsafe(ctx);
+    }
+
+    if (Tclduk_Preload(interp, instanceData) != TCL_OK) {
+        parse_instance(cdata, interp, objv[1], 1);
+        Tclduk_DeleteBound(instanceData);
+        Tclduk_DestroyHeap(instanceData);
+        Tclduk_InstanceClosed(instanceData);
+        return TCL_ERROR;
+    }
+
+    return TCL_OK;
+}
+
+/*
+ * Register a new global function within a context
+ */
+/*
+ * Evaluate a Tcl string and return the result to JavaScript
+ */
+static duk_ret_t EvalTclCmdFromJS(duk_context *ctx) {
+    struct DuktapeInstanceData *instanceData;
+    duk_memory_functions funcs;
+    Tcl_Interp *interp;
+    Tcl_Obj *prefix, *returnTypeObj;
+
+    duk_get_memory_functions(ctx, &funcs);
+    instanceData = funcs.udata;
+
+    interp = instanceData->interp;
+
+    duk_push_current_function(ctx);          /* => [args...] [function] */
+    duk_get_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("lambda"));      /* => [args...] [function] [lambda] */
+    prefix = duk_get_pointer(ctx, -1);
+    duk_pop(ctx);                            /* => [args...] [function] */
+
+    duk_get_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("returnType"));  /* => [args...] [function] [returnType] */
+    returnTypeObj = duk_get_pointer(ctx, -1);                       /* => [args...] [function] [returnType] */
+
+    duk_pop(ctx);                            /* => [args...] [function] */
+    duk_pop(ctx);                            /* => [args...] */
+
+    /* Interned types are compiled at registration, so this can't fail */
+    return(EvalTclFromJSWithInterp(interp, ctx, prefix, returnTypeObj == NULL ?
+            NULL : Tclduk_GetTypeFromObj(NULL, returnTypeObj), 0));
+}
+
+/*
+ * Finalizer of tcl-function functions: let go of the lambda.
+ */
+static duk_ret_t Tclduk_FunctionFinalizer(duk_context *ctx) {
+    struct DuktapeInstanceData *instanceData;
+    duk_memory_functions funcs;
+    Tcl_Obj *prefix;
+
+    duk_get_memory_functions(ctx, &funcs);
+    instanceData = funcs.udata;
+
+    duk_get_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("lambda")); /* => [function] [lambda] */
+    prefix = duk_get_pointer(ctx, -1);
+    if (prefix != NULL && instanceData != NULL) {
+        Tclduk_ForgetLambda(instanceData, prefix);
+    }
+    duk_push_pointer(ctx, NULL);                              /* => [function] [lambda] [NULL] */
+    duk_put_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("lambda")); /* => [function] [lambda] */
+
+    return(0);
+}
+
+static int RegisterFunction_Cmd(
+    ClientData cdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[]
+)
+{
+    struct DuktapeInstanceData *instanceData;
+    duk_context *ctx;
+    Tcl_Obj *lambdaObj, *returnTypeObj, *prefix;
+    const char *functionName;
+
+    if (objc != 5 && objc != 6) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_TCL_FUNCTION);
+        return(TCL_ERROR);
+    }
+
+    instanceData = parse_instance(cdata, interp, objv[1], 0);
+    if (instanceData == NULL) {
+        return(TCL_ERROR);
+    }
+
+    ctx = instanceData->ctx;
+
+    functionName = Tcl_GetStringFromObj(objv[2], NULL);
+
+    /* A NULL return type stands for string */
+    returnTypeObj = NULL;
+    if (objc == 6) {
+        returnTypeObj = Tclduk_InternType(interp, instanceData, objv[3]);
+        if (returnTypeObj == NULL) {
+            return(TCL_ERROR);
+        }
+        objv++;
+    }
+
+    lambdaObj = Tcl_NewListObj(2, objv + 3);
+    Tcl_ListObjAppendElement(interp, lambdaObj,
+      Tcl_NewStringObj(Tcl_GetCurrentNamespace(interp)->fullName, -1));
+    prefix = Tclduk_NewLambda(instanceData, lambdaObj);
+
+    duk_push_global_object(ctx);                                   /* => [global] */
+    duk_push_c_function(ctx, EvalTclCmdFromJS, DUK_VARARGS);       /* => [global] [function] */
+    duk_push_pointer(ctx, prefix);                                 /* => [global] [function] [lambda] */
+    duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("lambda"));     /* => [global] [function] */
+    duk_push_pointer(ctx, returnTypeObj);                          /* => [global] [function] [returnType] */
+    duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("returnType")); /* => [global] [function] */
+    duk_push_c_function(ctx, Tclduk_FunctionFinalizer, 2);         /* => [global] [function] [finalizer] */
+    duk_set_finalizer(ctx, -2);                                    /* => [global] [function] */
+    duk_put_prop_string(ctx, -2, functionName);                    /* => [global] */
+    duk_pop(ctx);                                                  /* => */
+
+    return(TCL_OK);
+}
+
+/*
+ * Call the command of a tcl-command function with the arguments of the
+ * JavaScript call.
+ */
+static duk_ret_t Tclduk_CallCommand(duk_context *ctx) {
+    struct DuktapeInstanceData *instanceData;
+    struct DuktapeCommandData *commandData;
+    duk_memory_functions funcs;
+    Tcl_Interp *interp;
+    Tcl_CmdInfo info;
+    Tcl_Obj *staticObjv[COMMAND_STATIC_ARGS], **objv, **words;
+    Tcl_Size numWords, objc, i;
+    duk_idx_t numArgs;
+    duk_ret_t numRetVals;
+    int flags, tclRet;
+
+    duk_get_memory_functions(ctx, &funcs);
+    instanceData = funcs.udata;
+
+    interp = instanceData->interp;
+
+    duk_push_current_function(ctx);                           /* => [args...] [function] */
+    duk_get_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("command")); /* => [args...] [function] [command] */
+    commandData = duk_get_pointer(ctx, -1);
+    duk_pop_2(ctx);                                           /* => [args...] */
+
+    if (commandData->token == NULL
+            && Tclduk_ResolveCommand(interp, commandData) != TCL_OK) {
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "%s",
+                Tcl_GetStringResult(interp));
+        Tcl_ResetResult(interp);
+        return(duk_throw(ctx));
+    }
+    Tcl_GetCommandInfoFromToken(commandData->token, &info);
+
+    Tcl_ListObjGetElements(NULL, commandData->words, &numWords, &words);
+    numArgs = duk_get_top(ctx);
+    objc = 1 + numWords + numArgs;
+    objv = objc <= COMMAND_STATIC_ARGS ? staticObjv
+            : (Tcl_Obj **) ckalloc(sizeof(Tcl_Obj *) * objc);
+    objv[0] = commandData->name;
+    memcpy(objv + 1, words, sizeof(Tcl_Obj *) * numWords);
+    for (i = 0; i <= numWords; i++) {
+        Tcl_IncrRefCount(objv[i]);
+    }
+    for (i = 0; i < numArgs; i++) {
+        flags = i < commandData->numArgTypes ? commandData->argFlags[i] : 0;
+        objv[1 + numWords + i] = Tclduk_JSToTcl(ctx, (duk_idx_t) i, flags);
+        if (objv[1 + numWords + i] == NULL) {
+            objc = 1 + numWords + i;
+            for (i = 0; i < objc; i++) {
+                Tcl_DecrRefCount(objv[i]);
+            }
+            if (objv != staticObjv) {
+                ckfree((char *) objv);
+            }
+            duk_push_error_object(ctx, DUK_ERR_TYPE_ERROR, "%s",
+                    ERROR_INVALID_STRING);
+            return(duk_throw(ctx));
+        }
+        Tcl_IncrRefCount(objv[1 + numWords + i]);
+    }
+
+    Tcl_ResetResult(interp);
+    if (info.isNativeObjectProc) {
+        tclRet = info.objProc(info.objClientData, interp, (int) objc, objv);
+    } else {
+        tclRet = Tcl_EvalObjv(interp, (int) objc, objv, 0);
+    }
+
+    for (i = 0; i < objc; i++) {
+        Tcl_DecrRefCount(objv[i]);
+    }
+    if (objv != staticObjv) {
+        ckfree((char *) objv);
+    }
+
+    if (tclRet != TCL_OK) {
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "%s",
+                Tcl_GetStringResult(interp));
+        Tcl_ResetResult(interp);
+        return(duk_throw(ctx));
+    }
+
+    duk_set_top(ctx, 0);                                      /* => */
+    /* Interned types are compiled at registration, so this can't fail */
+    numRetVals = Tclduk_TclToJS(interp, Tcl_GetObjResult(interp), ctx,
+            commandData->returnType == NULL ? NULL
+            : Tclduk_GetTypeFromObj(NULL, commandData->returnType));
+    Tcl_ResetResult(interp);
+
+    return(numRetVals);
+}
+
+/*
+ * Finalizer of tcl-command functions: stop tracing the command.
+ */
+static duk_ret_t Tclduk_CommandFinalizer(duk_context *ctx) {
+    struct DuktapeCommandData *commandData;
+
+    duk_get_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("command")); /* => [function] [command] */
+    commandData = duk_get_pointer(ctx, -1);
+    if (commandData != NULL) {
+        Tclduk_ForgetCommand(commandData);
+    }
+    duk_push_pointer(ctx, NULL);                               /* => [function] [command] [NULL] */
+    duk_put_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("command")); /* => [function] [command] */
+
+    return(0);
+}
+
+/*
+ * Create a global JavaScript function that calls a Tcl command without
+ * evaluating a script.
+ * Usage: tcl-command token jsName tclCommand ?returnType? ?argTypes?
+ * tclCommand is a command prefix: a command name and words to pass before
+ * the arguments of the JavaScript call.  argTypes lists how the arguments
+ * are converted by position: string, native or dict, like -eval-args.  The
+ * ones not listed are strings.
+ * Return value: nothing.
+ * Side effects: traces the command.
+ */
+static int RegisterCommand_Cmd(
+    ClientData cdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[]
+)
+{
+    struct DuktapeInstanceData *instanceData;
+    struct DuktapeCommandData *commandData;
+    Tcl_HashEntry *hashPtr;
+    duk_context *ctx;
+    Tcl_Obj *returnTypeObj, **typeObjs, **words;
+    Tcl_Size numArgTypes, numWords, i;
+    int *argFlags;
+    int argType, isNew;
+
+    if (objc < 4 || objc > 6) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_TCL_COMMAND);
+        return TCL_ERROR;
+    }
+
+    instanceData = parse_instance(cdata, interp, objv[1], 0);
+    if (instanceData == NULL) {
+        return TCL_ERROR;
+    }
+
+    ctx = instanceData->ctx;
+
+    if (Tcl_ListObjGetElements(interp, objv[3], &numWords, &words) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (numWords == 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_COMMAND, ""));
+        return TCL_ERROR;
+    }
+
+    /* A NULL return type stands for string */
+    returnTypeObj = NULL;
+    if (objc >= 5) {
+        returnTypeObj = Tclduk_InternType(interp, instanceData, objv[4]);
+        if (returnTypeObj == NULL) {
+            return TCL_ERROR;
+        }
+    }
+
+    numArgTypes = 0;
+    argFlags = NULL;
+    if (objc == 6) {
+        if (Tcl_ListObjGetElements(interp, objv[5], &numArgTypes, &typeObjs)
+                != TCL_OK) {
+            return TCL_ERROR;
+        }
+        argFlags = (int *) ckalloc(sizeof(int) * (numArgTypes + 1));
+        for (i = 0; i < numArgTypes; i++) {
+            if (Tcl_GetIndexFromObj(interp, typeObjs[i], evalArgTypes,
+                    "argument type", 0, &argType) != TCL_OK) {
+                ckfree((char *) argFlags);
+                return TCL_ERROR;
+            }
+            argFlags[i] = evalArgFlags[argType];
+        }
+    }
+
+    commandData = (struct DuktapeCommandData *) ckalloc(sizeof(*commandData));
+    commandData->instanceData = instanceData;
+    commandData->name = words[0];
+    Tcl_IncrRefCount(commandData->name);
+    commandData->words = Tcl_NewListObj(numWords - 1, words + 1);
+    Tcl_IncrRefCount(commandData->words);
+    commandData->token = NULL;
+    commandData->returnType = returnTypeObj;
+    commandData->numArgTypes = numArgTypes;
+    commandData->argFlags = argFlags;
+
+    if (Tclduk_ResolveCommand(interp, commandData) != TCL_OK) {
+        Tclduk_FreeCommand(commandData);
+        return TCL_ERROR;
+    }
+
+    hashPtr = Tcl_CreateHashEntry(&instanceData->commands,
+            (char *) commandData, &isNew);
+    Tcl_SetHashValue(hashPtr, (ClientData) commandData);
+
+    duk_push_global_object(ctx);                                   /* => [global] */
+    duk_push_c_function(ctx, Tclduk_CallCommand, DUK_VARARGS);     /* => [global] [function] */
+    duk_push_pointer(ctx, commandData);                            /* => [global] [function] [command] */
+    duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("command"));    /* => [global] [function] */
+    duk_push_c_function(ctx, Tclduk_CommandFinalizer, 2);          /* => [global] [function] [finalizer] */
+    duk_set_finalizer(ctx, -2);                                    /* => [global] [function] */
+    duk_put_prop_string(ctx, -2, Tcl_GetString(objv[2]));          /* => [global] */
+    duk_pop(ctx);                                                  /* => */
+
+    return TCL_OK;
+}
+
+static int EvalLambda_Cmd(
+    ClientData cdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[]
+)
+{
+    struct DuktapeInstanceData *instanceData;
+    struct DuktapeLambdaInstanceData *lambdaData;
+    duk_context *ctx;
+    duk_int_t duk_result;
+    Tcl_HashEntry *hashPtr;
+    Tcl_Obj *bytecodeObj, *result;
+    const char *lambdaName, *bytecode;
+    char *end;
+    Tcl_Size bytecodeLength;
+    unsigned long salt, serial;
+    int idx;
+    int retval;
+
+    if (objc < 4) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_EVAL_LAMBDA);
+        return(TCL_ERROR);
+    }
+
+    instanceData = parse_instance(cdata, interp, objv[1], 0);
+    if (instanceData == NULL) {
+        return(TCL_ERROR);
+    }
+
+    ctx = instanceData->ctx;
+
+    bytecodeObj = objv[2];
+    lambdaName = Tcl_GetString(objv[3]);
+
+    /*
+     * Look the function up by the serial number in the name of the lambda
+     * if the name is from this heap
+     */
+    lambdaData = NULL;
+    if (strncmp(lambdaName, LAMBDA_PREFIX, strlen(LAMBDA_PREFIX)) == 0) {
+        salt = strtoul(lambdaName + strlen(LAMBDA_PREFIX), &end, 10);
+        if (*end == '_' && salt == instanceData->lambdaSalt) {
+            serial = strtoul(end + 1, &end, 10);
+            hashPtr = Tcl_FindHashEntry(&instanceData->exports,
+                    (char *) (size_t) serial);
+            if (*end == '\0' && hashPtr != NULL) {
+                lambdaData = Tcl_GetHashValue(hashPtr);
+            }
+        }
+    }
+
+    /*
+     * If the function is no longer pinned, use the bytecode
+     */
+    if (lambdaData != NULL) {
+        Tclduk_PushPinned(ctx, lambdaData->slot);                 /* => [function] */
+    } else {
+        bytecode = Tcl_GetStringFromObj(bytecodeObj, &bytecodeLength);
+        if (bytecodeLength == 0) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(ERROR_LAMBDA, -1));
+            return(TCL_ERROR);
+        }
+
+        duk_push_lstring(ctx, (const char *) bytecode, bytecodeLength); /* => [bytecodeString] */
+        if (duk_safe_call(ctx, Tclduk_LoadBase64Function, NULL, 1, 1)
+                != DUK_EXEC_SUCCESS) {                            /* => [error] */
+            duk_pop(ctx);                                         /* => */
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(ERROR_LAMBDA, -1));
+            return(TCL_ERROR);
+        }                                                         /* => [function] */
+    }
+
+    /*
+     * Push each argument to the stack
+     * => [function] [args...]
+     */
+    for (idx = 4; idx < objc; idx++) {
+        Tclduk_TclToJS(interp, objv[idx], ctx, NULL);
+    }
+
+    /*
+     * Call the JavaScript function
+     */
+    instanceData->running++;
+    duk_result = duk_pcall(ctx, objc - 4);                        /* => [result|error] */
+    instanceData->running--;
+
+    retval = TCL_OK;
+    if (duk_result != DUK_EXEC_SUCCESS) {
+        retval = TCL_ERROR;
+        result = Tcl_NewStringObj(duk_safe_to_string(ctx, -1), -1);
+    } else {
+        result = Tclduk_JSToTcl(ctx, -1, 0);
+    }
+    duk_pop(ctx);                                                 /* => */
+
+    Tcl_SetObjResult(interp, result);
+
+    return(retval);
+}
+
+static duk_ret_t Tclduk_JsonEncode(duk_context *ctx, void *udata) {
+    duk_json_encode(ctx, -1);
+    return(1);
+    /* UNREACH: Disable some warnings */
+    udata = udata;
+}
+
+/*
+ * Convert the value on top of the stack with conversion->flags into
+ * conversion->obj.  Run with duk_safe_call since objects may be JSON-encoded,
+ * which throws on cyclic structures.
+ */
+static duk_ret_t Tclduk_ToNative(duk_context *ctx, void *udata) {
+    struct DuktapeConversion *conversion = udata;
+
+    conversion->obj = Tclduk_JSToTcl(ctx, -1, conversion->flags);
+    if (conversion->obj == NULL) {
+        return(duk_error(ctx, DUK_ERR_TYPE_ERROR, "%s", ERROR_INVALID_STRING));
+    }
+    return(0);
+}
+
+/*
+ * Parse the "-option value" pairs of eval, run and call-method from
+ * objv[first] on into opts.  If leading is set the options precede the
+ * positional arguments, so parsing stops at the first word that doesn't
+ * start with "-" or right after "--".
+ * Return value: TCL_OK or TCL_ERROR.  *next is set to the index of the
+ * first word that isn't part of an option.
+ */
+static int Tclduk_ParseCallOptions(
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[],
+    int first,
+    int leading,
+    struct DuktapeCallOptions *opts,
+    int *next
+)
+{
+    int i;
+    int optionIndex;
+    const char *option;
+
+    opts->resultType = RESULT_STRING;
+    opts->timeout = -1;
+    opts->budget = -1;
+
+    for (i = first; i < objc; i += 2) {
+        option = Tcl_GetString(objv[i]);
+        if (leading && option[0] != '-') {
+            break;
+        }
+        if (leading && strcmp(option, "--") == 0) {
+            i++;
+            break;
+        }
+
+        if (Tcl_GetIndexFromObj(interp, objv[i], callOptions, "option", 0,
+                &optionIndex) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (i + 1 == objc) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_OPTION_VALUE,
+                    option));
+            return TCL_ERROR;
+        }
+
+        switch ((enum callOptions) optionIndex) {
+            case CALL_OPTION_BUDGET:
+                if (Tclduk_GetLimit(interp, objv[i + 1], &opts->budget)
+                        != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                break;
+            case CALL_OPTION_RESULT:
+                if (Tcl_GetIndexFromObj(interp, objv[i + 1], resultTypes,
+                        "result type", 0, &opts->resultType) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                break;
+            case CALL_OPTION_TIMEOUT:
+                if (Tclduk_GetLimit(interp, objv[i + 1], &opts->timeout)
+                        != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+
+    *next = i;
+    return TCL_OK;
+}
+
+/*
+ * Convert the result of a call on top of the stack to a Tcl value as
+ * resultType and pop it.  Errors are always coerced to string.  Doesn't
+ * need an interp, so worker threads use it too.
+ * Return value: TCL_OK if the call succeeded, TCL_ERROR otherwise.
+ * *resultPtr is set to the value, which has a reference count of zero, or
+ * to NULL for the undefined result type.
+ */
+static int Tclduk_ResultObj(
+    duk_context *ctx,
+    duk_int_t duk_result,
+    int resultType,
+    Tcl_Obj **resultPtr
+)
+{
+    const char *json;
+    struct DuktapeConversion conversion;
+
+    if (duk_result != 0) {
+        resultType = RESULT_STRING;
+    }
+
+    switch ((enum resultTypes) resultType) {
+        case RESULT_UNDEFINED:
+            *resultPtr = NULL;
+            break;
+        case RESULT_JSON:
+            /* Cyclic structures make the encoder throw */
+            duk_result = duk_safe_call(ctx, Tclduk_JsonEncode, NULL, 1, 1);
+            json = duk_result == 0 ?
+                    duk_get_string(ctx, -1) : duk_safe_to_string(ctx, -1);
+            *resultPtr = Tcl_NewStringObj(json ? json : "", -1);
+            break;
+        case RESULT_DICT:
+        case RESULT_NATIVE:
+            conversion.flags = JSTOTCL_NATIVE;
+            if (resultType == RESULT_DICT) {
+                conversion.flags |= JSTOTCL_DICT;
+            }
+            duk_result = duk_safe_call(ctx, Tclduk_ToNative, &conversion,
+                    1, 1);
+            if (duk_result == 0) {
+                *resultPtr = conversion.obj;
+            } else {
+                *resultPtr = Tcl_NewStringObj(duk_safe_to_string(ctx, -1), -1);
+            }
+            break;
+        case RESULT_STRING:
+        default:
+            *resultPtr = Tcl_NewStringObj(duk_safe_to_string(ctx, -1), -1);
+            break;
+    }
+    duk_pop(ctx);
+
+    if (duk_result == 0) {
+        return TCL_OK;
+    } else {
+        return TCL_ERROR;
+    }
+}
+
+/*
+ * Set the interp result from the result of a call on top of the stack and
+ * pop it.  Errors are always coerced to string.
+ * Return value: TCL_OK if the call succeeded, TCL_ERROR otherwise.
+ */
+static int Tclduk_SetResult(
+    Tcl_Interp *interp,
+    duk_context *ctx,
+    duk_int_t duk_result,
+    int resultType
+)
+{
+    Tcl_Obj *result;
+    int tcl_result;
+
+    tcl_result = Tclduk_ResultObj(ctx, duk_result, resultType, &result);
+    if (result == NULL) {
+        Tcl_ResetResult(interp);
+    } else {
+        Tcl_SetObjResult(interp, result);
+    }
+
+    return tcl_result;
+}
+
+/*
+ * Start lending byte arrays to a call whose function is about to be pushed.
+ */
+static void Tclduk_BeginLoans(duk_context *ctx, struct DuktapeLoans *loans) {
+    loans->base = duk_get_top(ctx);
+    loans->values = NULL;
+}
+
+/*
+ * Detach the buffers lent to a call, so JavaScript code that kept them sees
+ * empty buffers, and drop them from the stack.  The string representations
+ * of the lent values are invalidated, since JavaScript may have written to
+ * their bytes.  Must be called when the stack holds nothing above the
+ * call's result except what the call pushed.
+ */
+static void Tclduk_EndLoans(duk_context *ctx, struct DuktapeLoans *loans) {
+    Tcl_Size count, i;
+    Tcl_Obj **values;
+
+    if (loans->values == NULL) {
+        return;
+    }
+
+    Tcl_ListObjGetElements(NULL, loans->values, &count, &values);
+    for (i = 0; i < count; i++) {
+        duk_config_buffer(ctx, loans->base, NULL, 0);
+        duk_remove(ctx, loans->base);
+        Tcl_InvalidateStringRep(values[i]);
+    }
+
+    Tcl_DecrRefCount(loans->values);
+    loans->values = NULL;
+}
+
+/*
+ * Push a call argument converted to one of callArgTypes.  A bytearray is
+ * pushed as an external buffer that refers to the bytes of value, which is
+ * added to loans.  A shared value, or one held by a shared list as told by
+ * inShared, is copied first, since JavaScript may write to the buffer and
+ * Tcl code run by the call may convert the value or see the list.
+ * Return value: TCL_OK or TCL_ERROR if the value can't be converted, in
+ * which case nothing is pushed.
+ */
+static int Tclduk_PushCallArg(
+    Tcl_Interp *interp,
+    duk_context *ctx,
+    struct DuktapeLoans *loans,
+    int type,
+    Tcl_Obj *value,
+    int inShared
+)
+{
+    int int_value;
+    double double_value;
+    unsigned char *bytes;
+    Tcl_Size length;
+
+    switch ((enum callArgTypes) type) {
+        case TYPE_BOOLEAN:
+            if (Tcl_GetIntFromObj(interp, value, &int_value) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            duk_push_boolean(ctx, int_value);
+            break;
+        case TYPE_BYTEARRAY:
+            if (inShared || Tcl_IsShared(value)) {
+                value = Tcl_DuplicateObj(value);
+            }
+            bytes = Tcl_GetByteArrayFromObj(value, &length);
+            duk_push_external_buffer(ctx);
+            duk_config_buffer(ctx, -1, bytes, length);
+            if (loans->values == NULL) {
+                loans->values = Tcl_NewListObj(0, NULL);
+                Tcl_IncrRefCount(loans->values);
+            }
+            Tcl_ListObjAppendElement(NULL, loans->values, value);
+            duk_dup_top(ctx);
+            duk_insert(ctx, loans->base);
+            break;
+        case TYPE_NAN:
+            duk_push_nan(ctx);
+            break;
+        case TYPE_NULL:
+            duk_push_null(ctx);
+            break;
+        case TYPE_NUMBER:
+            if (Tcl_GetDoubleFromObj(interp, value,
+                    &double_value) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            duk_push_number(ctx, double_value);
+            break;
+        case TYPE_UNDEFINED:
+            duk_push_undefined(ctx);
+            break;
+        case TYPE_STRING:
+        default:
+            duk_push_string(ctx, Tcl_GetString(value));
+            break;
+    }
+
+    return TCL_OK;
+}
+
+/*
+ * Evaluate a string as Duktape code in the selected heap.
+ * Usage: eval token code ?-result type?
+ * Return value: the result of the evaluation converted according to the
+ * result type, by default coerced to string.
+ * Side effects: may change the Duktape interpreter heap.
+ */
+static int
+Eval_Cmd(ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    struct DuktapeInstanceData *instanceData;
+    duk_context *ctx;
+    duk_int_t duk_result;
+    const char *js_code;
+    struct DuktapeCallOptions opts;
+    struct DuktapeLimitsFrame frame;
+    int next, retval;
+
+    if (objc < 3 || objc % 2 == 0) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_EVAL);
+        return TCL_ERROR;
+    }
+
+    if (Tclduk_ParseCallOptions(interp, objc, objv, 3, 0, &opts, &next)
+            != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    instanceData = parse_instance(cdata, interp, objv[1], 0);
+    if (instanceData == NULL) {
+        return TCL_ERROR;
+    }
+
+    ctx = instanceData->ctx;
+
+    js_code = Tcl_GetString(objv[2]);
+
+    Tclduk_BeginLimits(instanceData, &opts, &frame);
+    duk_result = duk_peval_string(ctx, js_code);
+    retval = Tclduk_SetResult(interp, ctx, duk_result, opts.resultType);
+
+    return Tclduk_EndLimits(interp, instanceData, &frame, retval);
+}
+
+/*
+ * Compile a string of Duktape code without running it.
+ * Usage: compile token code ?-filename name?
+ * Return value: a handle to the compiled code to pass to run.
+ * Side effects: pins the compiled function in the Duktape heap until the
+ * handle is freed.  With a code cache, loads the function from the cache
+ * instead of compiling it or stores it there.
+ */
+static int
+Compile_Cmd(
+    ClientData cdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[]
+)
+{
+    struct DuktapeInstanceData *instanceData;
+    duk_context *ctx;
+    duk_int_t duk_result;
+    Tcl_Obj *compiledObj, *bytecodeObj, *cachePathObj, *cachedObj;
+    Tcl_Obj *filenameObj;
+    const char *js_code, *dukString;
+    Tcl_Size js_code_length;
+    duk_size_t dukStringLength;
+    int loaded;
+
+    if (objc != 3 && objc != 5) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_COMPILE);
+        return TCL_ERROR;
+    }
+
+    if (objc == 5
+            && strcmp(Tcl_GetStringFromObj(objv[3], NULL), "-filename") != 0) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_COMPILE);
+        return TCL_ERROR;
+    }
+
+    instanceData = parse_instance(cdata, interp, objv[1], 0);
+    if (instanceData == NULL) {
+        return TCL_ERROR;
+    }
+
+    ctx = instanceData->ctx;
+
+    js_code = Tcl_GetStringFromObj(objv[2], &js_code_length);
+    filenameObj = objc == 5 ? objv[4] : NULL;
+
+    cachePathObj = NULL;
+    loaded = 0;
+    if (instanceData->codeCache) {
+        cachePathObj = Tclduk_CodeCachePath(instanceData, filenameObj,
+                js_code, js_code_length);
+        Tcl_IncrRefCount(cachePathObj);
+        cachedObj = Tclduk_ReadBundle(NULL, cachePathObj);
+        if (cachedObj) {
+            Tcl_IncrRefCount(cachedObj);
+            loaded = Tclduk_CodeCacheLoad(ctx, cachedObj, filenameObj,
+                    js_code, js_code_length);  /* => [function]? */
+            Tcl_DecrRefCount(cachedObj);
+
+            /* Compile over an entry for other code or a damaged one */
+            if (!loaded) {
+                Tcl_FSDeleteFile(cachePathObj);
+            }
+        }
+    }
+
+    if (!loaded) {
+        if (objc == 5) {
+            duk_push_string(ctx, Tcl_GetString(objv[4])); /* => [filename] */
+            duk_result = duk_pcompile_lstring_filename(ctx, DUK_COMPILE_EVAL,
+                    js_code, js_code_length);          /* => [function|error] */
+        } else {
+            duk_result = duk_pcompile_lstring(ctx, DUK_COMPILE_EVAL,
+                    js_code, js_code_length);          /* => [function|error] */
+        }
+
+        if (duk_result != 0) {
+            Tcl_SetObjResult(interp,
+                    Tcl_NewStringObj(duk_safe_to_string(ctx, -1), -1));
+            duk_pop(ctx);
+            if (cachePathObj) {
+                Tcl_DecrRefCount(cachePathObj);
+            }
+            return TCL_ERROR;
+        }
+
+        if (cachePathObj) {
+            Tclduk_CodeCacheStore(ctx, cachePathObj, filenameObj,
+                    js_code, js_code_length);
+        }
+    }
+    if (cachePathObj) {
+        Tcl_DecrRefCount(cachePathObj);
+    }
+
+    duk_dup_top(ctx);                                           /* => [function] [function] */
+    duk_dump_function(ctx);                                     /* => [function] [bytecode] */
+    duk_base64_encode(ctx, -1);                                 /* => [function] [bytecode.b64] */
+    dukString = duk_get_lstring(ctx, -1, &dukStringLength);
+    bytecodeObj = Tcl_NewStringObj(dukString, dukStringLength);
+    duk_pop(ctx);                                               /* => [function] */
+
+    compiledObj = Tcl_NewObj();
+    Tcl_InvalidateStringRep(compiledObj);
+    Tclduk_CompiledObjType_Set(instanceData, compiledObj, bytecodeObj);
+    duk_pop(ctx);                                               /* => */
+
+    Tcl_SetObjResult(interp, compiledObj);
+    return TCL_OK;
+}
+
+/*
+ * Compile a script and save its bytecode for init -preload.
+ * Usage: dump-bundle token file script
+ * Return value: nothing.
+ * Side effects: writes the bundle to file, replacing it.
+ */
+static int
+DumpBundle_Cmd(
+    ClientData cdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[]
+)
+{
+    struct DuktapeInstanceData *instanceData;
+    duk_context *ctx;
+    duk_int_t duk_result;
+    Tcl_Obj *recordObj;
+    const char *js_code;
+    void *bytecode;
+    duk_size_t bytecodeLength;
+    Tcl_Size js_code_length;
+    int retval;
+
+    if (objc != 4) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_DUMP_BUNDLE);
+        return TCL_ERROR;
+    }
+
+    instanceData = parse_instance(cdata, interp, objv[1], 0);
+    if (instanceData == NULL) {
+        return TCL_ERROR;
+    }
+
+    ctx = instanceData->ctx;
+
+    js_code = Tcl_GetStringFromObj(objv[3], &js_code_length);
+    duk_push_string(ctx, Tcl_GetString(objv[2]));   /* => [filename] */
+    duk_result = duk_pcompile_lstring_filename(ctx, 0,
+            js_code, js_code_length);                /* => [function|error] */
+    if (duk_result != 0) {
+        Tcl_SetObjResult(interp,
+                Tcl_NewStringObj(duk_safe_to_string(ctx, -1), -1));
+        duk_pop(ctx);
+        return TCL_ERROR;
+    }
+
+    duk_dump_function(ctx);                          /* => [bytecode] */
+    bytecode = duk_get_buffer(ctx, -1, &bytecodeLength);
+    recordObj = Tclduk_BundleRecord(bytecode, (Tcl_Size) bytecodeLength);
+    Tcl_IncrRefCount(recordObj);
+    retval = Tclduk_WriteBundle(interp, ctx, objv[2], "w", recordObj);
+    Tcl_DecrRefCount(recordObj);
+    duk_pop(ctx);                                    /* => */
+
+    return retval;
+}
+
+/*
+ * Run code compiled with compile.
+ * Usage: run token handle ?-result type?
+ * Return value: the result of the evaluation converted according to the
+ * result type, by default coerced to string.
+ * Side effects: may change the Duktape interpreter heap.
+ */
+static int
+Run_Cmd(ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    struct DuktapeInstanceData *instanceData;
+    duk_context *ctx;
+    duk_int_t duk_result;
+    struct DuktapeCallOptions opts;
+    struct DuktapeLimitsFrame frame;
+    int next, retval;
+
+    if (objc < 3 || objc % 2 == 0) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_RUN);
+        return TCL_ERROR;
+    }
+
+    if (Tclduk_ParseCallOptions(interp, objc, objv, 3, 0, &opts, &next)
+            != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    instanceData = parse_instance(cdata, interp, objv[1], 0);
+    if (instanceData == NULL) {
+        return TCL_ERROR;
+    }
+
+    ctx = instanceData->ctx;
+
+    if (Tclduk_PushCompiled(interp, instanceData, objv[2]) != TCL_OK) {
+        return TCL_ERROR;
+    }                                                           /* => [function] */
+
+    duk_push_global_object(ctx);                                /* => [function] [global] */
+    Tclduk_BeginLimits(instanceData, &opts, &frame);
+    duk_result = duk_pcall_method(ctx, 0);                      /* => [result] */
+    retval = Tclduk_SetResult(interp, ctx, duk_result, opts.resultType);
+
+    return Tclduk_EndLimits(interp, instanceData, &frame, retval);
+}
+
+
+/*
+ * Call a JS method/function.
+ * Usage: call-method ?-result type? ?--? token method this ?{arg ?type?}? ...
+ * Return value: the result of the method call converted according to the
+ * result type, by default coerced to string.
+ * Side effects: may change the Duktape interpreter heap.
+ */
+static int
+CallMethod_Cmd(
+    ClientData cdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[]
+)
+{
+    int i;
+    Tcl_Size list_length;
+    int tableIndex;
+    duk_context *ctx;
+    duk_int_t duk_result;
+    Tcl_Obj *value;
+    Tcl_Obj *type;
+    struct DuktapeInstanceData *instanceData;
+    struct DuktapeCallOptions opts;
+    struct DuktapeLimitsFrame frame;
+    struct DuktapeLoans loans;
+    int next, retval;
+
+    if (Tclduk_ParseCallOptions(interp, objc, objv, 1, 1, &opts, &next)
+            != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    if (objc - next < 3) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_CALL_METHOD);
+        return TCL_ERROR;
+    }
+
+    /* Drop the options so that objv[1] is the token. */
+    objc -= next - 1;
+    objv += next - 1;
+
+    instanceData = parse_instance(cdata, interp, objv[1], 0);
+    if (instanceData == NULL) {
+        return TCL_ERROR;
+    }
+
+    ctx = instanceData->ctx;
+
+    Tclduk_BeginLimits(instanceData, &opts, &frame);
+    Tclduk_BeginLoans(ctx, &loans);
+
+    /* Eval the function name and "this" to put them on the stack. */
+    for (i = 2; i < 4; i++)
+    {
+        duk_result = duk_peval_string(ctx, Tcl_GetString(objv[i]));
+        if (duk_result != 0) {
+            Tcl_SetObjResult(interp,
+                    Tcl_NewStringObj(
+                        duk_safe_to_string(ctx, -1), -1));
+            duk_pop_n(ctx, i - 1);
+            return Tclduk_EndLimits(interp, instanceData, &frame, TCL_ERROR);
+        }
+    }
+
+    /* Push the arguments. */
+    for (i = 4; i < objc; i++) {
+        retval = TCL_OK;
+        if (Tcl_ListObjIndex(interp, objv[i], 0, &value) != TCL_OK
+                || Tcl_ListObjLength(interp, objv[i], &list_length) != TCL_OK) {
+            retval = TCL_ERROR;
+        } else if (list_length == 2) {
+            if (Tcl_ListObjIndex(interp, objv[i], 1, &type) != TCL_OK
+                    || Tcl_GetIndexFromObj(interp, type, callArgTypes, "type",
+                            0, &tableIndex) != TCL_OK) {
+                retval = TCL_ERROR;
+            }
+        } else if (list_length == 1) {
+            tableIndex = TYPE_STRING;
+        } else {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(ERROR_ARG_LENGTH, -1));
+            retval = TCL_ERROR;
+        }
+
+        if (retval == TCL_OK) {
+            retval = Tclduk_PushCallArg(interp, ctx, &loans, tableIndex, value,
+                    Tcl_IsShared(objv[i]));
+        }
+
+        if (retval != TCL_OK) {
+            Tclduk_EndLoans(ctx, &loans);
+            duk_set_top(ctx, loans.base);
+            return Tclduk_EndLimits(interp, instanceData, &frame, TCL_ERROR);
+        }
+    }
+    duk_result = duk_pcall_method(ctx, objc - 4);
+
+    retval = Tclduk_SetResult(interp, ctx, duk_result, opts.resultType);
+    Tclduk_EndLoans(ctx, &loans);
+    return Tclduk_EndLimits(interp, instanceData, &frame, retval);
+}
+
+/*
+ * Call a JS function once for every tuple of arguments in a list.  The
+ * function is evaluated once and the results are collected in C.
+ * Usage: call-batch token function argTupleList ?-types {?type ...?}?
+ * ?-errors stop|collect? ?-result type? ?-timeout ms? ?-budget count?
+ * Return value: the list of the results converted according to the result
+ * type.  With "-errors collect" a list of that list, in which failed calls
+ * have empty results, and a dict that maps the indices of the failed calls
+ * to their errors.
+ * Side effects: may change the Duktape interpreter heap.
+ */
+static int
+CallBatch_Cmd(
+    ClientData cdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[]
+)
+{
+    struct DuktapeInstanceData *instanceData;
+    struct DuktapeCallOptions opts;
+    struct DuktapeLimitsFrame frame;
+    struct DuktapeLoans loans;
+    duk_context *ctx;
+    duk_int_t duk_result;
+    Tcl_Obj **tupleObjs, **argObjs, **typeObjs;
+    Tcl_Obj *tuples, *results, *errors, *result, *pair[2];
+    Tcl_Size tupleCount, argCount, typeCount, i, j;
+    int *argTypes;
+    int optionIndex, errorMode, retval;
+
+    if (objc < 4 || objc % 2 == 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_CALL_BATCH);
+        return TCL_ERROR;
+    }
+
+    opts.resultType = RESULT_STRING;
+    opts.timeout = -1;
+    opts.budget = -1;
+    errorMode = BATCH_ERRORS_STOP;
+    typeObjs = NULL;
+    typeCount = 0;
+    for (i = 4; i < objc; i += 2) {
+        if (Tcl_GetIndexFromObj(interp, objv[i], batchOptions, "option", 0,
+                &optionIndex) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        switch ((enum batchOptions) optionIndex) {
+            case BATCH_OPTION_BUDGET:
+                retval = Tclduk_GetLimit(interp, objv[i + 1], &opts.budget);
+                break;
+            case BATCH_OPTION_ERRORS:
+                retval = Tcl_GetIndexFromObj(interp, objv[i + 1],
+                        batchErrorModes, "error mode", 0, &errorMode);
+                break;
+            case BATCH_OPTION_RESULT:
+                retval = Tcl_GetIndexFromObj(interp, objv[i + 1],
+                        resultTypes, "result type", 0, &opts.resultType);
+                break;
+            case BATCH_OPTION_TIMEOUT:
+                retval = Tclduk_GetLimit(interp, objv[i + 1], &opts.timeout);
+                break;
+            case BATCH_OPTION_TYPES:
+            default:
+                retval = Tcl_ListObjGetElements(interp, objv[i + 1],
+                        &typeCount, &typeObjs);
+                break;
+        }
+        if (retval != TCL_OK) {
+            return TCL_ERROR;
+        }
+    }
+
+    argTypes = (int *) ckalloc(sizeof(int) * (typeCount + 1));
+    for (i = 0; i < typeCount; i++) {
+        if (Tcl_GetIndexFromObj(interp, typeObjs[i], callArgTypes, "type", 0,
+                &argTypes[i]) != TCL_OK) {
+            ckfree((char *) argTypes);
+            return TCL_ERROR;
+        }
+    }
+
+    /*
+     * Tcl code the calls run may shimmer the list that was passed in, so
+     * iterate over a private copy that shares its elements
+     */
+    tuples = Tcl_DuplicateObj(objv[3]);
+    Tcl_IncrRefCount(tuples);
+    if (Tcl_ListObjGetElements(interp, tuples, &tupleCount, &tupleObjs)
+            != TCL_OK) {
+        Tcl_DecrRefCount(tuples);
+        ckfree((char *) argTypes);
+        return TCL_ERROR;
+    }
+
+    instanceData = parse_instance(cdata, interp, objv[1], 0);
+    if (instanceData == NULL) {
+        Tcl_DecrRefCount(tuples);
+        ckfree((char *) argTypes);
+        return TCL_ERROR;
+    }
+
+    ctx = instanceData->ctx;
+
+    Tclduk_BeginLimits(instanceData, &opts, &frame);
+
+    duk_result = duk_peval_string(ctx, Tcl_GetString(objv[2])); /* => [function] */
+    if (duk_result != 0) {
+        Tcl_SetObjResult(interp,
+                Tcl_NewStringObj(duk_safe_to_string(ctx, -1), -1));
+        duk_pop(ctx);
+        Tcl_DecrRefCount(tuples);
+        ckfree((char *) argTypes);
+        return Tclduk_EndLimits(interp, instanceData, &frame, TCL_ERROR);
+    }
+
+    results = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(results);
+    errors = Tcl_NewDictObj();
+    Tcl_IncrRefCount(errors);
+    retval = TCL_OK;
+    for (i = 0; i < tupleCount; i++) {
+        if (Tcl_ListObjGetElements(interp, tupleObjs[i], &argCount, &argObjs)
+                != TCL_OK) {
+            retval = TCL_ERROR;
+            break;
+        }
+
+        Tclduk_BeginLoans(ctx, &loans);
+        duk_dup(ctx, -1);                               /* => [function] [function] */
+        for (j = 0; j < argCount; j++) {                /* => [function] [function] [args...] */
+            if (Tclduk_PushCallArg(interp, ctx, &loans,
+                    j < typeCount ? argTypes[j] : TYPE_STRING,
+                    argObjs[j], Tcl_IsShared(objv[3])
+                            || Tcl_IsShared(tupleObjs[i])) != TCL_OK) {
+                retval = TCL_ERROR;
+                break;
+            }
+        }
+        if (retval != TCL_OK) {
+            Tclduk_EndLoans(ctx, &loans);
+            duk_set_top(ctx, loans.base);               /* => [function] */
+            break;
+        }
+
+        duk_result = duk_pcall(ctx, (duk_idx_t) argCount); /* => [function] [result] */
+        if (Tclduk_ResultObj(ctx, duk_result, opts.resultType, &result)
+                == TCL_OK) {                            /* => [function] */
+            Tcl_ListObjAppendElement(NULL, results,
+                    result == NULL ? Tcl_NewObj() : result);
+        } else if (errorMode == BATCH_ERRORS_COLLECT
+                && !instanceData->limits.expired) {
+            Tcl_ListObjAppendElement(NULL, results, Tcl_NewObj());
+            Tcl_DictObjPut(NULL, errors, Tcl_NewWideIntObj(i), result);
+        } else {
+            Tcl_SetObjResult(interp, result);
+            retval = TCL_ERROR;
+        }
+        Tclduk_EndLoans(ctx, &loans);
+        if (retval != TCL_OK) {
+            break;
+        }
+    }
+    duk_pop(ctx);                                       /* => */
+    Tcl_DecrRefCount(tuples);
+    ckfree((char *) argTypes);
+
+    if (retval != TCL_OK) {
+        Tcl_AppendObjToErrorInfo(interp, Tcl_ObjPrintf(
+                "\n    (call %d of " NS CALL_BATCH ")", (int) i));
+    } else if (errorMode == BATCH_ERRORS_COLLECT) {
+        pair[0] = results;
+        pair[1] = errors;
+        Tcl_SetObjResult(interp, Tcl_NewListObj(2, pair));
+    } else {
+        Tcl_SetObjResult(interp, results);
+    }
+    Tcl_DecrRefCount(results);
+    Tcl_DecrRefCount(errors);
+
+    return Tclduk_EndLimits(interp, instanceData, &frame, retval);
+}
+
+/*
+ * Call a JS function bound with bind.
+ * Usage: (bound command) ?arg ...?
+ * Return value: the result of the call converted to the return type.
+ * Side effects: may change the Duktape interpreter heap.
+ */
+static int
+Bound_Cmd(ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    struct DuktapeBoundData *boundData;
+    struct DuktapeCallOptions opts;
+    struct DuktapeLimitsFrame frame;
+    struct DuktapeLoans loans;
+    duk_context *ctx;
+    duk_int_t duk_result;
+    Tcl_Size i;
+    int retval;
+
+    boundData = (struct DuktapeBoundData *) cdata;
+
+    if (boundData->instanceData == NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(ERROR_INVALID_INSTANCE, -1));
+        return TCL_ERROR;
+    }
+
+    if (objc - 1 != boundData->numArgs) {
+        Tcl_WrongNumArgs(interp, 1, objv, Tcl_GetString(boundData->signature));
+        return TCL_ERROR;
+    }
+
+    ctx = boundData->instanceData->ctx;
+
+    opts.timeout = -1;
+    opts.budget = -1;
+    Tclduk_BeginLimits(boundData->instanceData, &opts, &frame);
+    Tclduk_BeginLoans(ctx, &loans);
+    Tclduk_PushPinned(ctx, boundData->methodSlot);      /* => [method] */
+    Tclduk_PushPinned(ctx, boundData->thisSlot);        /* => [method] [this] */
+    for (i = 0; i < boundData->numArgs; i++) {          /* => [method] [this] [args...] */
+        if (Tclduk_PushCallArg(interp, ctx, &loans, boundData->argTypes[i],
+                objv[i + 1], 0) != TCL_OK) {
+            Tclduk_EndLoans(ctx, &loans);
+            duk_set_top(ctx, loans.base);
+            return Tclduk_EndLimits(interp, boundData->instanceData, &frame,
+                    TCL_ERROR);
+        }
+    }
+    duk_result = duk_pcall_method(ctx, boundData->numArgs); /* => [result] */
+
+    retval = Tclduk_SetResult(interp, ctx, duk_result, boundData->resultType);
+    Tclduk_EndLoans(ctx, &loans);
+    return Tclduk_EndLimits(interp, boundData->instanceData, &frame, retval);
+}
+
+/*
+ * Resolve a JS method and its "this" once and create a command that calls
+ * it with arguments of the given types.
+ * Usage: bind token method this {?type ...?} ?returnType?
+ * Return value: the name of the new command.
+ * Side effects: pins the method and "this" in the Duktape heap until the
+ * command is deleted.  Closing the heap deletes the command.
+ */
+static int
+Bind_Cmd(ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    struct DuktapeInstanceData *instanceData;
+    struct DuktapeBoundData *boundData;
+    duk_context *ctx;
+    duk_int_t duk_result;
+    Tcl_Obj **typeObjs;
+    Tcl_Obj *name;
+    Tcl_Size numArgs, i;
+    int *argTypes;
+    int resultType;
+
+    if (objc != 5 && objc != 6) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_BIND);
         return TCL_ERROR;
     }
 
-    if (objc == 3) {
-        if (strcmp(Tcl_GetStringFromObj(objv[1], NULL), "-safe") != 0) {
-            Tcl_WrongNumArgs(interp, 1, objv, USAGE_INIT);
-            return TCL_ERROR;
-        }
-        tclRet = Tcl_GetBoolean(
-            interp,
-            Tcl_GetStringFromObj(objv[2], NULL),
-            &makeSafe
-        );
-        if (tclRet != TCL_OK) {
-            return(tclRet);
-        }
+    instanceData = parse_instance(cdata, interp, objv[1], 0);
+    if (instanceData == NULL) {
+        return TCL_ERROR;
     }
 
-    instanceData = ckalloc(sizeof(*instanceData));
-    instanceData->interp = interp;
-    instanceData->lambdaCount = 0;
-    instanceData->cdata = cdata;
+    ctx = instanceData->ctx;
 
-    ctx = duk_create_heap(NULL, NULL, NULL, instanceData, NULL);
-    if (ctx == NULL) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj(ERROR_CREATE, -1));
-        free(instanceData);
+    resultType = RESULT_STRING;
+    if (objc == 6 && Tcl_GetIndexFromObj(interp, objv[5], resultTypes,
+            "return type", 0, &resultType) != TCL_OK) {
         return TCL_ERROR;
     }
 
-    instanceData->ctx = ctx;
+    if (Tcl_ListObjGetElements(interp, objv[4], &numArgs,
+            &typeObjs) != TCL_OK) {
+        return TCL_ERROR;
+    }
 
-    DUKTCL_CDATA->counter++;
-    token = Tcl_ObjPrintf(NS "::%d", DUKTCL_CDATA->counter);
-    instanceData->handle = token;
-    Tcl_IncrRefCount(token);
+    argTypes = ckalloc(sizeof(int) * (numArgs > 0 ? numArgs : 1));
+    for (i = 0; i < numArgs; i++) {
+        if (Tcl_GetIndexFromObj(interp, typeObjs[i], callArgTypes, "type", 0,
+                &argTypes[i]) != TCL_OK) {
+            ckfree(argTypes);
+            return TCL_ERROR;
+        }
+    }
 
-    hashPtr = Tcl_CreateHashEntry(&DUKTCL_CDATA->table, Tcl_GetString(token),
-            &isNew);
-    Tcl_SetHashValue(hashPtr, (ClientData) instanceData);
+    /* Eval the function name and "this" to put them on the stack. */
+    for (i = 2; i < 4; i++) {
+        duk_result = duk_peval_string(ctx, Tcl_GetString(objv[i]));
+        if (duk_result != 0) {
+            Tcl_SetObjResult(interp,
+                    Tcl_NewStringObj(
+                        duk_safe_to_string(ctx, -1), -1));
+            duk_pop_n(ctx, i - 1);
+            ckfree(argTypes);
+            return TCL_ERROR;
+        }
+    }                                                    /* => [method] [this] */
 
-    if (!makeSafe) {
-        MakeContextUnsafe(ctx);
+    if (!duk_is_callable(ctx, -2)) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(ERROR_NOT_CALLABLE, -1));
+        duk_pop_2(ctx);
+        ckfree(argTypes);
+        return TCL_ERROR;
     }
 
-    Tcl_SetObjResult(interp, token);
+    boundData = ckalloc(sizeof(*boundData));
+    boundData->instanceData = instanceData;
+    boundData->methodSlot   = Tclduk_Pin(ctx, -2);
+    boundData->thisSlot     = Tclduk_Pin(ctx, -1);
+    boundData->resultType   = resultType;
+    boundData->numArgs      = numArgs;
+    boundData->argTypes     = argTypes;
+    boundData->signature    = Tcl_NewListObj(numArgs, typeObjs);
+    Tcl_IncrRefCount(boundData->signature);
+    duk_pop_2(ctx);                                      /* => */
+
+    DUKTCL_CDATA->boundCounter++;
+    name = Tcl_ObjPrintf(NS BOUND "%d", DUKTCL_CDATA->boundCounter);
+
+    boundData->command = Tcl_CreateObjCommand(interp, Tcl_GetString(name),
+            Bound_Cmd, boundData, Tclduk_Bound_Delete);
+
+    boundData->prev = NULL;
+    boundData->next = instanceData->bound;
+    if (instanceData->bound) {
+        instanceData->bound->prev = boundData;
+    }
+    instanceData->bound = boundData;
+
+    Tcl_SetObjResult(interp, name);
     return TCL_OK;
 }
 
-static int MakeSafe_Cmd(
-    ClientData cdata,
-    Tcl_Interp *interp,
-    int objc,
-    Tcl_Obj *const objv[]
+/*
+ * Copy the string of a value a worker thread made and free the value.
+ * Return value: a string allocated with ckalloc.
+ */
+static char *Tclduk_ParallelMapString(Tcl_Obj *obj, Tcl_Size *lengthPtr) {
+    const char *string;
+    char *copy;
+    Tcl_Size length;
+
+    Tcl_IncrRefCount(obj);
+    string = Tcl_GetStringFromObj(obj, &length);
+    copy = ckalloc(length + 1);
+    memcpy(copy, string, length + 1);
+    Tcl_DecrRefCount(obj);
+
+    if (lengthPtr != NULL) {
+        *lengthPtr = length;
+    }
+    return(copy);
+}
+
+/*
+ * Record the first error of a parallel-map call.  Takes ownership of
+ * error.
+ */
+static void Tclduk_ParallelMapFail(
+    struct DuktapeParallelMap *map,
+    Tcl_Obj *error
 )
 {
+    char *message;
+
+    message = Tclduk_ParallelMapString(error, NULL);
+    Tcl_MutexLock(&map->mutex);
+    if (map->error == NULL) {
+        map->error = message;
+        message = NULL;
+    }
+    Tcl_MutexUnlock(&map->mutex);
+    if (message != NULL) {
+        ckfree(message);
+    }
+}
+
+/*
+ * Map chunks of items in a heap of its own until there are none left or a
+ * call has failed.
+ */
+static void Tclduk_ParallelMapWork(struct DuktapeParallelMap *map) {
     duk_context *ctx;
+    duk_int_t duk_result;
+    Tcl_Obj *result;
+    Tcl_Size i, start, end;
 
-    if (objc != 2) {
-        Tcl_WrongNumArgs(interp, 1, objv, USAGE_MAKE_SAFE);
-        return(TCL_ERROR);
+    ctx = duk_create_heap_default();
+    if (ctx == NULL) {
+        Tclduk_ParallelMapFail(map, Tcl_NewStringObj(ERROR_CREATE, -1));
+        return;
     }
 
-    ctx = parse_id(cdata, interp, objv[1], 0);
-    if (!ctx) {
-        return(TCL_ERROR);
+    duk_result = duk_peval_lstring(ctx, map->init, map->initLength);
+    if (duk_result == 0) {
+        duk_pop(ctx);
+        duk_result = duk_peval_lstring(ctx, map->function,
+                map->functionLength);
+    }                                                   /* => [function|error] */
+    if (duk_result != 0 || !duk_is_callable(ctx, -1)) {
+        Tclduk_ParallelMapFail(map, Tcl_NewStringObj(duk_result != 0 ?
+                duk_safe_to_string(ctx, -1) : ERROR_NOT_CALLABLE, -1));
+        duk_destroy_heap(ctx);
+        return;
     }
 
-    MakeContextSafe(ctx);
+    for (;;) {
+        Tcl_MutexLock(&map->mutex);
+        start = map->next;
+        end = start + map->chunk < map->count ?
+                start + map->chunk : map->count;
+        map->next = end;
+        if (map->error != NULL) {
+            end = start;
+        }
+        Tcl_MutexUnlock(&map->mutex);
+        if (start == end) {
+            break;
+        }
 
-    return(TCL_OK);
+        for (i = start; i < end; i++) {
+            duk_dup_top(ctx);                           /* => [function] [function] */
+            duk_push_lstring(ctx, map->items[i],
+                    map->itemLengths[i]);               /* => [function] [function] [item] */
+            duk_result = duk_pcall(ctx, 1);             /* => [function] [result] */
+            if (Tclduk_ResultObj(ctx, duk_result, map->resultType, &result)
+                    != TCL_OK) {                        /* => [function] */
+                Tcl_IncrRefCount(result);
+                Tclduk_ParallelMapFail(map, Tcl_ObjPrintf(ERROR_MAP_ITEM,
+                        (int) i, Tcl_GetString(result)));
+                Tcl_DecrRefCount(result);
+                duk_destroy_heap(ctx);
+                return;
+            }
+            if (result != NULL) {
+                map->results[i] = Tclduk_ParallelMapString(result,
+                        &map->resultLengths[i]);
+            }
+        }
+    }
+
+    duk_destroy_heap(ctx);
 }
 
-static int MakeUnsafe_Cmd(
+static Tcl_ThreadCreateType Tclduk_ParallelMapThread(ClientData cdata) {
+    Tclduk_ParallelMapWork((struct DuktapeParallelMap *) cdata);
+    /* Free what the Tcl API allocated for this thread */
+    Tcl_FinalizeThread();
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ * Call a JavaScript function on every item of a list in worker threads.
+ * Each thread creates a heap of its own, evaluates the init script in it
+ * and then takes chunks of items until they run out.
+ * Usage: parallel-map ?-threads count? ?-init script? ?-chunk size?
+ * ?-result type? ?--? function items ?-option value ...?
+ * Return value: the list of the results in the order of the items.
+ * Side effects: blocks the calling thread until every item has been
+ * mapped or a call has failed.
+ */
+static int
+ParallelMap_Cmd(
     ClientData cdata,
     Tcl_Interp *interp,
     int objc,
     Tcl_Obj *const objv[]
 )
 {
-    duk_context *ctx;
+    struct DuktapeParallelMap map;
+    Tcl_Obj *functionObj, *itemsObj, **itemObjs, *resultObj;
+    Tcl_ThreadId *threadIds;
+    Tcl_Size i, count;
+    int optionIndex, threads, chunk, started, status, value, retval;
+    const char *option;
+
+    map.init = "";
+    map.initLength = 0;
+    map.resultType = RESULT_STRING;
+    threads = 4;
+    chunk = 0;
+
+    /* The options may precede or follow the function and the items */
+    functionObj = itemsObj = NULL;
+    for (i = 1; i < objc; i++) {
+        option = Tcl_GetString(objv[i]);
+        if (functionObj == NULL && strcmp(option, "--") == 0) {
+            if (i + 1 < objc) {
+                functionObj = objv[++i];
+            }
+            continue;
+        }
+        if (functionObj == NULL && option[0] != '-') {
+            functionObj = objv[i];
+            continue;
+        }
+        if (functionObj != NULL && itemsObj == NULL) {
+            itemsObj = objv[i];
+            continue;
+        }
 
-    if (objc != 2) {
-        Tcl_WrongNumArgs(interp, 1, objv, USAGE_MAKE_UNSAFE);
-        return(TCL_ERROR);
+        if (Tcl_GetIndexFromObj(interp, objv[i], parallelMapOptions, "option",
+                0, &optionIndex) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (i + 1 == objc) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_OPTION_VALUE,
+                    option));
+            return TCL_ERROR;
+        }
+        i++;
+
+        switch ((enum parallelMapOptions) optionIndex) {
+            case MAP_OPTION_CHUNK:
+            case MAP_OPTION_THREADS:
+                if (Tcl_GetIntFromObj(interp, objv[i], &value) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if (value < 1) {
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_POSITIVE,
+                            Tcl_GetString(objv[i])));
+                    return TCL_ERROR;
+                }
+                if (optionIndex == MAP_OPTION_CHUNK) {
+                    chunk = value;
+                } else {
+                    threads = value;
+                }
+                break;
+            case MAP_OPTION_INIT:
+                map.init = Tcl_GetStringFromObj(objv[i], &map.initLength);
+                break;
+            case MAP_OPTION_RESULT:
+                if (Tcl_GetIndexFromObj(interp, objv[i], resultTypes,
+                        "result type", 0, &map.resultType) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                /* Typed values can't be handed from thread to thread */
+                if (map.resultType == RESULT_DICT
+                        || map.resultType == RESULT_NATIVE) {
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_MAP_RESULT,
+                            resultTypes[map.resultType]));
+                    return TCL_ERROR;
+                }
+                break;
+        }
     }
 
-    ctx = parse_id(cdata, interp, objv[1], 0);
-    if (!ctx) {
-        return(TCL_ERROR);
+    if (itemsObj == NULL) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_PARALLEL_MAP);
+        return TCL_ERROR;
     }
 
-    MakeContextUnsafe(ctx);
+    if (Tcl_ListObjGetElements(interp, itemsObj, &count, &itemObjs)
+            != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (count == 0) {
+        Tcl_ResetResult(interp);
+        return TCL_OK;
+    }
 
-    return(TCL_OK);
+    /* By default, hand out about four chunks to each thread */
+    if (chunk == 0) {
+        chunk = (int) (count / ((Tcl_Size) threads * 4));
+        if (chunk < 1) {
+            chunk = 1;
+        }
+    }
+    if ((count + chunk - 1) / chunk < threads) {
+        threads = (int) ((count + chunk - 1) / chunk);
+    }
+
+    /* Workers only read the strings of the items, which exist from now on */
+    map.mutex = NULL;
+    map.function = Tcl_GetStringFromObj(functionObj, &map.functionLength);
+    map.count = count;
+    map.items = (const char **) ckalloc(sizeof(const char *) * count);
+    map.itemLengths = (Tcl_Size *) ckalloc(sizeof(Tcl_Size) * count);
+    map.results = (char **) ckalloc(sizeof(char *) * count);
+    map.resultLengths = (Tcl_Size *) ckalloc(sizeof(Tcl_Size) * count);
+    for (i = 0; i < count; i++) {
+        map.items[i] = Tcl_GetStringFromObj(itemObjs[i], &map.itemLengths[i]);
+        map.results[i] = NULL;
+        map.resultLengths[i] = 0;
+    }
+    map.chunk = chunk;
+    map.next = 0;
+    map.error = NULL;
+
+    threadIds = (Tcl_ThreadId *) ckalloc(sizeof(Tcl_ThreadId) * threads);
+    started = 0;
+    for (i = 0; i < threads; i++) {
+        if (Tcl_CreateThread(&threadIds[started], Tclduk_ParallelMapThread,
+                &map, TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE)
+                == TCL_OK) {
+            started++;
+        }
+    }
+    /* Without thread support, do the work here */
+    if (started == 0) {
+        Tclduk_ParallelMapWork(&map);
+    }
+    for (i = 0; i < started; i++) {
+        Tcl_JoinThread(threadIds[i], &status);
+    }
+    ckfree((char *) threadIds);
+    Tcl_MutexFinalize(&map.mutex);
+
+    if (map.error != NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(map.error, -1));
+        ckfree(map.error);
+        retval = TCL_ERROR;
+    } else {
+        resultObj = Tcl_NewListObj(0, NULL);
+        for (i = 0; i < count; i++) {
+            Tcl_ListObjAppendElement(NULL, resultObj,
+                    Tcl_NewStringObj(map.results[i] ? map.results[i] : "",
+                    map.resultLengths[i]));
+        }
+        Tcl_SetObjResult(interp, resultObj);
+        retval = TCL_OK;
+    }
+    for (i = 0; i < count; i++) {
+        if (map.results[i] != NULL) {
+            ckfree(map.results[i]);
+        }
+    }
+    ckfree((char *) map.items);
+    ckfree((char *) map.itemLengths);
+    ckfree((char *) map.results);
+    ckfree((char *) map.resultLengths);
+
+    return retval;
+    /* UNREACH: Disable some warnings */
+    cdata = cdata;
 }
 
 /*
- * Destroy a Duktape interpreter heap.
- * Return value: nothing.
- * Side effects: destroys a Duktape interpreter heap.
+ * Take a heap away from the interp so it can be attached to another one,
+ * possibly in another thread.
+ * Usage: detach token
+ * Return value: a handle for attach.
+ * Side effects: the token stops working.  Deletes the bound function
+ * commands of the heap.  Its allocation counters are added to those of
+ * the closed heaps of the interp and restart from zero.
  */
 static int
-Close_Cmd(ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+Detach_Cmd(
+    ClientData cdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[]
+)
 {
-    duk_context *ctx;
+    struct DuktapeInstanceData *instanceData;
+    Tcl_HashEntry *hashPtr;
+    Tcl_Obj *handle, *token, *codeCache;
+    int isNew;
 
     if (objc != 2) {
-        Tcl_WrongNumArgs(interp, 1, objv, USAGE_CLOSE);
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_DETACH);
         return TCL_ERROR;
     }
 
-    ctx = parse_id(cdata, interp, objv[1], 1);
-    if (ctx == NULL) {
+    instanceData = parse_instance(cdata, interp, objv[1], 0);
+    if (instanceData == NULL) {
+        return TCL_ERROR;
+    }
+    if (Tclduk_CheckIdle(interp, instanceData) != TCL_OK) {
         return TCL_ERROR;
     }
 
-    duk_destroy_heap(ctx);
+    parse_instance(cdata, interp, objv[1], 1);
+    Tclduk_DeleteBound(instanceData);
+    Tclduk_ReleaseExports(instanceData);
+
+    DUKTCL_CDATA->closedStats.allocations += instanceData->stats.allocations;
+    DUKTCL_CDATA->closedStats.bytes += instanceData->stats.bytes;
+    memset(&instanceData->stats, 0, sizeof(instanceData->stats));
+
+    /*
+     * Don't take along objects that this interp may still hold or internal
+     * reps that belong to this thread.  Objects left behind have a stale
+     * generation and no longer touch the instance.
+     */
+    token = Tcl_NewStringObj(Tcl_GetString(instanceData->handle), -1);
+    Tcl_IncrRefCount(token);
+    Tcl_DecrRefCount(instanceData->handle);
+    instanceData->handle = token;
+    if (instanceData->codeCache) {
+        codeCache = Tcl_NewStringObj(Tcl_GetString(instanceData->codeCache),
+                -1);
+        Tcl_IncrRefCount(codeCache);
+        Tcl_DecrRefCount(instanceData->codeCache);
+        instanceData->codeCache = codeCache;
+    }
+    Tclduk_ResetLambdas(instanceData);
+    Tclduk_ResetCommands(instanceData);
+    instanceData->interp = NULL;
+    instanceData->cdata = NULL;
+
+    Tcl_MutexLock(&instanceMutex);
+    if (!detachedTableReady) {
+        Tcl_InitHashTable(&detachedTable, TCL_STRING_KEYS);
+        detachedTableReady = 1;
+    }
+    detachedCounter++;
+    handle = Tcl_ObjPrintf(DETACHED_PREFIX "%d", detachedCounter);
+    hashPtr = Tcl_CreateHashEntry(&detachedTable, Tcl_GetString(handle),
+            &isNew);
+    Tcl_SetHashValue(hashPtr, (ClientData) instanceData);
+    Tcl_MutexUnlock(&instanceMutex);
 
+    Tcl_SetObjResult(interp, handle);
     return TCL_OK;
 }
 
 /*
- * Register a new global function within a context
- */
-/*
- * Evaluate a Tcl string and return the result to JavaScript
+ * Give a heap taken away from its interp with detach to this interp.
+ * Usage: attach handle
+ * Return value: a new token for the heap.
+ * Side effects: the handle stops working.  Duktape.tcl.eval() and the
+ * functions created with tcl-function evaluate their Tcl code in this
+ * interp from now on.
  */
-static duk_ret_t EvalTclCmdFromJS(duk_context *ctx) {
+static int
+Attach_Cmd(
+    ClientData cdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *const objv[]
+)
+{
     struct DuktapeInstanceData *instanceData;
-    duk_memory_functions funcs;
-    Tcl_Interp *interp;
-    const char *returnType;
+    Tcl_HashEntry *hashPtr;
+    Tcl_Obj *token;
+    int isNew;
 
-    duk_get_memory_functions(ctx, &funcs);
-    instanceData = funcs.udata;
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_ATTACH);
+        return TCL_ERROR;
+    }
 
-    interp = instanceData->interp;
+    /* Only one interp can take the heap out of the table */
+    instanceData = NULL;
+    Tcl_MutexLock(&instanceMutex);
+    if (detachedTableReady) {
+        hashPtr = Tcl_FindHashEntry(&detachedTable, Tcl_GetString(objv[1]));
+        if (hashPtr != NULL) {
+            instanceData = Tcl_GetHashValue(hashPtr);
+            Tcl_DeleteHashEntry(hashPtr);
+        }
+    }
+    Tcl_MutexUnlock(&instanceMutex);
 
-    duk_push_current_function(ctx);          /* => [args...] [function] */
-    duk_push_literal(ctx, "apply");          /* => [args...] [function] ["apply"] */
-    duk_get_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("lambda"));  /* => [args...] [function] ["apply"] [lambda] */
-    duk_insert(ctx, 0);                      /* => [lambda] [args...] [function] ["apply"] */
-    duk_insert(ctx, 0);                      /* => ["apply"] [lambda] [args...] [function] */
+    if (instanceData == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_DETACHED,
+                Tcl_GetString(objv[1])));
+        return TCL_ERROR;
+    }
 
-    duk_get_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("returnType"));  /* => [args...] [function] [returnType] */
-    returnType = duk_get_string(ctx, -1);                           /* => [args...] [function] [returnType] */
+    instanceData->interp = interp;
+    instanceData->cdata = cdata;
+
+    DUKTCL_CDATA->counter++;
+    token = Tcl_ObjPrintf(NS "::%d", DUKTCL_CDATA->counter);
+    Tcl_IncrRefCount(token);
+    Tcl_DecrRefCount(instanceData->handle);
+    instanceData->handle = token;
+
+    hashPtr = Tcl_CreateHashEntry(&DUKTCL_CDATA->table, Tcl_GetString(token),
+            &isNew);
+    Tcl_SetHashValue(hashPtr, (ClientData) instanceData);
 
-    duk_pop(ctx);                            /* => ["apply"] [lambda] [args...] [function] */
-    duk_pop(ctx);                            /* => ["apply"] [lambda] [args...] */
+    token = Tcl_DuplicateObj(token);
+    Tclduk_TokenObjType_Set(token, instanceData);
 
-    return(EvalTclFromJSWithInterp(interp, ctx, returnType));
+    Tcl_SetObjResult(interp, token);
+    return TCL_OK;
 }
 
-static int RegisterFunction_Cmd(
-    ClientData cdata,
-    Tcl_Interp *interp,
-    int objc,
-    Tcl_Obj *const objv[]
-)
-{
-    duk_context *ctx;
-    Tcl_Obj *lambdaObj;
-    const char *functionName, *returnType, *lambdaString;
-    Tcl_Size lambdaStringLength, returnTypeLength;
+/*
+ * Run a json subcommand in the heap.  JSON documents are kept in the
+ * "json" object of the global stash under their number.  The value the
+ * path leads to is looked up one key at a time; set and set-json create
+ * the missing objects on the way.
+ * Return value: the value of get, exists and stringify or undefined.
+ */
+static duk_ret_t Tclduk_Json(duk_context *ctx, void *udata) {
+    struct DuktapeJson *json = udata;
+    const char *str;
+    Tcl_Size i, length;
+    duk_size_t keyLength;
+    int create;
+
+    create = json->subcommand == JSON_SET
+            || json->subcommand == JSON_SET_JSON;
+
+    duk_push_global_stash(ctx);                        /* => [stash] */
+    if (!duk_get_prop_literal(ctx, -1, "json")) {      /* => [stash] [docs|undefined] */
+        duk_pop(ctx);                                  /* => [stash] */
+        duk_push_object(ctx);                          /* => [stash] [docs] */
+        duk_dup_top(ctx);                              /* => [stash] [docs] [docs] */
+        duk_put_prop_literal(ctx, -3, "json");         /* => [stash] [docs] */
+    }
 
-    if (objc != 5 && objc != 6) {
-        Tcl_WrongNumArgs(interp, 1, objv, USAGE_TCL_FUNCTION);
-        return(TCL_ERROR);
+    if (json->subcommand == JSON_PARSE) {
+        str = Tcl_GetStringFromObj(json->value, &length);
+        duk_push_lstring(ctx, str, length);            /* => [stash] [docs] [json] */
+        duk_json_decode(ctx, -1);                      /* => [stash] [docs] [doc] */
+        duk_put_prop_index(ctx, -2, json->doc);        /* => [stash] [docs] */
+        duk_push_undefined(ctx);
+        return(1);
     }
 
-    ctx = parse_id(cdata, interp, objv[1], 0);
-    if (ctx == NULL) {
-        return(TCL_ERROR);
+    if (!duk_has_prop_index(ctx, -1, json->doc)) {
+        json->missing = 1;
+        duk_push_undefined(ctx);
+        return(1);
     }
 
-    functionName = Tcl_GetStringFromObj(objv[2], NULL);
+    if (json->subcommand == JSON_DESTROY) {
+        duk_del_prop_index(ctx, -1, json->doc);
+        duk_push_undefined(ctx);
+        return(1);
+    }
 
-    if (objc == 6) {
-        returnType = Tcl_GetStringFromObj(objv[3], &returnTypeLength);
-        objv++;
-    } else {
-        returnType = "string";
-        returnTypeLength = 6;
+    duk_push_uint(ctx, json->doc);                     /* => [stash] [holder] [key] */
+    for (i = 0; i < json->pathLength; i++) {
+        duk_dup_top(ctx);                              /* => ... [holder] [key] [key] */
+        duk_get_prop(ctx, -3);                         /* => ... [holder] [key] [value] */
+        if (!duk_is_object(ctx, -1) || duk_is_function(ctx, -1)) {
+            if (!create) {
+                json->badKey = i;
+                duk_push_undefined(ctx);
+                return(1);
+            }
+            duk_pop(ctx);                              /* => ... [holder] [key] */
+            duk_push_object(ctx);                      /* => ... [holder] [key] [value] */
+            duk_dup(ctx, -2);                          /* => ... [holder] [key] [value] [key] */
+            duk_dup(ctx, -2);                          /* => ... [holder] [key] [value] [key] [value] */
+            duk_put_prop(ctx, -5);                     /* => ... [holder] [key] [value] */
+        }
+        duk_remove(ctx, -2);                           /* => ... [holder] [value] */
+        duk_remove(ctx, -2);                           /* => ... [value] */
+        str = Tcl_GetStringFromObj(json->path[i], &length);
+        duk_push_lstring(ctx, str, length);            /* => ... [value] [key] */
     }
 
-    lambdaObj = Tcl_NewListObj(2, objv + 3);
-    Tcl_ListObjAppendElement(interp, lambdaObj,
-      Tcl_NewStringObj(Tcl_GetCurrentNamespace(interp)->fullName, -1));
-    lambdaString = Tcl_GetStringFromObj(lambdaObj, &lambdaStringLength);
+    if (create) {
+        str = Tcl_GetStringFromObj(json->value, &length);
+        duk_push_lstring(ctx, str, length);            /* => ... [holder] [key] [value] */
+        if (json->subcommand == JSON_SET_JSON) {
+            duk_json_decode(ctx, -1);
+        }
+        duk_put_prop(ctx, -3);                         /* => ... [holder] */
+        duk_push_undefined(ctx);
+        return(1);
+    }
 
-    duk_push_global_object(ctx);                                   /* => [global] */
-    duk_push_c_function(ctx, EvalTclCmdFromJS, DUK_VARARGS);       /* => [global] [function] */
-    duk_push_lstring(ctx, lambdaString, lambdaStringLength);       /* => [global] [function] [lambda] */
-    duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("lambda"));     /* => [global] [function] */
-    duk_push_lstring(ctx, returnType, returnTypeLength);           /* => [global] [function] [returnType] */
-    duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("returnType")); /* => [global] [function] */
-    duk_put_prop_string(ctx, -2, functionName);                    /* => [global] */
-    duk_pop(ctx);                                                  /* => */
+    duk_get_prop(ctx, -2);                             /* => ... [holder] [value] */
 
-    Tcl_DecrRefCount(lambdaObj);
+    switch ((enum jsonSubcommands) json->subcommand) {
+        case JSON_KEYS:
+            if (!duk_is_object(ctx, -1) || duk_is_function(ctx, -1)) {
+                json->badKey = json->pathLength;
+                break;
+            }
+            duk_enum(ctx, -1, DUK_ENUM_OWN_PROPERTIES_ONLY);
+                                                       /* => ... [value] [enum] */
+            while (duk_next(ctx, -1, 0)) {             /* => ... [value] [enum] [key] */
+                str = duk_get_lstring(ctx, -1, &keyLength);
+                Tcl_ListObjAppendElement(NULL, json->keys,
+                        Tcl_NewStringObj(str, (Tcl_Size) keyLength));
+                duk_pop(ctx);                          /* => ... [value] [enum] */
+            }
+            duk_pop(ctx);                              /* => ... [value] */
+            break;
+        case JSON_STRINGIFY:
+            if (!duk_is_undefined(ctx, -1)) {
+                duk_json_encode(ctx, -1);
+            }
+            break;
+        default:
+            break;
+    }
 
-    return(TCL_OK);
+    return(1);
 }
 
-static int EvalLambda_Cmd(
-    ClientData cdata,
-    Tcl_Interp *interp,
-    int objc,
-    Tcl_Obj *const objv[]
-)
+/*
+ * Work with JSON documents kept in a heap through the Duktape C API so
+ * looking up a path doesn't run JavaScript or reparse the document.
+ * Usage: json parse token json
+ *        json get|exists|keys|stringify token document ?key ...?
+ *        json set|set-json token document ?key ...? value
+ *        json destroy token document
+ * Return value: parse returns the number of the new document.  get returns
+ * the value a path leads to as a string, stringify returns it as JSON,
+ * exists returns whether there is a value there and keys returns the keys
+ * of the object there.  The other subcommands return nothing.
+ * Side effects: parse, set, set-json and destroy change the documents.
+ */
+static int
+Json_Cmd(ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
+    struct DuktapeInstanceData *instanceData;
+    struct DuktapeJson json;
     duk_context *ctx;
-    Tcl_Obj *lambdaNameObj, *bytecodeObj, *result;
-    const char *lambdaName, *bytecode;
-    Tcl_Size lambdaNameLength, bytecodeLength;
-    int idx;
-    int retval;
+    duk_int_t duk_result;
+    Tcl_WideInt doc;
+    Tcl_Obj *result, *pathObj;
+    int subcommand, minArgs, retval;
 
-    if (objc < 4) {
-        Tcl_WrongNumArgs(interp, 1, objv, USAGE_EVAL_LAMBDA);
-        return(TCL_ERROR);
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_JSON);
+        return TCL_ERROR;
     }
 
-    ctx = parse_id(cdata, interp, objv[1], 0);
-    if (ctx == NULL) {
-        return(TCL_ERROR);
+    if (Tcl_GetIndexFromObj(interp, objv[1], jsonSubcommands, "subcommand", 0,
+            &subcommand) != TCL_OK) {
+        return TCL_ERROR;
     }
 
-    bytecodeObj = objv[2];
-    lambdaNameObj = objv[3];
-    lambdaName = Tcl_GetStringFromObj(lambdaNameObj, &lambdaNameLength);
-
-    duk_push_global_stash(ctx);                                   /* => [stash] */
-    duk_get_prop_lstring(ctx, -1, lambdaName, lambdaNameLength);  /* => [stash] [function|undefined] */
-
-    /*
-     * If the lambda name cannot be found in the list of closures
-     * use the bytecode
-     */
-    if (duk_is_undefined(ctx, -1) || lambdaNameLength == 0) {
-        duk_pop(ctx);                                             /* => [stash] */
-
-        bytecode = Tcl_GetStringFromObj(bytecodeObj, &bytecodeLength);
+    switch ((enum jsonSubcommands) subcommand) {
+        case JSON_SET:
+        case JSON_SET_JSON:
+            minArgs = 5;
+            break;
+        default:
+            minArgs = 4;
+            break;
+    }
+    if (objc < minArgs || ((subcommand == JSON_PARSE
+            || subcommand == JSON_DESTROY) && objc != 4)) {
+        Tcl_WrongNumArgs(interp, 2, objv, jsonUsage[subcommand]);
+        return TCL_ERROR;
+    }
 
-        duk_push_lstring(ctx, (const char *) bytecode, bytecodeLength); /* => [stash] [bytecodeString] */
-        duk_base64_decode(ctx, -1);                               /* => [stash] [bytecodebuffer] */
-        duk_load_function(ctx);                                   /* => [stash] [function] */
+    instanceData = parse_instance(cdata, interp, objv[2], 0);
+    if (instanceData == NULL) {
+        return TCL_ERROR;
     }
+    ctx = instanceData->ctx;
 
-    /*
-     * Push each argument to the stack
-     * => [stash] [function] [args...]
-     */
-    for (idx = 4; idx < objc; idx++) {
-        Tclduk_TclToJS(interp, objv[idx], ctx, NULL);
+    json.subcommand = subcommand;
+    json.path = objv + 4;
+    json.pathLength = objc - 4;
+    json.value = NULL;
+    json.missing = 0;
+    json.badKey = -1;
+    json.keys = NULL;
+
+    if (subcommand == JSON_PARSE) {
+        json.doc = instanceData->jsonCount + 1;
+        json.value = objv[3];
+    } else {
+        if (Tcl_GetWideIntFromObj(NULL, objv[3], &doc) != TCL_OK
+                || doc < 1 || doc > instanceData->jsonCount) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_JSON_DOCUMENT,
+                    Tcl_GetString(objv[3])));
+            return TCL_ERROR;
+        }
+        json.doc = (duk_uarridx_t) doc;
+    }
+    if (subcommand == JSON_SET || subcommand == JSON_SET_JSON) {
+        json.pathLength--;
+        json.value = objv[objc - 1];
+    }
+    if (subcommand == JSON_KEYS) {
+        json.keys = Tcl_NewObj();
     }
 
-    /*
-     * Call the JavaScript function
-     */
-    duk_call(ctx, objc - 4);                                      /* => [stash] [result] */
+    duk_result = duk_safe_call(ctx, Tclduk_Json, &json, 0, 1);
+                                                       /* => [result] */
+    if (duk_result != DUK_EXEC_SUCCESS) {
+        if (json.keys != NULL) {
+            Tcl_DecrRefCount(json.keys);
+        }
+        return Tclduk_SetResult(interp, ctx, duk_result, RESULT_STRING);
+    }
 
     retval = TCL_OK;
-    if (duk_is_error(ctx, -1)) {
+    result = NULL;
+    pathObj = Tcl_NewListObj(json.pathLength, json.path);
+    Tcl_IncrRefCount(pathObj);
+    if (json.missing) {
+        result = Tcl_ObjPrintf(ERROR_JSON_DOCUMENT, Tcl_GetString(objv[3]));
+        retval = TCL_ERROR;
+    } else if (subcommand == JSON_EXISTS) {
+        result = Tcl_NewBooleanObj(json.badKey < 0
+                && !duk_is_undefined(ctx, -1));
+    } else if (json.badKey == 0) {
+        result = Tcl_NewStringObj(ERROR_JSON_ROOT, -1);
+        retval = TCL_ERROR;
+    } else if (json.badKey > 0) {
+        result = Tcl_ObjPrintf(ERROR_JSON_KEY,
+                Tcl_GetString(json.path[json.badKey - 1]),
+                Tcl_GetString(pathObj));
         retval = TCL_ERROR;
+    } else if (subcommand == JSON_KEYS) {
+        result = json.keys;
+        json.keys = NULL;
+    } else if (subcommand == JSON_GET || subcommand == JSON_STRINGIFY) {
+        if (duk_is_undefined(ctx, -1)) {
+            result = Tcl_ObjPrintf(ERROR_JSON_MISSING,
+                    Tcl_GetString(pathObj));
+            retval = TCL_ERROR;
+        } else {
+            result = Tcl_NewStringObj(duk_safe_to_string(ctx, -1), -1);
+        }
+    } else if (subcommand == JSON_PARSE) {
+        instanceData->jsonCount++;
+        result = Tcl_NewWideIntObj(json.doc);
+    }
+    duk_pop(ctx);                                      /* => */
+    Tcl_DecrRefCount(pathObj);
+    if (json.keys != NULL) {
+        Tcl_DecrRefCount(json.keys);
     }
 
-    result = Tclduk_JSToTcl(ctx, -1);
-    duk_pop_2(ctx);                                               /* => */
+    if (result == NULL) {
+        Tcl_ResetResult(interp);
+    } else {
+        Tcl_SetObjResult(interp, result);
+    }
+    return retval;
+}
 
-    Tcl_SetObjResult(interp, result);
+/*
+ * Append length bytes to the text collected by json-ingest.
+ */
+static void Tclduk_IngestAppend(
+    duk_context *ctx,
+    struct DuktapeIngest *ingest,
+    const char *bytes,
+    duk_size_t length
+)
+{
+    char *data;
+    duk_size_t size;
 
-    return(retval);
+    if (length == 0) {
+        return;
+    }
+    data = duk_get_buffer(ctx, ingest->base, &size);
+    if (ingest->used + length > size) {
+        size = size * 2 > ingest->used + length ?
+                size * 2 : ingest->used + length;
+        data = duk_resize_buffer(ctx, ingest->base, size);
+    }
+    memcpy(data + ingest->used, bytes, length);
+    ingest->used += length;
 }
 
 /*
- * Evaluate a string as Duktape code in the selected heap.
- * Usage: eval token code
- * Return value: the result of the evaluation coerced to string.
- * Side effects: may change the Duktape interpreter heap.
+ * Return value: whether the collected text is empty or all whitespace.
  */
-static int
-Eval_Cmd(ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
-{
-    duk_context *ctx;
-    duk_int_t duk_result;
-    const char *js_code;
+static int Tclduk_IngestBlank(duk_context *ctx, struct DuktapeIngest *ingest) {
+    const char *data;
+    duk_size_t i;
 
-    if (objc != 3) {
-        Tcl_WrongNumArgs(interp, 1, objv, USAGE_EVAL);
-        return TCL_ERROR;
+    data = duk_get_buffer(ctx, ingest->base, NULL);
+    for (i = 0; i < ingest->used; i++) {
+        if (!JSON_SPACE(data[i])) {
+            return(0);
+        }
     }
+    return(1);
+}
 
-    ctx = parse_id(cdata, interp, objv[1], 0);
-    if (ctx == NULL) {
-        return TCL_ERROR;
+/*
+ * Decode the collected text and hand the value over: store it in the array
+ * or pass it to the callback.  Throws on invalid JSON.
+ */
+static void Tclduk_IngestValue(duk_context *ctx, struct DuktapeIngest *ingest) {
+    const char *data;
+
+    if (ingest->mode == INGEST_WHOLE) {
+        /* Nothing follows, so turn the buffer itself into the text. */
+        duk_resize_buffer(ctx, ingest->base, ingest->used);
+        duk_buffer_to_string(ctx, ingest->base);       /* => [text] [undefined] ... */
+        ingest->used = 0;
+        duk_json_decode(ctx, ingest->base);            /* => [value] [undefined] ... */
+        duk_swap(ctx, ingest->base, ingest->base + 1); /* => [undefined] [value] ... */
+        ingest->count++;
+        return;
     }
 
-    js_code = Tcl_GetString(objv[2]);
+    data = duk_get_buffer(ctx, ingest->base, NULL);
+    duk_push_lstring(ctx, data, ingest->used);         /* => ... [text] */
+    ingest->used = 0;
+    duk_json_decode(ctx, -1);                          /* => ... [value] */
 
-    duk_result = duk_peval_string(ctx, js_code);
+    switch (ingest->mode) {
+        case INGEST_ARRAY:
+            duk_put_prop_index(ctx, ingest->base + 1,
+                    (duk_uarridx_t) ingest->count);    /* => ... */
+            break;
+        case INGEST_NDJSON:
+            duk_dup(ctx, ingest->base + 1);            /* => ... [value] [callback] */
+            duk_swap_top(ctx, -2);                     /* => ... [callback] [value] */
+            duk_push_number(ctx, (duk_double_t) ingest->count);
+            duk_call(ctx, 2);                          /* => ... [result] */
+            duk_pop(ctx);                              /* => ... */
+            break;
+        default:
+            duk_replace(ctx, ingest->base + 1);        /* => ... */
+            break;
+    }
+    ingest->count++;
+}
 
-    Tcl_SetObjResult(interp,
-            Tcl_NewStringObj(
-                duk_safe_to_string(ctx, -1), -1));
-    duk_pop(ctx);
+/*
+ * Feed the chunk of text in ingest to the decoder.  A document that is an
+ * array is decoded one element at a time; any other document is collected
+ * whole.  NDJSON records end at newlines.
+ */
+static duk_ret_t Tclduk_Ingest(duk_context *ctx, void *udata) {
+    struct DuktapeIngest *ingest = udata;
+    const char *chunk;
+    Tcl_Size i, start;
+    char c;
+
+    chunk = ingest->chunk;
+    start = 0;
+    for (i = 0; i < ingest->chunkLength; i++) {
+        c = chunk[i];
+        switch (ingest->mode) {
+            case INGEST_START:
+                if (JSON_SPACE(c)) {
+                    break;
+                }
+                if (c == '[') {
+                    ingest->mode = INGEST_ARRAY;
+                    ingest->depth = 1;
+                    duk_push_array(ctx);
+                    duk_replace(ctx, ingest->base + 1);
+                    start = i + 1;
+                } else {
+                    ingest->mode = INGEST_WHOLE;
+                    start = i;
+                }
+                break;
+            case INGEST_ARRAY:
+                if (ingest->inString) {
+                    if (ingest->escape) {
+                        ingest->escape = 0;
+                    } else if (c == '\\') {
+                        ingest->escape = 1;
+                    } else if (c == '"') {
+                        ingest->inString = 0;
+                    }
+                } else if (c == '"') {
+                    ingest->inString = 1;
+                } else if (c == '[' || c == '{') {
+                    ingest->depth++;
+                } else if (c == ']' || c == '}') {
+                    ingest->depth--;
+                    if (ingest->depth > 0) {
+                        break;
+                    }
+                    if (c != ']') {
+                        return(duk_error(ctx, DUK_ERR_SYNTAX_ERROR, "%s",
+                                ERROR_INGEST_NESTING));
+                    }
+                    Tclduk_IngestAppend(ctx, ingest, chunk + start, i - start);
+                    if (ingest->count > 0 || !Tclduk_IngestBlank(ctx, ingest)) {
+                        Tclduk_IngestValue(ctx, ingest);
+                    }
+                    ingest->mode = INGEST_DONE;
+                } else if (c == ',' && ingest->depth == 1) {
+                    Tclduk_IngestAppend(ctx, ingest, chunk + start, i - start);
+                    Tclduk_IngestValue(ctx, ingest);
+                    start = i + 1;
+                }
+                break;
+            case INGEST_NDJSON:
+                if (c == '\n') {
+                    Tclduk_IngestAppend(ctx, ingest, chunk + start, i - start);
+                    if (Tclduk_IngestBlank(ctx, ingest)) {
+                        ingest->used = 0;
+                    } else {
+                        Tclduk_IngestValue(ctx, ingest);
+                    }
+                    start = i + 1;
+                }
+                break;
+            case INGEST_DONE:
+                if (!JSON_SPACE(c)) {
+                    return(duk_error(ctx, DUK_ERR_SYNTAX_ERROR, "%s",
+                            ERROR_INGEST_TRAILING));
+                }
+                break;
+            case INGEST_WHOLE:
+            default:
+                i = ingest->chunkLength;
+                break;
+        }
+    }
+    if (ingest->mode == INGEST_ARRAY || ingest->mode == INGEST_NDJSON
+            || ingest->mode == INGEST_WHOLE) {
+        Tclduk_IngestAppend(ctx, ingest, chunk + start,
+                ingest->chunkLength - start);
+    }
 
-    if (duk_result == 0) {
-        return TCL_OK;
-    } else {
-        return TCL_ERROR;
+    if (ingest->eof) {
+        switch (ingest->mode) {
+            case INGEST_ARRAY:
+                return(duk_error(ctx, DUK_ERR_SYNTAX_ERROR, "%s",
+                        ERROR_INGEST_END));
+            case INGEST_NDJSON:
+                if (!Tclduk_IngestBlank(ctx, ingest)) {
+                    Tclduk_IngestValue(ctx, ingest);
+                }
+                break;
+            case INGEST_START:
+            case INGEST_WHOLE:
+                ingest->mode = INGEST_WHOLE;
+                Tclduk_IngestValue(ctx, ingest);
+                break;
+            default:
+                break;
+        }
     }
-}
 
+    duk_push_undefined(ctx);
+    return(1);
+}
 
 /*
- * Call a JS method/function.
- * Usage: call token method this ?{arg ?type?}? ...
- * Return value: the result of the method call coerced to string.
- * Side effects: may change the Duktape interpreter heap.
+ * Decode JSON read from a channel into a heap without holding the whole
+ * text in Tcl.  The channel is read in chunks.  The elements of a document
+ * that is an array are decoded as soon as they are complete; other
+ * documents are collected in a Duktape buffer and decoded at the end.
+ * Usage: json-ingest token channel target ?-ndjson? ?-chunk size?
+ * Return value: the number of values decoded: the elements of the array,
+ * the NDJSON records or 1.
+ * Side effects: reads the channel to the end.  Sets the global variable
+ * target to the document or, with -ndjson, calls the function target
+ * evaluates to with each record and its index.
  */
 static int
-CallMethod_Cmd(
+JsonIngest_Cmd(
     ClientData cdata,
     Tcl_Interp *interp,
     int objc,
     Tcl_Obj *const objv[]
 )
 {
-    int i;
-    Tcl_Size list_length;
-    int tableIndex;
-    int int_value;
-    double double_value;
+    struct DuktapeInstanceData *instanceData;
+    struct DuktapeCallOptions opts;
+    struct DuktapeLimitsFrame frame;
+    struct DuktapeIngest ingest;
     duk_context *ctx;
     duk_int_t duk_result;
-    Tcl_Obj *value;
-    Tcl_Obj *type;
-
-    static const char *types[] = {
-        "boolean",
-        "nan",
-        "null",
-        "number",
-        "string",
-        "undefined",
-        (char *)NULL
-    };
-    enum types {
-        TYPE_BOOLEAN,
-        TYPE_NAN,
-        TYPE_NULL,
-        TYPE_NUMBER,
-        TYPE_STRING,
-        TYPE_UNDEFINED
-    };
+    Tcl_Channel chan;
+    Tcl_Obj *chunkObj;
+    Tcl_Size read;
+    const char *target;
+    Tcl_Size targetLength;
+    int i, mode, optionIndex, ndjson, chunkSize, retval;
 
     if (objc < 4) {
-        Tcl_WrongNumArgs(interp, 1, objv, USAGE_CALL_METHOD);
-        return TCL_ERROR;
-    }
-
-    ctx = parse_id(cdata, interp, objv[1], 0);
-    if (ctx == NULL) {
+        Tcl_WrongNumArgs(interp, 1, objv, USAGE_JSON_INGEST);
         return TCL_ERROR;
     }
 
-    /* Eval the function name and "this" to put them on the stack. */
-    for (i = 2; i < 4; i++)
-    {
-        duk_result = duk_peval_string(ctx, Tcl_GetString(objv[i]));
-        if (duk_result != 0) {
-            Tcl_SetObjResult(interp,
-                    Tcl_NewStringObj(
-                        duk_safe_to_string(ctx, -1), -1));
-            duk_pop(ctx);
-            return TCL_ERROR;
-        }
-    }
-
-    /* Push the arguments. */
+    ndjson = 0;
+    chunkSize = INGEST_DEFAULT_CHUNK;
     for (i = 4; i < objc; i++) {
-        if (Tcl_ListObjIndex(interp, objv[i], 0, &value) != TCL_OK) {
-            return TCL_ERROR;
-        }
-
-        if (Tcl_ListObjLength(interp, objv[i], &list_length) != TCL_OK) {
-            return TCL_ERROR;
-        }
-
-        if (list_length == 2) {
-            if (Tcl_ListObjIndex(interp, objv[i], 1, &type) != TCL_OK) {
-                return TCL_ERROR;
-            }
-
-            if (Tcl_GetIndexFromObj(interp, type, types, "type", 0,
-                    &tableIndex) != TCL_OK) {
-                return TCL_ERROR;
-            }
-        } else if (list_length == 1) {
-            tableIndex = TYPE_STRING;
-        } else {
-            Tcl_SetObjResult(interp, Tcl_NewStringObj(ERROR_ARG_LENGTH, -1));
+        if (Tcl_GetIndexFromObj(interp, objv[i], ingestOptions, "option", 0,
+                &optionIndex) != TCL_OK) {
             return TCL_ERROR;
         }
 
-        switch ((enum types) tableIndex) {
-            case TYPE_BOOLEAN:
-                if (Tcl_GetIntFromObj(interp, value, &int_value) != TCL_OK) {
+        switch ((enum ingestOptions) optionIndex) {
+            case INGEST_OPTION_CHUNK:
+                if (i + 1 == objc) {
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_OPTION_VALUE,
+                            Tcl_GetString(objv[i])));
                     return TCL_ERROR;
                 }
-                duk_push_boolean(ctx, int_value);
-                break;
-            case TYPE_NAN:
-                duk_push_nan(ctx);
-                break;
-            case TYPE_NULL:
-                duk_push_null(ctx);
-                break;
-            case TYPE_NUMBER:
-                if (Tcl_GetDoubleFromObj(interp, value,
-                        &double_value) != TCL_OK) {
+                i++;
+                if (Tcl_GetIntFromObj(interp, objv[i], &chunkSize) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if (chunkSize < 1) {
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_POSITIVE,
+                            Tcl_GetString(objv[i])));
                     return TCL_ERROR;
                 }
-                duk_push_number(ctx, double_value);
-                break;
-            case TYPE_UNDEFINED:
-                duk_push_undefined(ctx);
                 break;
-            case TYPE_STRING:
-            default:
-                duk_push_string(ctx, Tcl_GetString(value));
+            case INGEST_OPTION_NDJSON:
+                ndjson = 1;
                 break;
         }
     }
-    duk_result = duk_pcall_method(ctx, objc - 4);
 
-    Tcl_SetObjResult(interp, Tcl_NewStringObj(duk_safe_to_string(ctx, -1), -1));
-    duk_pop(ctx);
+    instanceData = parse_instance(cdata, interp, objv[1], 0);
+    if (instanceData == NULL) {
+        return TCL_ERROR;
+    }
 
-    if (duk_result == 0) {
-        return TCL_OK;
-    } else {
+    chan = Tcl_GetChannel(interp, Tcl_GetString(objv[2]), &mode);
+    if (chan == NULL) {
         return TCL_ERROR;
     }
+    if (!(mode & TCL_READABLE)) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_CHANNEL_READABLE,
+                Tcl_GetString(objv[2])));
+        return TCL_ERROR;
+    }
+
+    ctx = instanceData->ctx;
+    target = Tcl_GetStringFromObj(objv[3], &targetLength);
+
+    /* Hold the channel in case a callback closes it. */
+    Tcl_RegisterChannel(NULL, chan);
+
+    opts.resultType = RESULT_UNDEFINED;
+    opts.timeout = -1;
+    opts.budget = -1;
+    Tclduk_BeginLimits(instanceData, &opts, &frame);
+
+    memset(&ingest, 0, sizeof(ingest));
+    ingest.mode = ndjson ? INGEST_NDJSON : INGEST_START;
+    ingest.base = duk_get_top(ctx);
+    duk_push_dynamic_buffer(ctx, 0);                   /* => [buffer] */
+    if (ndjson) {
+        duk_result = duk_peval_lstring(ctx, target, targetLength);
+                                                       /* => [buffer] [callback] */
+        if (duk_result != 0) {
+            Tcl_SetObjResult(interp,
+                    Tcl_NewStringObj(duk_safe_to_string(ctx, -1), -1));
+            duk_set_top(ctx, ingest.base);             /* => */
+            Tcl_UnregisterChannel(NULL, chan);
+            return Tclduk_EndLimits(interp, instanceData, &frame, TCL_ERROR);
+        }
+        if (!duk_is_callable(ctx, -1)) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(ERROR_NOT_CALLABLE, -1));
+            duk_set_top(ctx, ingest.base);             /* => */
+            Tcl_UnregisterChannel(NULL, chan);
+            return Tclduk_EndLimits(interp, instanceData, &frame, TCL_ERROR);
+        }
+    } else {
+        duk_push_undefined(ctx);                       /* => [buffer] [value] */
+    }
+
+    chunkObj = Tcl_NewObj();
+    Tcl_IncrRefCount(chunkObj);
+    retval = TCL_OK;
+    while (!ingest.eof) {
+        read = Tcl_ReadChars(chan, chunkObj, chunkSize, 0);
+        if (read < 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_READ,
+                    Tcl_GetString(objv[2]), Tcl_PosixError(interp)));
+            retval = TCL_ERROR;
+            break;
+        }
+        ingest.eof = Tcl_Eof(chan);
+        if (read == 0 && !ingest.eof && Tcl_InputBlocked(chan)) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(ERROR_CHANNEL_BLOCKED,
+                    Tcl_GetString(objv[2])));
+            retval = TCL_ERROR;
+            break;
+        }
+
+        ingest.chunk = Tcl_GetStringFromObj(chunkObj, &ingest.chunkLength);
+        duk_result = duk_safe_call(ctx, Tclduk_Ingest, &ingest, 0, 1);
+                                                       /* => [buffer] [value] [undefined|error] */
+        if (duk_result != DUK_EXEC_SUCCESS) {
+            Tcl_SetObjResult(interp,
+                    Tcl_NewStringObj(duk_safe_to_string(ctx, -1), -1));
+            retval = TCL_ERROR;
+        }
+        duk_pop(ctx);                                  /* => [buffer] [value] */
+        if (retval != TCL_OK) {
+            break;
+        }
+    }
+    Tcl_DecrRefCount(chunkObj);
+    Tcl_UnregisterChannel(NULL, chan);
+
+    if (retval == TCL_OK) {
+        if (!ndjson) {
+            duk_dup_top(ctx);                          /* => [buffer] [value] [value] */
+            duk_put_global_lstring(ctx, target, targetLength);
+        }
+        Tcl_SetObjResult(interp, Tcl_NewWideIntObj(ingest.count));
+    }
+    duk_set_top(ctx, ingest.base);                     /* => */
+
+    return Tclduk_EndLimits(interp, instanceData, &frame, retval);
 }
 
 /*
@@ -1357,9 +6881,23 @@ Tclduktape_Init(Tcl_Interp *interp)
     }
 
     duktape_data->counter = 0;
+    duktape_data->boundCounter = 0;
+    memset(&duktape_data->closedStats, 0, sizeof(duktape_data->closedStats));
     Tcl_InitHashTable(&duktape_data->table, TCL_STRING_KEYS);
 
+    Tcl_RegisterObjType(&Tclduk_TokenObjType);
     Tcl_RegisterObjType(&Tclduk_LambdaObjType);
+    Tcl_RegisterObjType(&Tclduk_CompiledObjType);
+    Tcl_RegisterObjType(&Tclduk_TypeObjType);
+
+    tclTypes.intType = Tcl_GetObjType("int");
+    tclTypes.wideIntType = Tcl_GetObjType("wideInt");
+    tclTypes.doubleType = Tcl_GetObjType("double");
+    tclTypes.booleanType = Tcl_GetObjType("boolean");
+    tclTypes.booleanStringType = Tcl_GetObjType("booleanString");
+    tclTypes.byteArrayType = Tcl_GetObjType("bytearray");
+    tclTypes.listType = Tcl_GetObjType("list");
+    tclTypes.dictType = Tcl_GetObjType("dict");
 
     Tcl_CreateObjCommand(
         interp, NS INIT, Init_Cmd, duktape_data, NULL
@@ -1382,9 +6920,54 @@ Tclduktape_Init(Tcl_Interp *interp)
     Tcl_CreateObjCommand(
         interp, NS TCL_FUNCTION, RegisterFunction_Cmd, duktape_data, NULL
     );
+    Tcl_CreateObjCommand(
+        interp, NS TCL_COMMAND, RegisterCommand_Cmd, duktape_data, NULL
+    );
     Tcl_CreateObjCommand(
         interp, NS CALL_METHOD, CallMethod_Cmd, duktape_data, NULL
     );
+    Tcl_CreateObjCommand(
+        interp, NS CALL_BATCH, CallBatch_Cmd, duktape_data, NULL
+    );
+    Tcl_CreateObjCommand(
+        interp, NS COMPILE, Compile_Cmd, duktape_data, NULL
+    );
+    Tcl_CreateObjCommand(
+        interp, NS RUN, Run_Cmd, duktape_data, NULL
+    );
+    Tcl_CreateObjCommand(
+        interp, NS BIND, Bind_Cmd, duktape_data, NULL
+    );
+    Tcl_CreateObjCommand(
+        interp, NS RESET, Reset_Cmd, duktape_data, NULL
+    );
+    Tcl_CreateObjCommand(
+        interp, NS HEAP_STATS, HeapStats_Cmd, duktape_data, NULL
+    );
+    Tcl_CreateObjCommand(
+        interp, NS DUMP_BUNDLE, DumpBundle_Cmd, duktape_data, NULL
+    );
+    Tcl_CreateObjCommand(
+        interp, NS BASELINE, Baseline_Cmd, duktape_data, NULL
+    );
+    Tcl_CreateObjCommand(
+        interp, NS RESTORE_BASELINE, RestoreBaseline_Cmd, duktape_data, NULL
+    );
+    Tcl_CreateObjCommand(
+        interp, NS PARALLEL_MAP, ParallelMap_Cmd, duktape_data, NULL
+    );
+    Tcl_CreateObjCommand(
+        interp, NS DETACH, Detach_Cmd, duktape_data, NULL
+    );
+    Tcl_CreateObjCommand(
+        interp, NS ATTACH, Attach_Cmd, duktape_data, NULL
+    );
+    Tcl_CreateObjCommand(
+        interp, NS JSON, Json_Cmd, duktape_data, NULL
+    );
+    Tcl_CreateObjCommand(
+        interp, NS JSON_INGEST, JsonIngest_Cmd, duktape_data, NULL
+    );
     Tcl_CallWhenDeleted(interp, cleanup_interp, duktape_data);
     Tcl_PkgProvide(interp, PACKAGE, VERSION);
 
@@ -8,29 +8,305 @@ namespace eval ::duktape {}
 
 set ::duktape::types [list num str]
 
-proc ::duktape::call {id function args} {
-    ::duktape::call-method $id $function $function {*}$args
+# Remove the leading "-option value" pairs of call-method from the list in
+# $argsVar and return them.
+proc ::duktape::call-options argsVar {
+    upvar 1 $argsVar arguments
+    set options {}
+    while {[string match -* [lindex $arguments 0]]} {
+        if {[lindex $arguments 0] eq {--}} {
+            set arguments [lrange $arguments 1 end]
+            break
+        }
+        lappend options {*}[lrange $arguments 0 1]
+        set arguments [lrange $arguments 2 end]
+    }
+    return $options
+}
+
+proc ::duktape::call args {
+    set options [call-options args]
+    if {[llength $args] < 2} {
+        error "wrong # args: should be \"::duktape::call ?-option value ...?\
+               ?--? id function ?arg ...?\""
+    }
+    set args [lassign $args id function]
+    ::duktape::call-method {*}$options -- $id $function $function {*}$args
 }
 
 # Generate procs call-num, call-str.
 foreach type $::duktape::types {
-    proc ::duktape::call-method-$type {id function this args} [format {
+    proc ::duktape::call-method-$type args [format {
+        set options [call-options args]
+        if {[llength $args] < 3} {
+            error "wrong # args: should be \"::duktape::call-method-%1$s\
+                   ?-option value ...? ?--? id function this ?arg ...?\""
+        }
         set callArgs {}
-        foreach arg $args {
+        foreach arg [lassign $args id function this] {
             lappend callArgs [list $arg %1$s]
         }
-        ::duktape::call-method $id $function $this {*}$callArgs
+        ::duktape::call-method {*}$options -- $id $function $this {*}$callArgs
     } $type]
 
-    proc ::duktape::call-$type {id function args} [format {
+    proc ::duktape::call-$type args [format {
+        set options [call-options args]
+        if {[llength $args] < 2} {
+            error "wrong # args: should be \"::duktape::call-%1$s\
+                   ?-option value ...? ?--? id function ?arg ...?\""
+        }
         set callArgs {}
-        foreach arg $args {
+        foreach arg [lassign $args id function] {
             lappend callArgs [list $arg %1$s]
         }
-        ::duktape::call $id $function {*}$callArgs
+        ::duktape::call {*}$options -- $id $function {*}$callArgs
     } $type]
 }
 
+# Evaluate the JavaScript file $file. The file is read as UTF-8 and
+# compiled under its own name, so a heap created with -code-cache loads it
+# from the cache when it hasn't changed. The options are those of run.
+proc ::duktape::eval-file {id file args} {
+    set ch [::open $file]
+    fconfigure $ch -encoding utf-8
+    set failed [catch {read $ch} code options]
+    ::close $ch
+    if {$failed} {
+        return -options $options $code
+    }
+    set compiled [::duktape::compile $id $code -filename $file]
+    ::duktape::run $id $compiled {*}$args
+}
+
+# A pool of warm heaps. Every heap of a pool is created with the same init
+# options, runs the pool's -init script and records a baseline. A heap that
+# is checked back in is reset and initialized again or, when asked with
+# -recycle false, restored to that baseline if possible. The baseline only
+# covers the global object, so restoring is only safe for code that doesn't
+# change built-in objects or the objects that global variables refer to.
+namespace eval ::duktape::pool {
+    variable counter 0
+    variable pools
+
+    namespace export checkin checkout create destroy stats
+    namespace ensemble create
+}
+
+proc ::duktape::pool::create args {
+    variable counter
+    variable pools
+
+    if {[llength $args] % 2 == 1} {
+        error "wrong # args: should be \"::duktape::pool create ?-size n?\
+               ?-max n? ?-max-uses n? ?-init script? ?option value ...?\""
+    }
+    set config [dict create size 1 max 0 max-uses 0 init {} options {}]
+    foreach {option value} $args {
+        switch -- $option {
+            -init {
+                dict set config init $value
+            }
+            -max -
+            -max-uses -
+            -size {
+                if {![string is integer -strict $value] || $value < 0} {
+                    error "expected a nonnegative integer but got \"$value\""
+                }
+                dict set config [string range $option 1 end] $value
+            }
+            default {
+                dict lappend config options $option $value
+            }
+        }
+    }
+    if {[dict get $config max] > 0
+            && [dict get $config max] < [dict get $config size]} {
+        error "-max can't be less than -size"
+    }
+
+    set pool pool[incr counter]
+    set pools($pool) [dict merge $config {
+        idle {} busy {} uses {} created 0 closed 0 checkouts 0 restored 0
+        recycled 0
+    }]
+    for {set i 0} {$i < [dict get $config size]} {incr i} {
+        if {[catch {new-heap $pool} id options]} {
+            destroy $pool
+            return -options $options $id
+        }
+        dict lappend pools($pool) idle $id
+    }
+    return $pool
+}
+
+proc ::duktape::pool::checkout pool {
+    variable pools
+
+    set state [get $pool]
+    set idle [dict get $state idle]
+    if {$idle ne {}} {
+        set id [lindex $idle end]
+        dict set pools($pool) idle [lrange $idle 0 end-1]
+    } else {
+        set max [dict get $state max]
+        if {$max > 0 && [llength [dict get $state busy]] >= $max} {
+            error "pool \"$pool\" is exhausted"
+        }
+        set id [new-heap $pool]
+    }
+    dict lappend pools($pool) busy $id
+    dict incr pools($pool) checkouts
+    dict update pools($pool) uses uses {
+        dict incr uses $id
+    }
+    return $id
+}
+
+proc ::duktape::pool::checkin {pool id args} {
+    variable pools
+
+    if {[llength $args] % 2 == 1} {
+        error "wrong # args: should be \"::duktape::pool checkin pool id\
+               ?-recycle bool?\""
+    }
+    set recycle 1
+    foreach {option value} $args {
+        switch -- $option {
+            -recycle {
+                set recycle [expr {!!$value}]
+            }
+            default {
+                error "unknown option \"$option\"; must be -recycle"
+            }
+        }
+    }
+
+    set state [get $pool]
+    set busy [dict get $state busy]
+    set i [lsearch -exact $busy $id]
+    if {$i == -1} {
+        error "heap \"$id\" isn't checked out from pool \"$pool\""
+    }
+    dict set pools($pool) busy [lreplace $busy $i $i]
+
+    # A heap that is running code, for example one checked in by its own
+    # callback, can be neither reset nor closed. It stays checked out.
+    try {
+        recycle $pool $id $recycle
+    } trap {DUKTAPE BUSY} {message options} {
+        dict lappend pools($pool) busy $id
+        return -options $options $message
+    }
+    return
+}
+
+proc ::duktape::pool::recycle {pool id recycle} {
+    variable pools
+
+    set state [get $pool]
+
+    # Shrink the pool back to its size.
+    if {[llength [dict get $state idle]] >= [dict get $state size]} {
+        close-heap $pool $id
+        return
+    }
+
+    set maxUses [dict get $state max-uses]
+    if {$maxUses > 0 && [dict get $state uses $id] >= $maxUses} {
+        set recycle 1
+    }
+    if {!$recycle && [catch {::duktape::restore-baseline $id} restored]} {
+        # The heap has been closed while it was checked out.
+        close-heap $pool $id
+        return
+    }
+    if {$recycle || !$restored} {
+        if {[catch {
+            ::duktape::reset $id
+            initialize $pool $id
+        }]} {
+            close-heap $pool $id
+            return
+        }
+        dict incr pools($pool) recycled
+        dict set pools($pool) uses $id 0
+    } else {
+        dict incr pools($pool) restored
+    }
+
+    dict lappend pools($pool) idle $id
+    return
+}
+
+proc ::duktape::pool::stats pool {
+    set state [get $pool]
+    set stats {}
+    foreach key {size max max-uses} {
+        dict set stats $key [dict get $state $key]
+    }
+    dict set stats idle [llength [dict get $state idle]]
+    dict set stats busy [llength [dict get $state busy]]
+    foreach key {created closed checkouts restored recycled} {
+        dict set stats $key [dict get $state $key]
+    }
+    return $stats
+}
+
+# Close every heap of $pool, including those that are checked out.
+proc ::duktape::pool::destroy pool {
+    variable pools
+
+    set state [get $pool]
+    foreach id [concat [dict get $state idle] [dict get $state busy]] {
+        catch {::duktape::close $id}
+    }
+    unset pools($pool)
+    return
+}
+
+proc ::duktape::pool::get pool {
+    variable pools
+
+    if {![info exists pools($pool)]} {
+        error "pool \"$pool\" doesn't exist"
+    }
+    return $pools($pool)
+}
+
+# Create a heap for $pool and bring it to its baseline.
+proc ::duktape::pool::new-heap pool {
+    variable pools
+
+    set id [::duktape::init {*}[dict get $pools($pool) options]]
+    if {[catch {initialize $pool $id} result options]} {
+        ::duktape::close $id
+        return -options $options $result
+    }
+    dict incr pools($pool) created
+    return $id
+}
+
+proc ::duktape::pool::initialize {pool id} {
+    variable pools
+
+    set script [dict get $pools($pool) init]
+    if {$script ne {}} {
+        ::duktape::eval $id $script
+    }
+    ::duktape::baseline $id
+}
+
+proc ::duktape::pool::close-heap {pool id} {
+    variable pools
+
+    if {[catch {::duktape::close $id} message options]
+            && [dict get $options -errorcode] eq {DUKTAPE BUSY}} {
+        return -options $options $message
+    }
+    dict incr pools($pool) closed
+    dict unset pools($pool) uses $id
+}
+
 # This is used by ::duktape::js-proc.
 proc ::duktape::slugify {text} {
     string trim [regsub -all {[^[:alnum:]]+} [string tolower $text] _] _
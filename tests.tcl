@@ -18,6 +18,9 @@ namespace eval ::duktape::tests {
     tcltest::testConstraint tcloo [expr {
         ![catch { package require TclOO }]
     }]
+    tcltest::testConstraint thread [expr {
+        ![catch { package require Thread }]
+    }]
 
     tcltest::test test1 {init, eval and close} \
             -setup $setup \
@@ -271,6 +274,1303 @@ namespace eval ::duktape::tests {
         return $result
     } -result 10
 
+    tcltest::test test13 {compile and run} -setup $setup -body {
+        set result {}
+        set dt [::duktape::init]
+        set compiled [::duktape::compile $dt {
+            var counter = (typeof counter === 'number' ? counter : 0) + 1;
+            counter * 10;
+        } -filename counter.js]
+        lappend result [::duktape::run $dt $compiled]
+        lappend result [::duktape::run $dt $compiled]
+        # A handle that has lost its internal representation is reloaded
+        # from the bytecode in its string representation.
+        lappend result [::duktape::run $dt [string range $compiled 0 end]]
+        set dt2 [::duktape::init]
+        lappend result [::duktape::run $dt2 $compiled]
+        lappend result [catch {::duktape::compile $dt {1 +}}]
+        lappend result [catch {::duktape::run $dt {not a handle}} err] $err
+        lappend result [catch {
+            ::duktape::run $dt {duktape-bytecode AAAA}
+        } err] $err
+        lappend result [catch {
+            ::duktape::run $dt {duktape-bytecode !!}
+        } err] $err
+        unset compiled
+        ::duktape::close $dt
+        ::duktape::close $dt2
+        return $result
+    } -result [list 10 20 30 10 1 1 {can't parse handle} \
+            1 {can't parse handle} 1 {can't parse handle}]
+
+    tcltest::test test14 {bind} -setup $setup -body {
+        set result {}
+        set dt [::duktape::init]
+        ::duktape::eval $dt {
+            var point = {
+                x: 1,
+                move: function(dx, label) {
+                    this.x += dx;
+                    return {label: label, x: this.x};
+                }
+            };
+        }
+        set move [::duktape::bind $dt point.move point {number string} json]
+        lappend result [$move 2 a]
+        lappend result [$move 0.5 b]
+        lappend result [catch {$move 1} err] \
+                [string equal $err "wrong # args: should be \"$move number string\""]
+        lappend result [catch {::duktape::bind $dt point.x point {}} err] $err
+        ::duktape::close $dt
+        lappend result [info commands $move]
+        return $result
+    } -result [list \
+        {{"label":"a","x":3}} \
+        {{"label":"b","x":3.5}} \
+        1 1 \
+        1 {method is not callable} \
+        {} \
+    ]
+
+    tcltest::test test15 {Stale tokens} -setup $setup -body {
+        set result {}
+        set dt [::duktape::init]
+        # A copy without the cached instance resolves through the table.
+        set copy [string range $dt 0 end]
+        lappend result [::duktape::eval $dt {1 + 1}]
+        lappend result [::duktape::eval $copy {2 + 2}]
+        ::duktape::close $dt
+        lappend result [catch {::duktape::eval $dt {1 + 1}} err] $err
+        lappend result [catch {::duktape::eval $copy {1 + 1}} err] $err
+        lappend result [catch {::duktape::close $dt} err] $err
+        return $result
+    } -result [list 2 4 \
+        1 {can't parse token} 1 {can't parse token} 1 {can't parse token}]
+
+    tcltest::test test16 {Pool allocator and reset} -setup $setup -body {
+        set result {}
+        set dt [::duktape::init -allocator pool -arena 8192 -safe false]
+        lappend result [::duktape::eval $dt {
+            var items = [];
+            for (var i = 0; i < 10000; i++) {
+                items.push({n: i, s: 'item' + i});
+            }
+            items[9999].s + ' ' + new Array(20000).join('x').length;
+        }]
+        set compiled [::duktape::compile $dt {typeof items}]
+        lappend result [::duktape::run $dt $compiled]
+        ::duktape::reset $dt
+        lappend result [::duktape::eval $dt {typeof items}]
+        lappend result [::duktape::run $dt $compiled]
+        lappend result [::duktape::eval $dt {Duktape.tcl.eval('expr', '6 * 7')}]
+        unset compiled
+        ::duktape::tcl-function $dt resetSelf {} [list ::duktape::reset $dt]
+        ::duktape::tcl-function $dt closeSelf {} [list ::duktape::close $dt]
+        ::duktape::tcl-function $dt resetCode {} [format {
+            catch {::duktape::reset %s} err options
+            return [dict get $options -errorcode]
+        } $dt]
+        ::duktape::eval $dt {var kept = 1;}
+        lappend result [catch {::duktape::eval $dt resetSelf()} err] $err
+        lappend result [::duktape::eval $dt resetCode()]
+        lappend result [catch {::duktape::eval $dt closeSelf()} err] $err
+        lappend result [::duktape::eval $dt {kept}]
+        ::duktape::close $dt
+        lappend result [catch {::duktape::init -allocator malloc} err] $err
+        return $result
+    } -result [list {item9999 19999} object undefined undefined 42 \
+        1 {Error: heap is running code} \
+        {DUKTAPE BUSY} \
+        1 {Error: heap is running code} \
+        1 \
+        1 {bad allocator "malloc": must be default or pool}]
+
+    tcltest::test test17 {Native results} -setup $setup -body {
+        set result {}
+        set dt [::duktape::init]
+        set list [::duktape::eval $dt {
+            [1, 2.5, true, 'a b', null, [3, 4]]
+        } -result native]
+        lappend result $list
+        foreach value [::duktape::eval $dt {[7, 0.5]} -result native] {
+            lappend result [lindex [tcl::unsupported::representation \
+                    $value] 3]
+        }
+        lappend result [::duktape::eval $dt {true} -result string]
+        set buffer [::duktape::eval $dt {
+            new Uint8Array([0, 255, 1])
+        } -result native]
+        binary scan $buffer cu* bytes
+        lappend result $bytes
+        lappend result [::duktape::eval $dt {({a: [1]})} -result native]
+        ::duktape::eval $dt {function pair(x) { return [x, x * 2]; }}
+        lappend result [::duktape::call-method -result native \
+                $dt pair null {1.5 number}]
+        lappend result [::duktape::call-num -result native $dt pair 2]
+        lappend result [::duktape::run $dt \
+                [::duktape::compile $dt {pair(3)}] -result native]
+        lappend result [[::duktape::bind $dt pair null number native] 4]
+        lappend result [catch {
+            ::duktape::eval $dt {var o = {}; o.o = o; o} -result native
+        } err] [string match TypeError* $err]
+        lappend result [catch {::duktape::eval $dt {1} -result} err] $err
+        lappend result [catch {::duktape::eval $dt {1} -result xml} err] $err
+        ::duktape::close $dt
+        return $result
+    } -result [list {1 2.5 1 {a b} {} {3 4}} int double true {0 255 1} \
+        {{"a":[1]}} {1.5 3} {2 4} {3 6} {4 8} 1 1 \
+        1 {wrong # args: should be "::duktape::eval token code ?-result type? ?-timeout ms? ?-budget count?"} \
+        1 {bad result type "xml": must be dict, json, native, string, or undefined}]
+
+    tcltest::test test18 {Dict results and arguments} -setup $setup -body {
+        set result {}
+        set dt [::duktape::init]
+        set config [::duktape::eval $dt {
+            ({name: 'x', size: 3, flags: {on: true}, items: [{a: 1}, {b: []}]})
+        } -result dict]
+        lappend result [dict get $config flags on] \
+                [dict get [lindex [dict get $config items] 0] a] \
+                [dict keys $config]
+        lappend result [::duktape::call-method -result dict $dt \
+                {(function(k, v) { var o = {}; o[k] = v; return o; })} null \
+                {{a b} string} {2.5 number}]
+        lappend result [catch {
+            ::duktape::eval $dt {var o = {}; o.o = o; o} -result dict
+        } err] [string match TypeError* $err]
+        ::duktape::close $dt
+
+        set dt [::duktape::init -safe false -eval-args dict]
+        lappend result [::duktape::eval $dt {
+            Duktape.tcl.eval('dict', 'get', {a: {b: 'c'}}, 'a', 'b');
+        }]
+        ::duktape::close $dt
+        lappend result [catch {::duktape::init -eval-args xml} err] $err
+        return $result
+    } -result [list 1 1 {name size flags items} {{a b} 2.5} 1 1 c \
+        1 {bad argument type "xml": must be string, native, or dict}]
+
+    tcltest::test test19 {Dict return types} -setup $setup -body {
+        set result {}
+        set dt [::duktape::init]
+        ::duktape::tcl-function $dt counts {dict integer} {} {
+            dict create a 1 b 2.5
+        }
+        ::duktape::tcl-function $dt request {dict-of {
+            id integer
+            tags {array string}
+            meta {dict boolean}
+        }} {} {
+            dict create id 7 tags {x y} meta {on yes off no} name {a b}
+        }
+        ::duktape::tcl-function $dt rows {list-of-dict double} {} {
+            list {x 1 y 2} {x 3}
+        }
+        ::duktape::tcl-function $dt nested {dict dict array integer} {} {
+            dict create m {a {1 2}}
+        }
+        lappend result [::duktape::eval $dt {JSON.stringify(counts())}]
+        lappend result [::duktape::eval $dt {JSON.stringify(request())}]
+        lappend result [::duktape::eval $dt {JSON.stringify(rows())}]
+        lappend result [::duktape::eval $dt {JSON.stringify(nested())}]
+        lappend result [catch {
+            ::duktape::tcl-function $dt bad {dict-of {a {array foo}}} {} {}
+        } err] $err
+        lappend result [::duktape::eval $dt {typeof bad}]
+        ::duktape::close $dt
+        return $result
+    } -result [list \
+        {{"a":1,"b":2.5}} \
+        {{"id":7,"tags":["x","y"],"meta":{"on":true,"off":false},"name":"a b"}} \
+        {[{"x":1,"y":2},{"x":3}]} \
+        {{"m":{"a":[1,2]}}} \
+        1 {bad type "foo": must be array, auto, bigint, boolean, bytearray,\
+dict, dict-of, double, integer, json, list-of-dict, null, string, or undefined} \
+        undefined \
+    ]
+
+    tcltest::test test20 {Byte arrays and buffers} -setup $setup -body {
+        set result {}
+        set dt [::duktape::init -safe false]
+        set data [binary format cu* {1 2 3 250}]
+        ::duktape::eval $dt {
+            var kept;
+            function sum(buf) {
+                kept = buf;
+                var total = 0;
+                for (var i = 0; i < buf.length; i++) {
+                    total += buf[i];
+                }
+                return total;
+            }
+            function same(buf) {
+                return buf;
+            }
+            function slice(buf) {
+                return new Uint8Array(buf).subarray(1, 3);
+            }
+            function scribble(buf) {
+                buf[0] = 255;
+                return buf[0];
+            }
+        }
+        lappend result [::duktape::call-method $dt sum null \
+                [list $data bytearray]]
+        # The buffer is detached once the call returns.
+        lappend result [::duktape::eval $dt {kept.length}]
+        set same [::duktape::call-method -result native $dt same null \
+                [list $data bytearray]]
+        lappend result [string equal $same $data]
+        binary scan [::duktape::call-method -result native $dt slice null \
+                [list $data bytearray]] cu* bytes
+        lappend result $bytes
+        set sum [::duktape::bind $dt sum null bytearray]
+        lappend result [$sum $data] [$sum {}]
+        ::duktape::tcl-function $dt blob bytearray {} [list return $data]
+        lappend result [::duktape::eval $dt {sum(blob())}]
+        lappend result [::duktape::eval $dt {
+            Duktape.tcl.eval('string', 'length', blob());
+        }]
+        # Writes go to a copy of a shared value.
+        set copy $data
+        lappend result [::duktape::call-method $dt scribble null \
+                [list $data bytearray]]
+        binary scan $data cu bytes
+        lappend result $bytes [string equal $copy $data]
+        # So do writes to a value held by a list that is shared.
+        set tuple [list [binary format cu* {1 2}] bytearray]
+        set text $tuple
+        lappend result [::duktape::call-method $dt scribble null $tuple]
+        binary scan [lindex $tuple 0] cu* bytes
+        lappend result $bytes [string equal $text $tuple]
+        set batch [list [list [binary format cu* {1 2}]]]
+        lappend result [::duktape::call-batch $dt scribble $batch \
+                -types bytearray]
+        binary scan [lindex $batch 0 0] cu* bytes
+        lappend result $bytes
+        # A value that only the call sees is written to in place.
+        set scribble [::duktape::bind $dt scribble null bytearray]
+        lappend result [$scribble [binary format cu* {1 2}]]
+        ::duktape::close $dt
+        return $result
+    } -result [list 256 0 1 {2 3} 256 0 256 4 255 1 1 255 {1 2} 1 255 {1 2} \
+        255]
+
+    tcltest::test test21 {Timeouts and instruction budgets} -setup $setup -body {
+        set result {}
+        set dt [::duktape::init -safe false]
+        lappend result [catch {
+            ::duktape::eval $dt {while (true) {}} -timeout 50
+        } err opts] $err [dict get $opts -errorcode]
+        lappend result [catch {
+            ::duktape::eval $dt {
+                try { while (true) {} } catch (e) { 'caught'; }
+            } -timeout 50
+        } err] $err
+        lappend result [::duktape::eval $dt {1 + 1}]
+        lappend result [catch {
+            ::duktape::eval $dt {for (var i = 0; i < 1e8; i++) {}} -budget 1000
+        } err opts] [dict get $opts -errorcode]
+        lappend result [::duktape::eval $dt {
+            var s = 0;
+            for (var i = 0; i < 10; i++) { s += i; }
+            s;
+        } -budget 1000000 -timeout 1000]
+        ::duktape::eval $dt {function spin() { while (true) {} }}
+        lappend result [catch {
+            ::duktape::call-method -timeout 50 $dt spin null
+        } err] $err
+        # A nested call can't outlive the deadline of the outer one.
+        lappend result [catch {
+            ::duktape::eval $dt "Duktape.tcl.eval('::duktape::eval', '$dt',
+                    'while (true) {}')" -timeout 50
+        } err] [string match *timeout* $err]
+        lappend result [catch {::duktape::eval $dt {1} -timeout -1} err] $err
+        ::duktape::close $dt
+
+        set dt [::duktape::init -timeout 50]
+        set spin [::duktape::bind $dt {(function() { while (true) {} })} null {}]
+        lappend result [catch $spin err] $err
+        lappend result [catch {::duktape::eval $dt {for (;;) {}}} err] $err
+        lappend result [::duktape::eval $dt {'still usable'}]
+        ::duktape::close $dt
+        return $result
+    } -result [list \
+        1 {RangeError: execution timeout} {DUKTAPE TIMEOUT} \
+        1 {RangeError: execution timeout} \
+        2 \
+        1 {DUKTAPE BUDGET} \
+        45 \
+        1 {RangeError: execution timeout} \
+        1 1 \
+        1 {expected a non-negative integer but got "-1"} \
+        1 {RangeError: execution timeout} \
+        1 {RangeError: execution timeout} \
+        {still usable} \
+    ]
+
+    # The same answers are expected with and without --enable-performance
+    # (see "make test-performance").
+    tcltest::test test22 {Integer and JSON edge cases} -setup $setup -body {
+        set result {}
+        set dt [::duktape::init]
+        lappend result [::duktape::eval $dt {0x7fffffff + 1}]
+        lappend result [::duktape::eval $dt {(-0x80000000 - 1) | 0}]
+        lappend result [::duktape::eval $dt {1 / (0 * -1)}]
+        lappend result [::duktape::eval $dt {
+            Math.pow(2, 53) + 1 === Math.pow(2, 53)
+        }]
+        lappend result [::duktape::eval $dt {
+            var n = 1;
+            for (var i = 0; i < 70; i++) { n *= 2; }
+            n;
+        }]
+        lappend result [::duktape::eval $dt {7 / 2}]
+        lappend result [::duktape::eval $dt {
+            [1, 2, 3].reduce(function(a, b) { return a + b; }) / 3
+        } -result native]
+        lappend result [::duktape::eval $dt {
+            JSON.stringify({a: [1, -0, 1.5, 'x\n', null, true],
+                            b: undefined, c: {d: NaN, e: Infinity}})
+        }]
+        lappend result [::duktape::eval $dt {
+            JSON.stringify({n: 1, d: new Date(0), f: function() {}},
+                           null, 1)
+        }]
+        lappend result [::duktape::eval $dt {
+            JSON.stringify([1, {toJSON: function() { return 'x'; }}],
+                           function(k, v) {
+                               return typeof v === 'number' ? v * 2 : v;
+                           })
+        }]
+        ::duktape::close $dt
+        return $result
+    } -result [list \
+        2147483648 \
+        2147483647 \
+        -Infinity \
+        true \
+        1.1805916207174113e+21 \
+        3.5 \
+        2 \
+        {{"a":[1,0,1.5,"x\n",null,true],"c":{"d":null,"e":null}}} \
+        "{\n \"n\": 1,\n \"d\": \"1970-01-01T00:00:00.000Z\"\n}" \
+        {[2,"x"]} \
+    ]
+
+    tcltest::test test23 {Heap allocation counters} -setup $setup -body {
+        set result {}
+        set before [::duktape::heap-stats]
+        foreach allocator {default pool} {
+            set dt [::duktape::init -allocator $allocator -stats true]
+            set stats [::duktape::heap-stats $dt]
+            lappend result [dict keys $stats] \
+                    [expr {[dict get $stats allocations] > 0}]
+            ::duktape::eval $dt {var big = new Array(10000).join('x');}
+            set grown [::duktape::heap-stats $dt]
+            lappend result [expr {
+                [dict get $grown bytes] - [dict get $stats bytes] >= 10000
+            }]
+            ::duktape::close $dt
+        }
+        set after [::duktape::heap-stats]
+        lappend result [expr {
+            [dict get $after bytes] - [dict get $before bytes] >= 20000
+        }]
+        # Heaps don't count by default.
+        foreach allocator {default pool} {
+            set dt [::duktape::init -allocator $allocator]
+            ::duktape::eval $dt {var big = new Array(10000).join('x');}
+            lappend result [::duktape::heap-stats $dt]
+            ::duktape::close $dt
+        }
+        lappend result [catch {::duktape::heap-stats $dt} err] $err
+        lappend result [catch {::duktape::heap-stats a b} err] $err
+        return $result
+    } -result [list \
+        {allocations bytes} 1 1 \
+        {allocations bytes} 1 1 \
+        1 \
+        {allocations 0 bytes 0} {allocations 0 bytes 0} \
+        1 {can't parse token} \
+        1 {wrong # args: should be "::duktape::heap-stats ?token?"} \
+    ]
+
+    tcltest::test test24 {Preloading bytecode bundles} -setup $setup -body {
+        set result {}
+        set bundle [tcltest::makeFile {} test24.bundle]
+        set broken [tcltest::makeFile {not a bundle} test24.broken]
+        set dt [::duktape::init]
+        ::duktape::dump-bundle $dt $bundle {
+            var loads = (typeof loads === 'number' ? loads : 0) + 1;
+            function greet(name) {
+                return 'привет, ' + name;
+            }
+        }
+        lappend result [::duktape::eval $dt {typeof greet}]
+        lappend result [catch {
+            ::duktape::dump-bundle $dt $bundle {function (}
+        } err] [string match SyntaxError* $err]
+        ::duktape::close $dt
+
+        foreach allocator {default pool} {
+            set dt [::duktape::init -preload $bundle -allocator $allocator]
+            lappend result [::duktape::eval $dt {greet('мир') + ' ' + loads}]
+            ::duktape::eval $dt {loads = 10}
+            ::duktape::reset $dt
+            lappend result [::duktape::eval $dt loads]
+            ::duktape::close $dt
+        }
+
+        lappend result [catch {::duktape::init -preload $broken} err] \
+                [string match {*is not a bytecode bundle*} $err]
+        lappend result [catch {
+            ::duktape::init -preload [file join [file dirname $bundle] \
+                    no-such-file]
+        } err]
+
+        set dt [::duktape::init]
+        ::duktape::dump-bundle $dt $bundle {throw new Error('broken library')}
+        ::duktape::close $dt
+        lappend result [catch {::duktape::init -preload $bundle} err] $err
+
+        set dt [::duktape::init]
+        ::duktape::dump-bundle $dt $bundle {while (true) {}}
+        ::duktape::close $dt
+        lappend result [catch {
+            ::duktape::init -preload $bundle -timeout 50
+        } err opts] [dict get $opts -errorcode]
+
+        # A bundle with a valid header whose body is cut short.
+        set ch [open $bundle rb]
+        set contents [read $ch]
+        close $ch
+        set ch [open $bundle wb]
+        puts -nonewline $ch [string range $contents 0 end-20]
+        close $ch
+        lappend result [catch {::duktape::init -preload $bundle} err] \
+                [string match {*is not a bytecode bundle*} $err]
+        return $result
+    } -cleanup {
+        tcltest::removeFile test24.bundle
+        tcltest::removeFile test24.broken
+    } -result [list \
+        undefined \
+        1 1 \
+        {привет, мир 1} 1 \
+        {привет, мир 1} 1 \
+        1 1 \
+        1 \
+        1 {error running preloaded bundle: Error: broken library} \
+        1 {DUKTAPE TIMEOUT} \
+        1 1 \
+    ]
+
+    tcltest::test test25 {Code cache} -setup $setup -body {
+        set result {}
+        set cache [tcltest::makeDirectory test25.cache]
+        set script [tcltest::makeFile {} test25.js]
+        set code {'from source: ' + 'ü'}
+        set ch [open $script w]
+        fconfigure $ch -encoding utf-8
+        puts -nonewline $ch $code
+        close $ch
+
+        set dt [::duktape::init -code-cache $cache]
+        lappend result [::duktape::run $dt [::duktape::compile $dt $code]]
+        set files [glob -directory $cache *]
+        lappend result [llength $files]
+        ::duktape::close $dt
+
+        # Later heaps load the cached bytecode rather than write it again.
+        file mtime [lindex $files 0] 0
+        set dt [::duktape::init -code-cache $cache]
+        lappend result [::duktape::run $dt [::duktape::compile $dt $code]] \
+                [file mtime [lindex $files 0]]
+        ::duktape::close $dt
+
+        # The bytecode of other code under the same name isn't used.
+        set dt [::duktape::init]
+        ::duktape::dump-bundle $dt [lindex $files 0] {'from cache'}
+        ::duktape::close $dt
+        set dt [::duktape::init -code-cache $cache]
+        lappend result [::duktape::run $dt [::duktape::compile $dt $code]]
+
+        # Other names and code miss the cache.
+        lappend result [::duktape::run $dt [::duktape::compile $dt $code \
+                -filename other.js]]
+        lappend result [::duktape::run $dt [::duktape::compile $dt "$code;"]]
+        lappend result [llength [glob -directory $cache *]]
+
+        # A broken file is ignored and replaced.
+        set ch [open [lindex $files 0] w]
+        puts $ch garbage
+        close $ch
+        lappend result [::duktape::run $dt [::duktape::compile $dt $code]]
+        set ch [open [lindex $files 0] rb]
+        set contents [read $ch]
+        close $ch
+        set ch [open [lindex $files 0] wb]
+        puts -nonewline $ch [string range $contents 0 end-20]
+        close $ch
+        lappend result [::duktape::run $dt [::duktape::compile $dt $code]]
+        ::duktape::close $dt
+        set dt [::duktape::init -code-cache $cache]
+        lappend result [::duktape::run $dt [::duktape::compile $dt $code]]
+
+        lappend result [::duktape::eval-file $dt $script]
+        lappend result [llength [glob -directory $cache *]]
+        lappend result [::duktape::eval-file $dt $script]
+        lappend result [llength [glob -directory $cache *]]
+        ::duktape::close $dt
+
+        lappend result [catch {::duktape::init -code-cache $script} err] \
+                [string match {*is not a directory} $err]
+        return $result
+    } -cleanup {
+        tcltest::removeDirectory test25.cache
+        tcltest::removeFile test25.js
+    } -result [list \
+        {from source: ü} 1 \
+        {from source: ü} 0 \
+        {from source: ü} \
+        {from source: ü} {from source: ü} 3 \
+        {from source: ü} {from source: ü} {from source: ü} \
+        {from source: ü} 4 {from source: ü} 4 \
+        1 1 \
+    ]
+
+    tcltest::test test26 {Heap pools} \
+            -setup $setup \
+            -body {
+        set result {}
+
+        set dt [::duktape::init]
+        lappend result [catch {::duktape::restore-baseline $dt} err] $err
+        ::duktape::eval $dt {var lib = {n: 0}; function f() { return 1; }}
+        ::duktape::baseline $dt
+        ::duktape::eval $dt {
+            var added = 1;
+            f = null;
+            delete lib;
+            Object.defineProperty(this, 'hidden', {
+                value: 2,
+                configurable: true
+            });
+        }
+        lappend result [::duktape::restore-baseline $dt]
+        lappend result [::duktape::eval $dt {
+            [typeof added, typeof hidden, f(), lib.n].join(' ')
+        }]
+        ::duktape::eval $dt {Object.defineProperty(this, 'locked', {value: 3})}
+        lappend result [::duktape::restore-baseline $dt]
+        ::duktape::tcl-function $dt restoreSelf {} \
+                [list ::duktape::restore-baseline $dt]
+        lappend result [catch {::duktape::eval $dt restoreSelf()} err] $err
+        ::duktape::close $dt
+
+        set pool [::duktape::pool create -size 2 -max 3 -max-uses 3 \
+                -init {var counter = {n: 0}; function f() { return 1; }}]
+        set dt [::duktape::pool checkout $pool]
+        ::duktape::eval $dt {
+            var leak = 1; f = null; counter.n++; Array.prototype.extra = 1;
+        }
+        ::duktape::pool checkin $pool $dt
+        set dt [::duktape::pool checkout $pool]
+        lappend result [::duktape::eval $dt {
+            [typeof leak, f(), counter.n, typeof [].extra].join(' ')
+        }]
+        # Restoring the baseline only undoes changes to the global object.
+        ::duktape::eval $dt {var leak = 1; f = null; counter.n++}
+        ::duktape::pool checkin $pool $dt -recycle false
+        set dt [::duktape::pool checkout $pool]
+        lappend result [::duktape::eval $dt {
+            [typeof leak, f(), counter.n].join(' ')
+        }]
+        ::duktape::eval $dt {Object.defineProperty(this, 'locked', {value: 3})}
+        ::duktape::pool checkin $pool $dt -recycle false
+        set dt [::duktape::pool checkout $pool]
+        lappend result [::duktape::eval $dt {typeof locked}]
+
+        # A heap stays checked out when code running in it checks it in.
+        ::duktape::tcl-function $dt checkinSelf {} \
+                [list ::duktape::pool checkin $pool $dt]
+        lappend result [catch {::duktape::eval $dt checkinSelf()} err] $err \
+                [dict get [::duktape::pool stats $pool] busy] \
+                [::duktape::eval $dt {typeof locked}]
+
+        set heaps [list $dt [::duktape::pool checkout $pool] \
+                            [::duktape::pool checkout $pool]]
+        lappend result [catch {::duktape::pool checkout $pool} err] $err
+        foreach dt $heaps {
+            ::duktape::pool checkin $pool $dt
+        }
+        lappend result [catch {::duktape::pool checkin $pool $dt} err] \
+                [string match {*isn't checked out*} $err]
+        lappend result [::duktape::pool stats $pool]
+
+        ::duktape::pool destroy $pool
+        lappend result [catch {::duktape::pool stats $pool} err]
+        return $result
+    } -result [list \
+        1 {heap has no baseline} \
+        1 {undefined undefined 1 0} \
+        0 \
+        1 {Error: heap is running code} \
+        {undefined 1 0 undefined} \
+        {undefined 1 1} \
+        undefined \
+        1 {Error: heap is running code} 1 undefined \
+        1 {pool "pool1" is exhausted} \
+        1 1 \
+        {size 2 max 3 max-uses 3 idle 2 busy 0 created 3 closed 1\
+         checkouts 6 restored 1 recycled 4} \
+        1 \
+    ]
+
+    tcltest::test test27 {Parallel map} \
+            -setup $setup \
+            -body {
+        set result {}
+        set items {}
+        for {set i 0} {$i < 1000} {incr i} {
+            lappend items $i
+        }
+        set init {
+            var offset = 1;
+            function square(x) {
+                return x * x + offset;
+            }
+        }
+        set expected {}
+        foreach item $items {
+            lappend expected [expr {$item * $item + 1}]
+        }
+        foreach threads {1 3} {
+            foreach chunk {1 7 1000} {
+                lappend result [expr {
+                    [::duktape::parallel-map -threads $threads -init $init \
+                            square $items -chunk $chunk -result json]
+                    eq $expected
+                }]
+            }
+        }
+        lappend result [expr {
+            [::duktape::parallel-map -init $init square $items] eq $expected
+        }]
+
+        lappend result [::duktape::parallel-map -- \
+                {(function(x) { return {item: x}; })} {a b} -result json]
+        lappend result [::duktape::parallel-map square {}]
+        lappend result [catch {::duktape::parallel-map -threads 2 -chunk 1 {
+            (function(x) {
+                if (x === '7') throw new Error('seven');
+                return x;
+            })
+        } {1 2 3 4 5 6 7 8 9}} err] $err
+        lappend result [catch {::duktape::parallel-map square {1}} err] $err
+        lappend result [catch {
+            ::duktape::parallel-map -threads 0 square {1}
+        } err] $err
+        lappend result [catch {
+            ::duktape::parallel-map square {1} -result native
+        } err] $err
+        return $result
+    } -result [list \
+        1 1 1 1 1 1 \
+        1 \
+        [list {{"item":"a"}} {{"item":"b"}}] \
+        {} \
+        1 {error mapping item 6: Error: seven} \
+        1 {ReferenceError: identifier 'square' undefined} \
+        1 {expected a positive integer but got "0"} \
+        1 {parallel-map can't return native results} \
+    ]
+
+    tcltest::test test28 {Detach and attach heaps} \
+            -setup $setup \
+            -body {
+        set result {}
+        set ::whoami parent
+
+        set dt [::duktape::init -safe false]
+        # The namespace of the function must exist in the child interp.
+        namespace eval :: [list ::duktape::tcl-function $dt whoami {} {
+            set ::whoami
+        }]
+        ::duktape::eval $dt {
+            var warm = 1;
+            function where() {
+                return [warm, whoami(), Duktape.tcl.eval('set', '::whoami')]
+                        .join(' ');
+            }
+        }
+        set bound [::duktape::bind $dt where null {}]
+        set compiled [::duktape::compile $dt warm]
+        set lambda [::duktape::eval $dt {(function() { return warm; })} \
+                -result native]
+        set named [::duktape::eval $dt {(function() { return warm; })} \
+                -result native]
+        string length $named
+        set handle [::duktape::detach $dt]
+        lappend result [string match duktape-detached-* $handle]
+        lappend result [catch {::duktape::eval $dt 1} err] $err
+        lappend result [info commands $bound]
+
+        set child [interp create]
+        $child eval [list lappend ::auto_path {*}$::auto_path]
+        $child eval {
+            package require duktape
+            set ::whoami child
+        }
+        lappend result [$child eval [list apply {handle {
+            set dt [::duktape::attach $handle]
+            set where [::duktape::eval $dt {warm++; where()}]
+            list $where [::duktape::detach $dt]
+        }} $handle]]
+        set handle [lindex $result end 1]
+        lappend result [catch {::duktape::attach $handle-x} err] $err
+
+        set dt [::duktape::attach $handle]
+        interp delete $child
+        lappend result [::duktape::eval $dt where()]
+        # A handle compiled before the heap was detached is reloaded.
+        lappend result [::duktape::run $dt $compiled]
+        unset compiled
+        # Lambdas from before stay with the old token.
+        lappend result [catch {{*}$lambda} err] $err
+        lappend result [catch {{*}$named} err] $err
+        unset lambda named
+        lappend result [catch {::duktape::attach $handle} err] \
+                [string match {no detached heap*} $err]
+
+        ::duktape::tcl-function $dt detachSelf {} [list ::duktape::detach $dt]
+        lappend result [catch {::duktape::eval $dt detachSelf()} err] $err
+        ::duktape::close $dt
+        return $result
+    } -cleanup {
+        unset ::whoami
+    } -match glob -result [list \
+        1 \
+        1 {can't parse token} \
+        {} \
+        {{2 child child} duktape-detached-*} \
+        1 {no detached heap "duktape-detached-*-x"} \
+        {2 parent parent} \
+        2 \
+        1 {can't parse token} \
+        1 {can't parse token} \
+        1 1 \
+        1 {Error: heap is running code} \
+    ]
+
+    tcltest::test test29 {Attach a heap in another thread} \
+            -constraints thread \
+            -setup $setup \
+            -body {
+        set dt [::duktape::init]
+        ::duktape::eval $dt {var counter = 0}
+        set handle [::duktape::detach $dt]
+
+        set thread [thread::create]
+        thread::send $thread [list lappend ::auto_path {*}$::auto_path]
+        set handle [thread::send $thread [list apply {handle {
+            package require duktape
+            set dt [::duktape::attach $handle]
+            ::duktape::eval $dt {counter++}
+            ::duktape::detach $dt
+        }} $handle]]
+        thread::release $thread
+
+        set dt [::duktape::attach $handle]
+        set counter [::duktape::eval $dt counter]
+        ::duktape::close $dt
+        return $counter
+    } -result 1
+
+    tcltest::test test30 {call-batch} \
+            -setup $setup \
+            -body {
+        set result {}
+        set dt [::duktape::init]
+        ::duktape::eval $dt {
+            function add(a, b) {
+                if (a === 13) throw new Error('unlucky');
+                return a + b;
+            }
+            function length(buffer) {
+                return buffer.length;
+            }
+        }
+
+        set tuples {{1 2} {3 4} {5 6}}
+        lappend result [::duktape::call-batch $dt add $tuples]
+        lappend result [::duktape::call-batch $dt add $tuples \
+                -types {number number}]
+        lappend result [::duktape::call-batch $dt add $tuples \
+                -types number -result json]
+        lappend result [::duktape::call-batch $dt add {}]
+        lappend result [::duktape::call-batch $dt length \
+                [list [list [binary format a3 abc]]] -types bytearray]
+
+        lappend result [::duktape::call-batch $dt add {{13 1} {1 1}} \
+                -types {number number} -errors collect]
+        lappend result [catch {
+            ::duktape::call-batch $dt add {{1 1} {13 1} {2 2}} \
+                    -types {number number}
+        } err options] $err [string match {*(call 1 of*} \
+                [dict get $options -errorinfo]]
+        lappend result [catch {
+            ::duktape::call-batch $dt add {{x 1}} -types number
+        } err] $err
+        lappend result [catch {
+            ::duktape::call-batch $dt {(function() { while (true) {} })} \
+                    {{} {}} -budget 1 -errors collect
+        } err options] [dict get $options -errorcode]
+        lappend result [catch {
+            ::duktape::call-batch $dt add $tuples -errors ignore
+        } err] $err
+
+        # A callback that shimmers the tuple list mid-batch.
+        set ::batchTuples [list {1 2} {3 4} {5 6} {7 8}]
+        ::duktape::tcl-function $dt shimmer {a b} {
+            dict size $::batchTuples
+            return [expr {$a * $b}]
+        }
+        lappend result [::duktape::call-batch $dt shimmer $::batchTuples]
+        unset ::batchTuples
+
+        ::duktape::close $dt
+        return $result
+    } -result [list \
+        {12 34 56} \
+        {3 7 11} \
+        {{"12"} {"34"} {"56"}} \
+        {} \
+        3 \
+        {{{} 2} {0 {Error: unlucky}}} \
+        1 {Error: unlucky} 1 \
+        1 {expected floating-point number but got "x"} \
+        1 {DUKTAPE BUDGET} \
+        1 {bad error mode "ignore": must be collect or stop} \
+        {2 12 30 56} \
+    ]
+
+    tcltest::test test31 {JSON documents} -setup $setup -body {
+        set result {}
+        set dt [::duktape::init]
+
+        set doc [::duktape::json parse $dt {
+            {"a": [1, 2, {"x": null}], "b": {"c": "d"}}
+        }]
+        lappend result [::duktape::json get $dt $doc a 1]
+        lappend result [::duktape::json get $dt $doc a 2 x]
+        lappend result [::duktape::json keys $dt $doc]
+        lappend result [::duktape::json keys $dt $doc a]
+        lappend result [::duktape::json exists $dt $doc a 2 x] \
+                [::duktape::json exists $dt $doc a 2 y] \
+                [::duktape::json exists $dt $doc a 1 y]
+
+        ::duktape::json set $dt $doc n m "Hello, world!"
+        ::duktape::json set-json $dt $doc a 0 {[true]}
+        lappend result [::duktape::json stringify $dt $doc]
+        lappend result [::duktape::json stringify $dt $doc b]
+
+        lappend result [catch {::duktape::json get $dt $doc a 1 y} err] $err
+        lappend result [catch {::duktape::json get $dt $doc q} err] $err
+        lappend result [catch {::duktape::json keys $dt $doc b c} err] $err
+        lappend result [catch {::duktape::json set-json $dt $doc {[}} err] $err
+
+        set scalar [::duktape::json parse $dt 5]
+        lappend result [catch {::duktape::json get $dt $scalar a} err] $err
+        ::duktape::json set $dt $scalar a b
+        lappend result [::duktape::json stringify $dt $scalar]
+
+        ::duktape::json destroy $dt $doc
+        lappend result [catch {::duktape::json get $dt $doc a} err] $err
+
+        ::duktape::close $dt
+        return $result
+    } -result [list \
+        2 \
+        null \
+        {a b} \
+        {0 1 2} \
+        1 0 0 \
+        {{"a":[[true],2,{"x":null}],"b":{"c":"d"},"n":{"m":"Hello, world!"}}} \
+        {{"c":"d"}} \
+        1 {key 1 in sequence {a 1 y} isn't an object} \
+        1 {can't access key q} \
+        1 {key c in sequence {b c} isn't an object} \
+        1 {SyntaxError: invalid json (at offset 2)} \
+        1 {JSON document isn't an object} \
+        {{"a":"b"}} \
+        1 {no JSON document "1"} \
+    ]
+
+    tcltest::test test32 {Streaming JSON from a channel} -setup $setup -body {
+        set result {}
+        set file [tcltest::makeFile {} test32.json]
+        set dt [::duktape::init]
+        ::duktape::eval $dt {
+            var records = [];
+            function record(value, i) {
+                records.push([i, value]);
+            }
+        }
+
+        foreach {text options} {
+            " \[1, \"a,\]b\\\"\[\", {\"x\": \[1, {\"y\": \"\}\"}\]}, null\] " {
+                -chunk 3
+            }
+            {[]} {}
+            {{"a": "b"}} {-chunk 1}
+            "{\"a\": 1}\n\n[2]\n3" {-ndjson -chunk 4}
+            {[1, 2} {}
+            {[1, 2] 3} {}
+            "\[1\}" {}
+            {[1,,2]} {}
+            "1\nx\n" {-ndjson}
+        } {
+            set ch [open $file w]
+            puts -nonewline $ch $text
+            close $ch
+
+            set ch [open $file]
+            if {"-ndjson" in $options} {
+                set target record
+            } else {
+                set target data
+            }
+            lappend result [catch {
+                ::duktape::json-ingest $dt $ch $target {*}$options
+            } err] $err
+            close $ch
+            if {$target eq {record}} {
+                lappend result [::duktape::eval $dt {JSON.stringify(records)}]
+            } elseif {$err ne {} && [string is integer $err]} {
+                lappend result [::duktape::eval $dt {JSON.stringify(data)}]
+            }
+        }
+
+        # A record callback that closes the channel being read.
+        set ch [open $file w]
+        puts $ch "1\n2\n3"
+        close $ch
+        set ch [open $file]
+        ::duktape::tcl-function $dt closeChannel {} {
+            close $::ingestChannel
+        }
+        set ::ingestChannel $ch
+        ::duktape::eval $dt {records = [];}
+        lappend result [::duktape::json-ingest $dt $ch {
+            (function (value, i) {
+                if (i === 0) {
+                    closeChannel();
+                }
+                record(value, i);
+            })
+        } -ndjson -chunk 2]
+        lappend result [::duktape::eval $dt {JSON.stringify(records)}]
+        lappend result [expr {$ch in [file channels]}]
+        unset ::ingestChannel
+
+        lappend result [catch {
+            ::duktape::json-ingest $dt stdout data
+        } err] $err
+        lappend result [catch {
+            ::duktape::json-ingest $dt stdin data -chunk 0
+        } err] $err
+        lappend result [catch {
+            ::duktape::json-ingest $dt stdin data -chunk 4294967296
+        } err] $err
+
+        ::duktape::close $dt
+        return $result
+    } -cleanup {
+        tcltest::removeFile test32.json
+    } -result [list \
+        0 4 "\[1,\"a,\]b\\\"\[\",{\"x\":\[1,{\"y\":\"\}\"}\]},null\]" \
+        0 0 {[]} \
+        0 1 {{"a":"b"}} \
+        0 3 {[[0,{"a":1}],[1,[2]],[2,3]]} \
+        1 {SyntaxError: invalid json (unexpected end of input)} \
+        1 {SyntaxError: invalid json (data after the end of the array)} \
+        1 {SyntaxError: invalid json (mismatched brackets)} \
+        1 {SyntaxError: invalid json (at offset 1)} \
+        1 {SyntaxError: invalid json (at offset 1)} \
+        {[[0,{"a":1}],[1,[2]],[2,3],[0,1]]} \
+        3 {[[0,1],[1,2],[2,3]]} 0 \
+        1 {channel "stdout" wasn't opened for reading} \
+        1 {expected a positive integer but got "0"} \
+        1 {integer value too large to represent} \
+    ]
+
+    tcltest::test test33 {Tcl channels in JavaScript} -setup $setup -body {
+        set result {}
+        set file [tcltest::makeFile {} test33.txt]
+        set ch [open $file wb]
+        puts -nonewline $ch "line one\nline two\r\n\xff"
+        close $ch
+
+        set dt [::duktape::init -safe false -stats true]
+        ::duktape::eval $dt {
+            function bytes(buffer) {
+                return Array.prototype.join.call(buffer, ' ');
+            }
+        }
+
+        set ch [open $file]
+        fconfigure $ch -translation binary
+        ::duktape::eval $dt "var c = Duktape.tcl.channel('$ch');"
+        lappend result [expr {[::duktape::eval $dt {c.name}] eq $ch}]
+        lappend result [::duktape::eval $dt {c.gets()}]
+        lappend result [::duktape::eval $dt {bytes(c.read(5)) + ' ' + c.eof()}]
+        lappend result [::duktape::eval $dt {bytes(c.read(100)) + ' ' + c.eof()}]
+        lappend result [::duktape::eval $dt {c.read(1).length + ' ' + c.gets()}]
+        lappend result [catch {::duktape::eval $dt {c.write('x')}} err] \
+                [string match {*wasn't opened for writing} $err]
+        lappend result [catch {::duktape::eval $dt {c.read(-1)}} err] $err
+        close $ch
+        lappend result [catch {::duktape::eval $dt {c.eof()}} err] \
+                [string match {*can not find channel*} $err]
+
+        set ch [open $file w]
+        puts -nonewline $ch "tcl "
+        ::duktape::eval $dt "var o = Duktape.tcl.channel('$ch');"
+        lappend result [::duktape::eval $dt {
+            o.write('js ') + o.write(new Uint8Array([0x41, 0x42]))
+        }]
+        puts $ch " tcl"
+        close $ch
+        set ch [open $file]
+        lappend result [read $ch]
+        close $ch
+
+        # Large reads grow the buffer as data arrives.
+        set ch [open $file wb]
+        puts -nonewline $ch [string repeat x 200000]
+        close $ch
+        set ch [open $file rb]
+        ::duktape::eval $dt "var big = Duktape.tcl.channel('$ch');"
+        set before [dict get [::duktape::heap-stats $dt] bytes]
+        lappend result [::duktape::eval $dt {
+            big.read(150000).length + ' ' + big.read(1e9).length + ' '
+                    + big.eof()
+        }]
+        lappend result [expr {
+            [dict get [::duktape::heap-stats $dt] bytes] - $before < 10000000
+        }]
+        close $ch
+
+        ::duktape::make-safe $dt
+        lappend result [catch {
+            ::duktape::eval $dt {Duktape.tcl.channel('stdin')}
+        } err]
+        ::duktape::close $dt
+        return $result
+    } -cleanup {
+        tcltest::removeFile test33.txt
+    } -result [list \
+        1 \
+        {line one} \
+        {108 105 110 101 32 false} \
+        {116 119 111 13 10 255 true} \
+        {0 null} \
+        1 1 \
+        1 {RangeError: expected a non-negative integer but got "-1"} \
+        1 1 \
+        5 \
+        "tcl js AB tcl\n" \
+        {150000 50000 true} 1 \
+        1 \
+    ]
+
+    tcltest::test test34 {Reusing tcl-function lambdas} -setup $setup -body {
+        set result {}
+        foreach allocator {default pool} {
+            set dt [::duktape::init -allocator $allocator]
+            namespace eval :: [list ::duktape::tcl-function $dt f integer x {
+                expr {$x * 2}
+            }]
+            ::duktape::eval $dt {var old = f; var sum = 0;}
+            lappend result [::duktape::eval $dt {
+                for (var i = 0; i < 100; i++) sum += f(i);
+                sum;
+            }]
+
+            namespace eval :: [list ::duktape::tcl-function $dt f integer x {
+                expr {$x * 3}
+            }]
+            lappend result [::duktape::eval $dt {f(2) + ' ' + old(2)}]
+            ::duktape::eval $dt {delete old; Duktape.gc();}
+            lappend result [::duktape::eval $dt {f(3)}]
+
+            ::duktape::reset $dt
+            lappend result [::duktape::eval $dt {typeof f}]
+            ::duktape::close $dt
+        }
+        return $result
+    } -result [list \
+        9900 {6 4} 9 undefined \
+        9900 {6 4} 9 undefined \
+    ]
+
+    tcltest::test test35 {tcl-command} -setup $setup -body {
+        set id [::duktape::init]
+        proc ::add {a b} {
+            expr {$a + $b}
+        }
+        namespace eval ::duktape::test {
+            proc twice x {
+                expr {$x * 2}
+            }
+        }
+        namespace eval ::duktape::test [list \
+            ::duktape::tcl-command $id twice twice double \
+        ]
+        ::duktape::tcl-command $id add ::add integer
+        ::duktape::tcl-command $id len {string length} integer
+        ::duktape::tcl-command $id llen llength integer native
+        ::duktape::tcl-command $id dget {dict get} string dict
+        set result [list [::duktape::eval $id {
+            [add(1, 2), twice(21), len('abc'), llen([1, 2, 3]),
+                    dget({a: 'x'}, 'a')].join(' ')
+        }]]
+
+        rename ::add ::plus
+        lappend result [::duktape::eval $id {add(2, 3)}]
+        rename ::plus {}
+        lappend result [catch {::duktape::eval $id {add(2, 3)}} err] $err
+        proc ::plus {a b} {
+            expr {$a - $b}
+        }
+        lappend result [::duktape::eval $id {add(2, 3)}]
+        rename ::plus {}
+        namespace delete ::duktape::test
+        ::duktape::tcl-command $id stop break
+        lappend result [catch {::duktape::eval $id {stop()}} err] $err
+
+        lappend result [catch {::duktape::tcl-command $id x nosuch} err] $err
+        lappend result [catch {
+            ::duktape::tcl-command $id x llength string bogus
+        } err] $err
+        ::duktape::close $id
+        return $result
+    } -result [list \
+        {3 42 3 3 x} 5 1 {Error: invalid command name "::plus"} -1 \
+        1 Error \
+        1 {invalid command name "nosuch"} \
+        1 {bad argument type "bogus": must be string, native, or dict} \
+    ]
+
+    tcltest::test test36 {Duktape.tcl.call} -setup $setup -body {
+        set id [::duktape::init -safe false -eval-args native]
+        proc ::duktape::test-record {} {
+            dict create id [expr {6 * 7}] ratio [expr {1 / 4.0}] \
+                    tags [list a [expr {1 + 1}]] data [binary format a2 hi] \
+                    name plain
+        }
+        ::duktape::tcl-function $id record auto {} {
+            ::duktape::test-record
+        }
+        set result [list [::duktape::eval $id {
+            var r = Duktape.tcl.call('::duktape::test-record');
+            JSON.stringify([r.id, r.ratio, r.tags, r.name, typeof r.data,
+                    r.data.length + ':' + r.data[0], typeof Duktape.tcl.call('expr', '2**80'),
+                    Duktape.tcl.call('list', 1, 2.5)]);
+        }]]
+        lappend result [::duktape::eval $id {
+            JSON.stringify([
+                Duktape.tcl.callAs('string', 'expr', '1 + 2'),
+                Duktape.tcl.callAs('dict-of {id integer}',
+                        '::duktape::test-record').id,
+                record().tags
+            ]);
+        }]
+        lappend result [catch {::duktape::eval $id {
+            Duktape.tcl.callAs('bogus', 'list');
+        }} err] [string range $err 0 27]
+        lappend result [catch {::duktape::eval $id {
+            Duktape.tcl.call();
+        }} err] $err
+        lappend result [catch {::duktape::eval $id {
+            Duktape.tcl.call('error', 'oops');
+        }} err] $err
+        lappend result [catch {::duktape::eval $id {
+            Duktape.tcl.call('break');
+        }} err] $err
+        lappend result [catch {::duktape::eval $id {
+            Duktape.tcl.call('return', '-code', 'continue', 'skipped');
+        }} err] $err
+        rename ::duktape::test-record {}
+        ::duktape::close $id
+        return $result
+    } -result [list \
+        {[42,0.25,["a",2],"plain","object","2:104","string",[1,2.5]]} \
+        {["3",42,["a",2]]} \
+        1 {TypeError: bad type "bogus":} \
+        1 {TypeError: no command to call} \
+        1 {Error: oops} \
+        1 Error \
+        1 {Error: skipped} \
+    ]
+
+    tcltest::test test37 {Freeing lambdas} -setup $setup -body {
+        set dt [::duktape::init]
+        ::duktape::eval $dt {
+            var finalized = 0;
+            function onFinalize() {
+                finalized++;
+            }
+            function counted(factor) {
+                var f = function(x) { return x * factor; };
+                Duktape.fin(f, onFinalize);
+                return f;
+            }
+            function collect() {
+                Duktape.gc();
+                Duktape.gc();
+                return finalized;
+            }
+        }
+        set result {}
+
+        # Lambdas that never got a string rep are released with the Tcl_Obj.
+        set lambdas [::duktape::eval $dt {
+            [counted(2), counted(3), counted(4)]
+        } -result native]
+        lappend result [{*}[lindex $lambdas 0] 21]
+        unset lambdas
+        lappend result [::duktape::eval $dt collect()]
+
+        # The one called by its string rep waits for the next export.
+        set lambda [::duktape::eval $dt {counted(5)} -result native]
+        lappend result [::duktape::eval $dt collect()]
+        set copy [string range $lambda 0 end]
+        unset lambda
+        lappend result [{*}$copy 2] [::duktape::eval $dt collect()]
+
+        ::duktape::eval $dt {counted(6)} -result native
+        lappend result [::duktape::eval $dt collect()]
+        lappend result [catch {{*}$copy 2} err] $err
+
+        # Throwing a value that isn't an Error is still an error.
+        set thrower [::duktape::eval $dt {
+            (function() { throw 'bad'; })
+        } -result native]
+        lappend result [catch {{*}$thrower} err] $err
+        lappend result [catch {
+            ::duktape::eval-lambda $dt AAAAAAAA lambda_x
+        } err] $err
+
+        ::duktape::close $dt
+        return $result
+    } -result [list \
+        42 2 3 10 3 5 1 {ReferenceError: identifier 'factor' undefined} \
+        1 bad \
+        1 {lambda refers to a function that is gone} \
+    ]
+
     tcltest::cleanupTests
     # Exit with nonzero status if there are failed tests.
     if {$::tcltest::numTests(Failed) > 0} {